@@ -62,11 +62,11 @@ module.exports = (function(){
 		];
 		
 		/**
-		 * Adds a callback handler for web requests, which is called any time a web browser asks
-		 * for a file or information. By using this we can obtain information about what the
-		 * browser wants and customise our future output accordingly.
+		 * Adds a route for web requests, which is called any time a web browser asks for a file
+		 * or information the native routes didn't answer. By using this we can obtain information
+		 * about what the browser wants and customise our future output accordingly.
 		**/
-		web.listen(function(request){
+		web.route('*', '/*path', function(request){
 			// Check if there exists a static file in the web directory for the requested URI
 			if (web.isStaticFile(request.uri)) {
 				// Use web.createStaticResponse to return the static file to the web browser
@@ -33,6 +33,41 @@ module.exports = (function(){
 			max_width:'1100',
 		}
 	});
+	/**
+	 * Scripts and stylesheets are served as bundles, one file per list, named by a hash of the content.
+	 * web.bundle() returns the current URL of a bundle, building it again only once a source changes,
+	 * so the page asks for it on each render and browsers never have to revalidate it.
+	**/
+	var bundles = {
+		css: function(){
+			return web.bundle('page', [
+				//'/css/fonts.css',
+				/**
+				 * web.TemplateFile objects have a 'cacheFile' method which will output a
+				 * managed cache file and return the resulting path in the web directory.
+				 * Given a prefix and suffix, it concatenates them to a randomly generated
+				 * hash for a unique file path. Each worker runs this script, so the
+				 * stylesheet gets a fixed path instead and every worker lists the same
+				 * sources, or the bundle would be rebuilt whenever the worker changes.
+				**/
+				stylesheetFile,
+				'/css/jquery/jquery-ui.min.css',
+				'/css/jquery/jquery-ui.theme.min.css'
+			]);
+		},
+		javascript: function(){
+			return web.bundle('page', [
+				'/javascript/jquery/jquery.min.js',
+				'/javascript/jquery/jquery-ui.min.js',
+				'/javascript/imagesloaded.min.js',
+				'/javascript/spin.min.js',
+				'/javascript/iziModal.min.js',
+				'/javascript/app.js',
+				'/javascript/common.js'
+			]);
+		}
+	};
+	var stylesheetFile = stylesheet.cacheFile("css/page.css");
 	var template = new web.TemplateFile('system/template/html/page.html', {
 		/**
 		 * Variables, such as this one, the title of the webpage, may need to
@@ -86,18 +121,7 @@ module.exports = (function(){
 			css:new web.TemplateFile('system/template/html/page/css.html', {
 				blocks: {
 					stylesheet: {
-						vars:[
-							//{source: '/css/fonts.css'},
-							/**
-							 * web.TemplateFile objects have a 'cacheFile' method which will output a
-							 * managed cache file and return the resulting path in the web directory.
-							 * The two strings provided specify the file path prefix and suffix, which
-							 * is concatenated to a randomly generated hash for a unique file path.
-							**/
-							{source: stylesheet.cacheFile("css/", ".css")},
-							{source: '/css/jquery/jquery-ui.min.css'},
-							{source: '/css/jquery/jquery-ui.theme.min.css'}
-						]
+						vars:{source: bundles.css()}
 					}
 				}
 			}),
@@ -114,15 +138,7 @@ module.exports = (function(){
 				]
 			}),
 			javascript:new web.TemplateFile('system/template/html/page/javascript.html', {
-				vars: [
-					{source:"/javascript/jquery/jquery.min.js"},
-					{source:"/javascript/jquery/jquery-ui.min.js"},
-					{source:"/javascript/imagesloaded.min.js"},
-					{source:"/javascript/spin.min.js"},
-					{source:"/javascript/iziModal.min.js"},
-					{source:"/javascript/app.js"},
-					{source:"/javascript/common.js"}
-				]
+				vars: {source: bundles.javascript()}
 			})
 		}
 	});
@@ -170,21 +186,42 @@ module.exports = (function(){
 	controller.Updater = Updater;
 
 	controller.navigation = [];
-	controller.updates = [];
 
-	function Updater(selector) {
+	/**
+	 * Updates an element of the page after the response was sent
+	 * Changes are pushed to the session's event streams, clients without one poll /updates for them
+	 * Without a request there is no session to push to, so the update is only polled for, by any session
+	 * @param 	{string} selector	the element to update
+	 * @param 	{web.Request} request	the request of the page, pass it for content meant for one user
+	**/
+	function Updater(selector, request) {
 		var self = this;
 		this.selector = selector;
+		this.session = request && request.session ? request.session.id : null;
 		this.content = '';
 		this.is_complete = false;
-		controller.updates.push(this);
+		// held natively rather than in this context, so a poll served by any worker finds it
+		this.id = web.openUpdate(this.session, selector);
+		function push() {
+			// a null session would reach every open stream
+			if (!self.session) return 0;
+			return web.push(self.session, 'update', {
+				selector:self.selector,
+				content:self.content,
+				complete:self.is_complete
+			});
+		}
 		return {
 			update:function(content){
 				self.content = content;
+				push();
+				web.setUpdate(self.id, self.content, false, false);
 			},
 			complete:function(content){
-				if (content) this.update(content);
+				if (content) self.content = content;
 				self.is_complete = true;
+				// once a stream has it, nobody needs to poll for it
+				web.setUpdate(self.id, self.content, true, push() > 0);
 			}
 		};
 	}
@@ -289,31 +326,11 @@ module.exports = (function(){
 	};
 
 	controller._getUpdates = function(request) {
-		var updates = [];
-		var remaining = [];
-		for (var i=0; i<this.updates.length; ++i) {
-			var u = this.updates[i];
-			updates.push({
-				selector:u.selector,
-				content:u.content,
-				complete:u.is_complete
-			});
-			if (!u.is_complete)
-				remaining.push(u);
-		}
-		this.updates = remaining;
-		return updates;
+		return web.collectUpdates(request.session ? request.session.id : null);
 	};
-	controller._prepareUpdates = function(){
-		var updates = [];
-		for (var i=0; i<this.updates.length; ++i) {
-			var u = this.updates[i];
-			updates.push({
-				selector:u.selector,
-				complete:u.is_complete
-			});
-		}
-		return updates;
+	controller._prepareUpdates = function(request){
+		// pushed updates are listed once so the page knows to expect them
+		return web.prepareUpdates(request.session ? request.session.id : null);
 	};
 	controller._getPageResponse = function(request) {
 		// Re-cache the stylesheet
@@ -323,10 +340,14 @@ module.exports = (function(){
 		else
 			template.css.stylesheet.vars.source = stylesheet.cacheFile("css/", ".css");
 		print(template.css.stylesheet.vars.source);*/
+
+		// A bundle whose sources changed was rebuilt under a new URL, so point the page at the current ones
+		this.template.css.stylesheet.vars.source = bundles.css();
+		this.template.javascript.vars.source = bundles.javascript();
 		
 		// Add an 'is_ajax' boolean property for convenience, the following conditions verify the request was sent via AJAX
-		request.is_ajax = typeof(request.headers['X-Requested-With']) !== 'undefined' &&
-						  request.headers['X-Requested-With'].toLowerCase() == 'xmlhttprequest';
+		// request.header() looks the one value up rather than building request.headers
+		request.is_ajax = request.header('X-Requested-With').toLowerCase() == 'xmlhttprequest';
 		request.is_post = request.method.toLowerCase == "post";
 		var ajax = request.is_ajax;
 		
@@ -339,20 +360,13 @@ module.exports = (function(){
 		if (arr.length && !arr[0]) arr.shift();
 		
 		// Check there is more to the URI path and if the first part is 'page' (/page/page_id/etc...), check for a matching page
-		if (arr.length >= 1) {
-			if (arr.length > 1 && arr[0] == 'page') {
-				// Attempt to get a page using the second part of the URI path as a page ID
-				if (this.loadPage(arr[1])) {
-					page = this.getPage(arr[1]);
-					page_request = true;
-				}
-			}
-			// If the first part of the URI is 'update', return any updates for the page
-			else if (arr[0] == 'update' && ajax) {
-				return {update: this._prepareUpdates()};
+		// polls of /update and /updates never get here, they are answered natively, see Web::init_module
+		if (arr.length > 1 && arr[0] == 'page') {
+			// Attempt to get a page using the second part of the URI path as a page ID
+			if (this.loadPage(arr[1])) {
+				page = this.getPage(arr[1]);
+				page_request = true;
 			}
-			else if (arr[0] == 'updates' && ajax)
-				return {updates: this._getUpdates(request)};
 		}
 		
 		if (!page) {
@@ -387,7 +401,7 @@ module.exports = (function(){
 					if (page.module && typeof(page.module.onRequest) === 'function') {
 						// If the handler returns a value, use it as the response
 						res = page.module.onRequest(request, template);
-						if (typeof(res) !== 'undefined') return Object.assign(res, {'update': this._prepareUpdates()});
+						if (typeof(res) !== 'undefined') return Object.assign(res, {'update': this._prepareUpdates(request)});
 					}
 					template.opts.url = page.url;
 					template.opts.title = page.title;
@@ -398,7 +412,7 @@ module.exports = (function(){
 					if (!ajax)
 						return template;
 					return {
-						update: this._prepareUpdates(),
+						update: this._prepareUpdates(request),
 						opts: template.opts,
 						content: template.render()
 					};
@@ -408,7 +422,7 @@ module.exports = (function(){
 				// If the page has a module with an 'onRequest' handler, call it for the response, or return a blank one
 				if (page.module && typeof(page.module.onRequest) === 'function') {
 					res = page.module.onRequest(request);
-					if (typeof(res) !== 'undefined') return Object.assign(res, {'update': this._prepareUpdates()});
+					if (typeof(res) !== 'undefined') return Object.assign(res, {'update': this._prepareUpdates(request)});
 				}
 				return '';
 			}
@@ -418,14 +432,14 @@ module.exports = (function(){
 			// If there is a module, let it do its magic on the template block
 			res = page.module.onRequest(request, this.template.body.content);
 			// If the module returned something, it will be a response we can return
-			if (typeof(res) !== 'undefined') return Object.assign(res, {'update': this._prepareUpdates()});
+			if (typeof(res) !== 'undefined') return Object.assign(res, {'update': this._prepareUpdates(request)});
 		}
 		this.template.opts.url = page.url;
 		this.template.opts.title = page.title;
 		this.template.opts.path = this.template.path;
 		if (ajax) {
 			return {
-				update: this._prepareUpdates(),
+				update: this._prepareUpdates(request),
 				opts: this.template.opts,
 				content: this.template.body.render()
 			};
@@ -440,10 +454,7 @@ module.exports = (function(){
 	 * @param string	The contents to update the DOM element with
 	**/
 	controller.update = function(selector, content) {
-		this.updates.push({
-			selector: selector,
-			content: content
-		});
+		web.openUpdate(null, selector, content);
 	};
 
 	/**
@@ -462,17 +473,17 @@ module.exports = (function(){
 	 * web.Controller prototype has an 'onRenderBlock' method which can be overriden with a
 	 * function, as below. The function is passed the block being rendered within the template.
 	 * The block can be modified here in order to alter variables and blocks dynamically.
+	 * While it's defined, blocks with the 'cache' option are rendered in full on every request,
+	 * so the page doesn't define it until it's needed.
 	 * @this {web.Controller}
 	 * @param {web.TemplateBlock} block	- the template block about to be rendered
 	**/
-	controller.onRenderBlock = function(block){
-		/**
-		 * The block 'path' variable allows us to identify the template block
-		**/
-		if (block.path == "body") {
-			//print(block);
-		}
-	};
+	//controller.onRenderBlock = function(block){
+	//	// The block 'path' variable allows us to identify the template block
+	//	if (block.path == "body") {
+	//		print(block);
+	//	}
+	//};
 	
 	// Return the controller object which may be used by caller to generate the page by returning it in web.listen()
 	return controller;
@@ -29,7 +29,7 @@ module.exports = function(page, controller){
 			setupCategoryPanel(block.setup.video_categories, block);
 			/*var opts = block.opts;
 			var req = net.get('https://google.com');
-			var updater = new controller.Updater('.block_content');
+			var updater = new controller.Updater('.block_content', request);
 			req.done(function(data, response){
 				var $ = parser.load(data);
 				var items = [];
@@ -164,6 +164,8 @@ var app = {
 		return success;
 	},
 	updaters:{},
+	// pushed updates which arrived before the page expecting them
+	pushed_updates:{},
 	update_ui:function(o, ui){
 		var updates = typeof(ui.update) !== 'undefined' ? ui.update : [];
 		if (updates.length) {
@@ -173,9 +175,34 @@ var app = {
 				if (typeof(update.selector) !== 'undefined' && update.selector)
 					o = $(update.selector);
 				this.updaters[update.selector] = o;
+				if (update.selector in this.pushed_updates) {
+					this.apply_update(this.pushed_updates[update.selector]);
+					delete this.pushed_updates[update.selector];
+				}
 			}
 		}
 	},
+	apply_update:function(update){
+		if (typeof(update.content) === 'undefined') return;
+		if (update.selector in this.updaters) {
+			this.updaters[update.selector].html(update.content);
+			if (update.complete)
+				delete this.updaters[update.selector];
+		}
+		else this.pushed_updates[update.selector] = update;
+	},
+	listen_updates:function(){
+		var self = this;
+		// the server pushes updates as they happen, polling is only needed without EventSource
+		if (typeof(window.EventSource) === 'undefined') {
+			setTimeout((function(){ return function(){ self.update_page.call(self); }; })(), 100);
+			return;
+		}
+		var source = new EventSource('/events');
+		source.addEventListener('update', function(e){
+			self.apply_update(JSON.parse(e.data));
+		});
+	},
 	update_page:function(){
 		var self = this;
 		if (Object.keys(this.updaters).length) {
@@ -188,12 +215,8 @@ var app = {
 			}).done(function(data){
 				if (typeof(data.updates) !== 'undefined') {
 					for (var i=0; i<data.updates.length; ++i) {
-						if (typeof(data.updates[i].content) === 'undefined') continue;
-						if (data.updates[i].selector in self.updaters) {
-							self.updaters[data.updates[i].selector].html(data.updates[i].content);
-							if (data.updates[i].complete)
-								delete self.updaters[data.updates[i].selector];
-						}
+						if (data.updates[i].selector in self.updaters)
+							self.apply_update(data.updates[i]);
 					}
 				}
 			});
@@ -202,6 +225,7 @@ var app = {
 	},
 	reset_page:function(){
 		this.updaters = {};
+		this.pushed_updates = {};
 		if (Object.keys(this.refresh_interval).length) {
 			for (var k in this.refresh_interval) {
 				clearInterval(this.refresh_interval[k]);
@@ -451,8 +475,7 @@ var app = {
 			return false;
 		});
 		this.updater(this.base_element);
-		var self = this;
-		setTimeout((function(){ return function(){ self.update_page.call(self); }; })(), 100);
+		this.listen_updates();
 	},
 	doSetup:function(){
 		alert('hi');
@@ -0,0 +1,136 @@
+#include "stdinc.h"
+#include <cmath>
+#include "admission.h"
+
+using namespace iTease;
+
+struct BudgetRate {
+	// tokens per second, and how many may be saved up for bursts
+	double rate;
+	double burst;
+};
+
+// a cold page load fetches a few dozen assets, dynamic requests are far fewer
+static const BudgetRate budget_rates[] = {
+	{100.0, 400.0},		// Static
+	{50.0, 100.0},		// Session
+	{20.0, 40.0}		// Anonymous
+};
+constexpr double MinLimit = 4;
+constexpr double InitialLimit = 16;
+// anonymous requests may only take this share of the limit, keeping room for signed in users
+constexpr double AnonymousShare = 0.75;
+// smoothing of latency samples, the long term average is the baseline the short term one is compared to
+constexpr double ShortLatencyWeight = 0.2;
+constexpr double LongLatencyWeight = 0.01;
+// how far the limit moves toward its new estimate on each sample
+constexpr double LimitSmoothing = 0.2;
+// idle buckets have refilled, so they're dropped
+constexpr auto BucketIdleTime = std::chrono::seconds(60);
+constexpr auto SweepInterval = std::chrono::seconds(10);
+constexpr auto ShedRetryAfter = std::chrono::seconds(1);
+
+AdmissionControl::Ticket::Ticket(Ticket&& other) : m_control(other.m_control), m_budget(other.m_budget), m_start(other.m_start) {
+	other.m_control = nullptr;
+}
+auto AdmissionControl::Ticket::operator=(Ticket&& other)->Ticket& {
+	if (this != &other) {
+		release(false);
+		m_control = other.m_control;
+		m_budget = other.m_budget;
+		m_start = other.m_start;
+		other.m_control = nullptr;
+	}
+	return *this;
+}
+AdmissionControl::Ticket::~Ticket() {
+	release(false);
+}
+auto AdmissionControl::Ticket::release(bool sample)->void {
+	if (!m_control) return;
+	m_control->release(m_budget, Clock::now() - m_start, sample);
+	m_control = nullptr;
+}
+
+AdmissionControl::AdmissionControl(size_t maxConcurrency) :
+	m_maxLimit(std::max(MinLimit, static_cast<double>(maxConcurrency))),
+	m_limit(std::min(InitialLimit, std::max(MinLimit, static_cast<double>(maxConcurrency))))
+{ }
+auto AdmissionControl::admit(string_view client, Budget budget)->optional<std::chrono::seconds> {
+	return take_token(client, budget, Clock::now());
+}
+auto AdmissionControl::enter(Budget budget, Ticket& ticket)->optional<std::chrono::seconds> {
+	// static files are served natively and quickly, the rate limit is their only budget
+	if (budget == Budget::Static)
+		return std::nullopt;
+
+	auto limit = m_limit.load();
+	if (m_inflight.fetch_add(1) + 1 > limit) {
+		m_inflight.fetch_sub(1);
+		return ShedRetryAfter;
+	}
+	if (budget == Budget::Anonymous && m_anonymousInflight.fetch_add(1) + 1 > limit * AnonymousShare) {
+		m_anonymousInflight.fetch_sub(1);
+		m_inflight.fetch_sub(1);
+		return ShedRetryAfter;
+	}
+	ticket.release(false);
+	ticket.m_control = this;
+	ticket.m_budget = budget;
+	ticket.m_start = Clock::now();
+	return std::nullopt;
+}
+auto AdmissionControl::take_token(string_view client, Budget budget, Clock::time_point now)->optional<std::chrono::seconds> {
+	auto& rate = budget_rates[static_cast<int>(budget)];
+	string key;
+	key.reserve(client.size() + 1);
+	key += static_cast<char>('0' + static_cast<int>(budget));
+	key.append(client);
+	auto& shard = m_shards[std::hash<string>{}(key) % NumShards];
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	if (now - shard.swept > SweepInterval) {
+		for (auto it = shard.buckets.begin(); it != shard.buckets.end(); ) {
+			if (now - it->second.updated > BucketIdleTime) it = shard.buckets.erase(it);
+			else ++it;
+		}
+		shard.swept = now;
+	}
+	auto it = shard.buckets.find(key);
+	if (it == shard.buckets.end())
+		it = shard.buckets.emplace(std::move(key), Bucket{rate.burst, now}).first;
+	auto& bucket = it->second;
+	auto elapsed = std::chrono::duration<double>(now - bucket.updated).count();
+	bucket.tokens = std::min(rate.burst, bucket.tokens + elapsed * rate.rate);
+	bucket.updated = now;
+	if (bucket.tokens < 1.0) {
+		// time until the next token, rounded up to the whole seconds of Retry-After
+		auto wait = std::ceil((1.0 - bucket.tokens) / rate.rate);
+		return std::chrono::seconds(std::max<long long>(1, static_cast<long long>(wait)));
+	}
+	bucket.tokens -= 1.0;
+	return std::nullopt;
+}
+auto AdmissionControl::release(Budget budget, Clock::duration latency, bool sample)->void {
+	if (budget == Budget::Anonymous)
+		m_anonymousInflight.fetch_sub(1);
+	m_inflight.fetch_sub(1);
+	if (!sample)
+		return;
+
+	// the limit follows the ratio of baseline to recent latency: it shrinks as handlers slow down under load,
+	// and grows by roughly its square root while they keep up, so queueing stays short
+	auto seconds = std::chrono::duration<double>(latency).count();
+	std::lock_guard<std::mutex> lock(m_latencyMutex);
+	if (m_longLatency == 0) {
+		m_shortLatency = m_longLatency = seconds;
+		return;
+	}
+	m_shortLatency += (seconds - m_shortLatency) * ShortLatencyWeight;
+	m_longLatency += (seconds - m_longLatency) * LongLatencyWeight;
+	auto gradient = std::max(0.5, std::min(1.0, m_longLatency / std::max(m_shortLatency, 1e-6)));
+	auto limit = m_limit.load();
+	auto estimate = limit * gradient + std::sqrt(limit);
+	limit += (estimate - limit) * LimitSmoothing;
+	m_limit = std::max(MinLimit, std::min(m_maxLimit, limit));
+}
\ No newline at end of file
@@ -0,0 +1,84 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include "common.h"
+
+namespace iTease {
+	/**
+	 * AdmissionControl - decides whether a request is served or shed before its handler does any work for it
+	 * Each client has a token bucket per budget checked as the request arrives, and dynamic requests share a concurrency limit adapted to handler latency
+	**/
+	class AdmissionControl {
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		enum class Budget : int {
+			// files under web/, cheap and plentiful on page loads
+			Static,
+			// requests of sessions with a signed in user
+			Session,
+			Anonymous
+		};
+
+		/**
+		 * Ticket - holds a dynamic request's place under the concurrency limit until released
+		**/
+		class Ticket {
+			friend class AdmissionControl;
+
+		public:
+			Ticket() = default;
+			Ticket(Ticket&&);
+			auto operator=(Ticket&&)->Ticket&;
+			~Ticket();
+
+			// frees the place, sampling the time since it was taken as handler latency if told to
+			auto release(bool sample = true)->void;
+
+		private:
+			AdmissionControl* m_control = nullptr;
+			Budget m_budget = Budget::Static;
+			Clock::time_point m_start;
+		};
+
+	public:
+		AdmissionControl(size_t maxConcurrency);
+		AdmissionControl(const AdmissionControl&) = delete;
+		auto operator=(const AdmissionControl&)->AdmissionControl& = delete;
+
+		// admits a request of the client (any stable key, e.g. its address) by its rate, returns how long it should wait if it's shed
+		auto admit(string_view client, Budget)->optional<std::chrono::seconds>;
+		// takes a place under the concurrency limit for an admitted request about to be handled, returns how long to wait if there is none
+		auto enter(Budget, Ticket&)->optional<std::chrono::seconds>;
+		// current concurrency limit of dynamic requests
+		auto limit() const { return static_cast<size_t>(m_limit.load()); }
+
+	private:
+		struct Bucket {
+			double tokens;
+			Clock::time_point updated;
+		};
+		struct Shard {
+			std::mutex mutex;
+			unordered_map<string, Bucket> buckets;
+			Clock::time_point swept;
+		};
+		static constexpr size_t NumShards = 16;
+
+		auto take_token(string_view client, Budget, Clock::time_point now)->optional<std::chrono::seconds>;
+		auto release(Budget, Clock::duration latency, bool sample)->void;
+
+	private:
+		std::array<Shard, NumShards> m_shards;
+		const double m_maxLimit;
+		std::atomic<double> m_limit;
+		std::atomic<int> m_inflight{0};
+		std::atomic<int> m_anonymousInflight{0};
+		std::mutex m_latencyMutex;
+		// smoothed handler latency over the short and long term, in seconds
+		double m_shortLatency = 0;
+		double m_longLatency = 0;
+	};
+}
\ No newline at end of file
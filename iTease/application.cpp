@@ -23,13 +23,25 @@
 
 using namespace iTease;
 
+constexpr const char* HandlerTimeHelp = "Time spent in request handlers which answered the request.";
+
 const Version Version::Latest;
 
 static const map<string, string> application_arguments = {
 	{"port", "Port"},
+	{"workers", "Workers"},
+	{"connections", "Connections"},
+	{"streams", "Streams"},
+	{"bench", "Benchmark"},
+	{"bench-requests", "BenchmarkRequests"},
+	{"bench-concurrency", "BenchmarkConcurrency"},
+	{"bench-mix", "BenchmarkMix"},
 	{"log", "LogLevel"}
 };
 
+// the worker whose JS context is in use by the current thread
+static thread_local Application::Worker* t_worker = nullptr;
+
 vector<string> ParseCommandLine(string cmdLine, bool skipFirst = true) {
 	auto arguments = vector<string>{};
 	unsigned cmdStart = 0, cmdEnd = 0;
@@ -80,7 +92,11 @@ void SystemError::create(JS::Context& ctx) const {
 	ctx.remove(-2);
 }
 
-Application::Application(string args) {
+Application::Application(string args) :
+	m_nativeHandlerTime(metrics.histogram("itease_handler_duration_seconds", HandlerTimeHelp, "dispatch=\"native\"")),
+	m_internalHandlerTime(metrics.histogram("itease_handler_duration_seconds", HandlerTimeHelp, "dispatch=\"internal\"")),
+	m_jsHandlerTime(metrics.histogram("itease_handler_duration_seconds", HandlerTimeHelp, "dispatch=\"js\""))
+{
 	m_args = parse_args(ParseCommandLine(args));
 	if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK)
 		throw std::runtime_error("curl failed to initialise");
@@ -99,12 +115,15 @@ auto Application::init()->bool {
 			initModules();
 			init_js(*js);
 			initPlugins();
+			initWorkers();
 			m_started = true;
 		}
 	}
 	return m_started;
 }
 auto Application::run()->void {
+	// tick callbacks may call into any context, so wait for workers to finish their requests
+	std::unique_lock<std::shared_mutex> lock(m_jsMutex);
 	try {
 		auto now = std::chrono::steady_clock::now();
 		for (auto it = m_onTicks.begin(); it != m_onTicks.end(); ) {
@@ -113,7 +132,7 @@ auto Application::run()->void {
 				if (!(*it->second)(v))
 					it = m_onTicks.erase(it);
 				else {
-					it->first.interval = std::chrono::nanoseconds(v);
+					it->first.interval = std::chrono::milliseconds(v);
 					it->first.last_run = now;
 					++it;
 				}
@@ -136,6 +155,55 @@ auto Application::add_interval_callback(long long intervalMS, OnTickEvent::Handl
 	auto& pr = m_onTicks.emplace_back(EventInterval{std::chrono::milliseconds{intervalMS}, std::chrono::steady_clock::time_point{ }}, std::move(ev));
 	return std::move(pr.second->listen(h));
 }
+auto Application::next_tick() const->optional<std::chrono::steady_clock::duration> {
+	optional<std::chrono::steady_clock::duration> next;
+	auto now = std::chrono::steady_clock::now();
+	for (auto& pr : m_onTicks) {
+		auto due = (pr.first.last_run + pr.first.interval) - now;
+		if (!next || due < *next)
+			next = std::max(due, std::chrono::steady_clock::duration::zero());
+	}
+	return next;
+}
+auto Application::current_worker()->Worker* {
+	return t_worker;
+}
+auto Application::initWorkers()->void {
+	m_freeWorkers.clear();
+	m_workers.clear();
+	for (int i = 0; i < opt.workers; ++i) {
+		auto worker = std::make_unique<Worker>();
+		worker->js = std::make_unique<JS::Context>();
+		// web.listen() calls made by the startup scripts register with the current worker
+		t_worker = worker.get();
+		try {
+			init_js(*worker->js);
+		}
+		catch (...) {
+			t_worker = nullptr;
+			throw;
+		}
+		t_worker = nullptr;
+		m_freeWorkers.push_back(worker.get());
+		m_workers.emplace_back(std::move(worker));
+	}
+	if (!m_workers.empty())
+		ITEASE_LOGINFO("Started " << m_workers.size() << " request workers");
+}
+auto Application::acquire_worker()->Worker& {
+	std::unique_lock<std::mutex> lock(m_workerMutex);
+	m_workerAvailable.wait(lock, [this] { return !m_freeWorkers.empty(); });
+	auto worker = m_freeWorkers.back();
+	m_freeWorkers.pop_back();
+	return *worker;
+}
+auto Application::release_worker(Worker& worker)->void {
+	{
+		std::lock_guard<std::mutex> lock(m_workerMutex);
+		m_freeWorkers.push_back(&worker);
+	}
+	m_workerAvailable.notify_one();
+}
 auto Application::initModules()->void {
 	add_module<Web>(*this);
 	add_module<HTML>();
@@ -341,17 +409,17 @@ auto Application::init_js(JS::Context& js, bool omit_scripts)->void {
 	js.put_property(-2, "prototype");
 	js.pop(2);
 
-	if (!omit_scripts) initScripts();
+	if (!omit_scripts) initScripts(js);
 }
-auto Application::initScripts()->void {
+auto Application::initScripts(JS::Context& js)->void {
 	try {
-		JS::StackAssert sa2(*js);
+		JS::StackAssert sa2(js);
 		static vector<string> s_systemScripts = {
 			"system/startup"
 		};
 		for (auto& scr : s_systemScripts) {
 			Script script(scr, "system", true);
-			script.run(*js);
+			script.run(js);
 		}
 	}
 	catch (const JS::ErrorException& ex) {
@@ -362,17 +430,24 @@ auto Application::initScripts()->void {
 	}
 }
 auto Application::partial_restart()->void {
-	m_onTicks.clear();
+	// no worker may be serving while the contexts are rebuilt
+	std::unique_lock<std::shared_mutex> lock(m_jsMutex);
+	// ticks aren't cleared, the server's own outlive the restart, the modules' listeners remove theirs and run() drops the emptied events
 	// be sure to clear modules first as they may need to make JS destruction calls
 	modules.clear();
+	m_freeWorkers.clear();
+	m_workers.clear();
 	js.reset();
 	js = std::make_unique<JS::Context>();
 	initModules();
 	init_js(*js);
 	initPlugins();
+	initWorkers();
 }
 auto Application::initDB()->bool {
 	try {
+		// opening reads the schema version, which is as much a query as the upgrade
+		Metrics::Timer timer(metrics.histogram("itease_db_query_duration_seconds", "Time spent in database queries.", "module=\"database\""));
 		db = std::make_unique<Database>((data_path() / "web.db").string());
 		sqlite3_config(SQLITE_CONFIG_LOG, [](void* arg, int errCode, const char* msg) {
 			ITEASE_LOGERROR("SQLite: (" << errCode << ") " << msg);
@@ -412,10 +487,38 @@ auto Application::initPlugins()->void {
 	}
 }
 auto Application::server_request(const ServerRequest& request, ServerResponse& response)->bool {
+	// every handler belongs to a module or context a restart tears down, and their listener lists are rewritten with them
+	std::shared_lock<std::shared_mutex> lock(m_jsMutex);
 	try {
-		if (!OnServerRequestInternal(request, response))
-			return OnServerRequest(request, response) > 0;
-		return true;
+		{
+			// misses only walk the route trie, so only the handler that answers is timed
+			Metrics::Timer timer(m_nativeHandlerTime);
+			if (nativeRoutes.dispatch(request, response))
+				return true;
+			timer.cancel();
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_internalMutex);
+			Metrics::Timer timer(m_internalHandlerTime);
+			if (internalRoutes.dispatch(request, response) || OnServerRequestInternal(request, response))
+				return true;
+			timer.cancel();
+		}
+		if (m_workers.empty()) {
+			Metrics::Timer timer(m_jsHandlerTime);
+			return routes.dispatch(request, response) || OnServerRequest(request, response) > 0;
+		}
+
+		// dispatch to a free worker, its context is exclusive to this thread until released
+		auto& worker = acquire_worker();
+		// responses are complete by the time the handler returns, so nothing uses the context after the worker is released
+		auto release = unique_ptr<Worker, std::function<void(Worker*)>>(&worker, [this](Worker* w) {
+			t_worker = nullptr;
+			release_worker(*w);
+		});
+		t_worker = &worker;
+		Metrics::Timer timer(m_jsHandlerTime);
+		return worker.routes.dispatch(request, response) || worker.OnServerRequest(request, response) > 0;
 	}
 	catch (const JS::ErrorException& ex) {
 		ITEASE_LOGERROR(ex.what());
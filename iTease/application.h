@@ -1,20 +1,33 @@
 #pragma once
+#include <condition_variable>
+#include <shared_mutex>
 #include "common.h"
 #include "iTease.h"
 #include "logging.h"
 #include "server.h"
+#include "router.h"
 #include "db.h"
 #include "webui.h"
 #include "js.h"
+#include "metrics.h"
 #include "plugin.h"
 #include "module.h"
 
 namespace iTease {
 	class WebUI;
+	class Reactor;
 
 	class Options {
 	public:
 		int			port = 36900;
+		// number of request workers, each owning a JS context (0 serves requests from the main loop)
+		int			workers = 0;
+		// number of request slots, requests beyond this are turned away
+		int			maxConnections = 64;
+		// number of event streams and WebSockets, which hold their connections open without taking a request slot
+		int			maxStreams = 256;
+		// sheds requests beyond each client's rate and the adaptive concurrency limit
+		bool		admission = true;
 		LogLevel	logLevel = LogLevel::Warning;
 	};
 
@@ -59,9 +72,25 @@ namespace iTease {
 
 	public:
 		using OnTickEvent = const Event<long long&>;
+		using OnSessionRestoreEvent = const Event<uint64_t, shared_ptr<void>&>;
+		using OnServerStopEvent = const Event<>;
+		using OnStaticLookupEvent = const Event<const string&>;
+
+		/**
+		 * Worker - a fully initialised JS context which serves requests on one server thread at a time
+		**/
+		struct Worker {
+			unique_ptr<JS::Context> js;
+			// fired for requests dispatched to this worker, populated by web.listen() calls made in its context
+			Server::OnRequestEvent OnServerRequest;
+			// routes registered by web.route() calls made in its context, tried before OnServerRequest
+			Router routes;
+		};
 
 	public:
 		Options opt;
+		// counters, gauges and histograms of every module, served at /metrics
+		Metrics metrics;
 		unique_ptr<JS::Context> js;
 		unique_ptr<Database> db;
 		ci_map<string, std::unique_ptr<Module>> modules;
@@ -70,6 +99,20 @@ namespace iTease {
 		Server::OnRequestEvent OnServerRequest;
 		// fired before OnServerRequest, if request handled by this, OnServerRequest won't be called
 		Server::OnRequestEvent OnServerRequestInternal;
+		// routes resolved before any event, their handlers run concurrently on server threads
+		Router nativeRoutes;
+		// routes tried before OnServerRequestInternal and serialised with it
+		Router internalRoutes;
+		// routes tried before OnServerRequest, for JS routes of the main context
+		Router routes;
+		// fired when a persisted session is brought back, handlers set the data of the user bound to it
+		OnSessionRestoreEvent OnSessionRestore;
+		// asks the modules serving files whether one answers the URI, such requests are admitted as cheap ones
+		OnStaticLookupEvent OnStaticLookup;
+		// fired as the server stops, before it closes upgraded connections, so modules stop servicing them first
+		OnServerStopEvent OnServerStop;
+		// Server-Sent Event channels, one per session, published to from any thread
+		ServerEvents events;
 
 	public:
 		Application(string args = "");
@@ -79,6 +122,19 @@ namespace iTease {
 		auto init()->bool;
 		auto run()->void;
 		auto add_interval_callback(long long intervalMS, OnTickEvent::Handler h)->OnTickEvent::Listener;
+		// returns the time until the next interval callback is due, empty if there are none
+		auto next_tick() const->optional<std::chrono::steady_clock::duration>;
+		// blocks request workers while native code outside of run() calls into JS
+		auto lock_js() { return std::unique_lock<std::shared_mutex>(m_jsMutex); }
+		// serialises native code outside of the request path with the internal handlers, whose module state it shares
+		auto lock_internal() { return std::unique_lock<std::mutex>(m_internalMutex); }
+		// the event loop driving the application, if any, set before init() so modules may register with it
+		auto set_reactor(Reactor* reactor) { m_reactor = reactor; }
+		auto reactor() const { return m_reactor; }
+		// returns the number of request workers
+		auto num_workers() const { return m_workers.size(); }
+		// returns the worker whose context is active on the calling thread, or nullptr if there is none
+		static auto current_worker()->Worker*;
 		auto is_running() {
 			return !m_exit;
 		}
@@ -116,13 +172,29 @@ namespace iTease {
 
 		auto initDB()->bool;
 		auto initPlugins()->void;
-		auto initScripts()->void;
+		auto initScripts(JS::Context&)->void;
 		auto initModules()->void;
+		auto initWorkers()->void;
+		auto acquire_worker()->Worker&;
+		auto release_worker(Worker&)->void;
 		auto server_request(const ServerRequest&, ServerResponse&)->bool;
 		auto parse_args(const vector<string>&)->map<string, string>;
 
 	private:
 		vector<pair<EventInterval, unique_ptr<OnTickEvent>>> m_onTicks;
+		vector<unique_ptr<Worker>> m_workers;
+		vector<Worker*> m_freeWorkers;
+		std::mutex m_workerMutex;
+		std::condition_variable m_workerAvailable;
+		// held shared while requests are dispatched to any handler, exclusively while ticking or restarting, as tick callbacks may enter any context
+		std::shared_mutex m_jsMutex;
+		// serialises OnServerRequestInternal handlers, which share native module state
+		std::mutex m_internalMutex;
+		Reactor* m_reactor = nullptr;
+		// time spent in request handlers by where they were dispatched
+		Metrics::Histogram& m_nativeHandlerTime;
+		Metrics::Histogram& m_internalHandlerTime;
+		Metrics::Histogram& m_jsHandlerTime;
 		unique_ptr<WebUI> m_ui;
 		vector<unique_ptr<Plugin>> m_plugins;
 		map<string, string> m_args;
@@ -0,0 +1,253 @@
+#include "stdinc.h"
+#include <chrono>
+#include <new>
+#include <curl/curl.h>
+#include "benchmark.h"
+#include "application.h"
+#include "user.h"
+#include "logging.h"
+
+using namespace iTease;
+
+using Clock = std::chrono::steady_clock;
+
+constexpr const char* BenchmarkUser = "benchmark";
+constexpr const char* BenchmarkPassword = "benchmark";
+constexpr const char* StaticPath = "/css/main.css";
+constexpr long RequestTimeoutMS = 30000;
+static const char* request_names[] = {"static", "page", "signin", "updates"};
+// the parts of the working directory a run reads
+static const char* FixtureDirs[] = {"config", "plugin", "system", "web"};
+
+// allocations made while counting, by every thread of the process
+static std::atomic<bool> count_allocations{false};
+static std::atomic<uint64_t> allocation_count{0};
+
+// counts allocations only while a benchmark is measuring, otherwise it's one relaxed load per allocation
+void* operator new(size_t size) {
+	if (count_allocations.load(std::memory_order_relaxed))
+		allocation_count.fetch_add(1, std::memory_order_relaxed);
+	if (auto ptr = std::malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept {
+	std::free(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept {
+	std::free(ptr);
+}
+
+// returns the value at the given fraction of sorted samples, in ms
+static auto percentile(const vector<double>& sorted, double fraction)->double {
+	if (sorted.empty())
+		return 0;
+	auto idx = static_cast<size_t>(fraction * static_cast<double>(sorted.size() - 1) + 0.5);
+	return sorted[std::min(idx, sorted.size() - 1)];
+}
+static auto latency_report(vector<double>& samples)->json {
+	std::sort(samples.begin(), samples.end());
+	return {
+		{"p50", percentile(samples, 0.5)},
+		{"p99", percentile(samples, 0.99)},
+		{"p999", percentile(samples, 0.999)},
+		{"max", samples.empty() ? 0 : samples.back()}
+	};
+}
+
+auto BenchmarkOptions::parse_mix(const string& str)->void {
+	std::array<unsigned, 4> weights = {0, 0, 0, 0};
+	std::istringstream ss(str);
+	string entry;
+	while (std::getline(ss, entry, ',')) {
+		auto colon = entry.find(':');
+		auto name = strtolower(entry.substr(0, colon));
+		auto it = std::find_if(std::begin(request_names), std::end(request_names), [&name](const char* n) { return name == n; });
+		if (it == std::end(request_names))
+			throw std::invalid_argument("unknown benchmark request '" + name + "'");
+		weights[it - std::begin(request_names)] = colon == string::npos ? 1 : static_cast<unsigned>(std::stoul(entry.substr(colon + 1)));
+	}
+	if (std::accumulate(weights.begin(), weights.end(), 0u) == 0)
+		throw std::invalid_argument("benchmark mix has no requests");
+	mix = weights;
+}
+
+Benchmark::Benchmark(BenchmarkOptions options) : m_options(options)
+{ }
+Benchmark::~Benchmark() {
+	if (m_thread.joinable())
+		m_thread.join();
+}
+auto Benchmark::prepare_fixture()->fs::path {
+	auto source = fs::current_path();
+	auto fixture = fs::temp_directory_path() / ("itease-bench-" + std::to_string(Clock::now().time_since_epoch().count()));
+	fs::create_directories(fixture);
+	try {
+		// the run needs the scripts and what they serve, data/ starts empty so the database is a fresh one
+		for (auto dir : FixtureDirs) {
+			if (fs::is_directory(source / dir))
+				fs::copy(source / dir, fixture / dir, fs::copy_options::recursive);
+		}
+		fs::create_directories(fixture / "data");
+	}
+	catch (...) {
+		std::error_code ec;
+		fs::remove_all(fixture, ec);
+		throw;
+	}
+	fs::current_path(fixture);
+	return fixture;
+}
+auto Benchmark::remove_fixture(const fs::path& fixture)->void {
+	std::error_code ec;
+	fs::current_path(fixture.parent_path(), ec);
+	fs::remove_all(fixture, ec);
+	if (ec)
+		ITEASE_LOGERROR("Failed to remove the benchmark fixture " << fixture.string() << ": " << ec.message());
+}
+auto Benchmark::prepare_user(Application& app)->void {
+	auto it = app.modules.find("users");
+	auto users = it != app.modules.end() ? dynamic_cast<Users*>(it->second.get()) : nullptr;
+	if (users && !users->get_user(string(BenchmarkUser)))
+		users->create_user(BenchmarkUser, "benchmark@localhost", BenchmarkPassword, date::year{1990} / 1 / 1);
+}
+auto Benchmark::start(int port)->void {
+	m_thread = std::thread([this, port] {
+		try {
+			run(port);
+		}
+		catch (const std::exception& ex) {
+			ITEASE_LOGERROR("Benchmark failed: " << ex.what());
+			m_report = {{"error", ex.what()}};
+		}
+		count_allocations = false;
+		m_finished = true;
+	});
+}
+auto Benchmark::report()->json {
+	if (m_thread.joinable())
+		m_thread.join();
+	return m_report;
+}
+auto Benchmark::run(int port)->void {
+	struct Slot {
+		CURL* curl = nullptr;
+		BenchmarkRequest kind;
+		Clock::time_point start;
+	};
+	auto base = "http://127.0.0.1:" + std::to_string(port);
+	auto signinForm = string("username=") + BenchmarkUser + "&password=" + BenchmarkPassword;
+	// deterministic, so runs are comparable
+	std::mt19937 rng(0x17ea5e);
+	std::discrete_distribution<int> pick(m_options.mix.begin(), m_options.mix.end());
+
+	auto multi = curl_multi_init();
+	if (!multi) throw std::runtime_error("curl_multi_init failed");
+	vector<Slot> slots(std::max<size_t>(1, m_options.concurrency));
+	size_t started = 0;
+	auto total = m_options.warmup + m_options.requests;
+	auto launch = [&](Slot& slot) {
+		slot.kind = static_cast<BenchmarkRequest>(pick(rng));
+		string path;
+		switch (slot.kind) {
+		case BenchmarkRequest::Static: path = StaticPath; break;
+		case BenchmarkRequest::Page: path = "/"; break;
+		case BenchmarkRequest::Signin: path = "/signin"; break;
+		case BenchmarkRequest::Updates: path = "/updates"; break;
+		}
+		curl_easy_setopt(slot.curl, CURLOPT_URL, (base + path).c_str());
+		if (slot.kind == BenchmarkRequest::Signin)
+			curl_easy_setopt(slot.curl, CURLOPT_POSTFIELDS, signinForm.c_str());
+		else
+			curl_easy_setopt(slot.curl, CURLOPT_HTTPGET, 1L);
+		slot.start = Clock::now();
+		curl_multi_add_handle(multi, slot.curl);
+		++started;
+	};
+	for (auto& slot : slots) {
+		slot.curl = curl_easy_init();
+		if (!slot.curl) throw std::runtime_error("curl_easy_init failed");
+		curl_easy_setopt(slot.curl, CURLOPT_PRIVATE, &slot);
+		curl_easy_setopt(slot.curl, CURLOPT_WRITEFUNCTION, +[](char*, size_t size, size_t n, void*)->size_t { return size * n; });
+		curl_easy_setopt(slot.curl, CURLOPT_TIMEOUT_MS, RequestTimeoutMS);
+		// each connection is a client of its own, keeping the session cookie it's given
+		curl_easy_setopt(slot.curl, CURLOPT_COOKIEFILE, "");
+		curl_easy_setopt(slot.curl, CURLOPT_NOSIGNAL, 1L);
+	}
+
+	std::array<vector<double>, 4> latencies;
+	vector<double> all;
+	all.reserve(m_options.requests);
+	for (auto& l : latencies) l.reserve(m_options.requests);
+	size_t completed = 0, errors = 0, shed = 0;
+	Clock::time_point measureStart;
+	uint64_t allocationsStart = 0;
+
+	for (auto& slot : slots) {
+		if (started < total) launch(slot);
+	}
+	while (completed < total) {
+		int running = 0;
+		curl_multi_perform(multi, &running);
+		int queued = 0;
+		while (auto msg = curl_multi_info_read(multi, &queued)) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			Slot* slot = nullptr;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &slot);
+			auto elapsed = std::chrono::duration<double, std::milli>(Clock::now() - slot->start).count();
+			long status = 0;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+			curl_multi_remove_handle(multi, msg->easy_handle);
+
+			if (completed >= m_options.warmup) {
+				latencies[static_cast<int>(slot->kind)].push_back(elapsed);
+				all.push_back(elapsed);
+				// the mix only makes requests which should succeed, so a 4xx is as much an error as a 5xx
+				if (msg->data.result != CURLE_OK || status == 0 || status >= 400) {
+					++errors;
+					if (status == 503) ++shed;
+				}
+			}
+			if (++completed == m_options.warmup) {
+				measureStart = Clock::now();
+				allocationsStart = allocation_count.load();
+				count_allocations = true;
+			}
+			if (started < total)
+				launch(*slot);
+		}
+		if (completed < total)
+			curl_multi_wait(multi, nullptr, 0, 100, nullptr);
+	}
+	count_allocations = false;
+	auto duration = std::chrono::duration<double>(Clock::now() - measureStart).count();
+	auto allocations = allocation_count.load() - allocationsStart;
+
+	for (auto& slot : slots)
+		curl_easy_cleanup(slot.curl);
+	curl_multi_cleanup(multi);
+
+	auto measured = static_cast<double>(std::max<size_t>(1, m_options.requests));
+	m_report = {
+		{"requests", m_options.requests},
+		{"concurrency", slots.size()},
+		{"errors", errors},
+		{"shed", shed},
+		{"duration_s", duration},
+		{"requests_per_second", duration > 0 ? measured / duration : 0.0},
+		{"latency_ms", latency_report(all)},
+		// includes the client's own, which are few as its handles are reused
+		{"allocations_per_request", static_cast<double>(allocations) / measured},
+		{"mix", json::object()}
+	};
+	for (size_t i = 0; i < latencies.size(); ++i) {
+		if (!m_options.mix[i]) continue;
+		auto count = latencies[i].size();
+		m_report["mix"][request_names[i]] = {
+			{"weight", m_options.mix[i]},
+			{"requests", count},
+			{"latency_ms", latency_report(latencies[i])}
+		};
+	}
+}
\ No newline at end of file
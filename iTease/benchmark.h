@@ -0,0 +1,64 @@
+#pragma once
+#include <array>
+#include <thread>
+#include "common.h"
+
+namespace iTease {
+	class Application;
+
+	enum class BenchmarkRequest : int {
+		// a file under web/, served natively
+		Static,
+		// the page of the main controller, rendered by JS
+		Page,
+		// a POST to /signin with the benchmark user's form
+		Signin,
+		// a poll of /updates, as made by clients without an event stream
+		Updates
+	};
+
+	struct BenchmarkOptions {
+		// total requests, not counting the warmup
+		size_t requests = 10000;
+		// requests made before measuring starts, so caches and connections are warm
+		size_t warmup = 200;
+		// requests in flight at any time, each on a connection of its own
+		size_t concurrency = 16;
+		// relative weight of each kind of request, parsed from e.g. "static:60,page:30,signin:5,updates:5"
+		std::array<unsigned, 4> mix = {60, 30, 5, 5};
+
+		auto parse_mix(const string&)->void;
+	};
+
+	/**
+	 * Benchmark - drives the application's own server over loopback with a libcurl multi client
+	 * Requests of a weighted mix are kept at a fixed concurrency, the report gives throughput, latency percentiles and allocations per request as JSON
+	**/
+	class Benchmark {
+	public:
+		Benchmark(BenchmarkOptions);
+		~Benchmark();
+
+		// copies what the application reads from the directory it runs in to a temporary one and moves there, so the benchmark doesn't touch real data
+		// must be called before anything resolves the application's paths, returns the copy
+		static auto prepare_fixture()->fs::path;
+		// moves out of the copy and deletes it, once the application no longer uses it
+		static auto remove_fixture(const fs::path&)->void;
+		// adds the user signed in as by Signin requests, call once the application is initialised
+		auto prepare_user(Application&)->void;
+		// starts the client on a thread of its own, the server must be served by the caller until finished()
+		auto start(int port)->void;
+		auto finished() const { return m_finished.load(); }
+		// waits for the client, returns the report
+		auto report()->json;
+
+	private:
+		auto run(int port)->void;
+
+	private:
+		BenchmarkOptions m_options;
+		std::thread m_thread;
+		std::atomic<bool> m_finished{false};
+		json m_report;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include "stdinc.h"
+#include <MurmurHash3/MurmurHash3.h>
+#include "bundle.h"
+#include "application.h"
+#include "static_cache.h"
+
+using namespace iTease;
+
+constexpr const char* BundlePrefix = "/bundle/";
+
+// sources are given as URLs, which are relative to web/
+static auto source_path(const string& url) {
+	return fs::path("web") / fs::path(string(ltrim(url, "/")));
+}
+// returns the directory of a URL path, with its trailing slash
+static auto url_dir(const string& url) {
+	auto slash = url.rfind('/');
+	return slash == string::npos ? string("/") : url.substr(0, slash + 1);
+}
+// rewrites relative url() references of a stylesheet to absolute ones, as the bundle is served from another directory
+static auto rebase_css_urls(string_view css, const string& dir)->string {
+	string out;
+	out.reserve(css.size());
+	size_t pos = 0;
+	for (auto found = css.find("url(", pos); found != string_view::npos; found = css.find("url(", pos)) {
+		auto start = found + 4;
+		while (start < css.size() && std::isspace(static_cast<unsigned char>(css[start]))) ++start;
+		if (start < css.size() && (css[start] == '"' || css[start] == '\'')) ++start;
+		out.append(css.substr(pos, start - pos));
+		pos = start;
+		auto ref = css.substr(start, std::min<size_t>(css.size() - start, 8));
+		bool absolute = ref.empty() || ref[0] == '/' || ref[0] == '#' || ref.substr(0, 5) == "data:" || ref.substr(0, 5) == "http:" || ref.substr(0, 6) == "https:";
+		if (!absolute)
+			out += dir;
+	}
+	out.append(css.substr(pos));
+	return out;
+}
+
+AssetBundler::AssetBundler(StaticCache& cache) : m_cache(cache)
+{ }
+auto AssetBundler::bundle(const string& name, const vector<string>& sources)->string {
+	if (name.empty() || !std::all_of(name.begin(), name.end(), [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_'; }))
+		throw std::invalid_argument("bundle name '" + name + "' must be alphanumeric");
+	if (sources.empty())
+		throw std::invalid_argument("bundle '" + name + "' has no sources");
+	auto ext = strtolower(fs::path(sources.front()).extension().string());
+	for (auto& source : sources) {
+		if (source.find("..") != string::npos)
+			throw std::invalid_argument("bundle source '" + source + "' is outside of web/");
+		if (strtolower(fs::path(source).extension().string()) != ext)
+			throw std::invalid_argument("bundle '" + name + "' mixes types of files");
+	}
+
+	// the static cache only stats a file once a second, and only reloads it if it changed
+	vector<pair<uint64_t, std::time_t>> versions;
+	versions.reserve(sources.size());
+	for (auto& source : sources) {
+		auto entry = m_cache.get(source_path(source));
+		if (!entry)
+			throw std::runtime_error("bundle source '" + source + "' not found");
+		versions.emplace_back(entry->size, entry->mtime);
+	}
+
+	auto key = name + ext;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_builds.find(key);
+		if (it != m_builds.end() && it->second.sources == sources && it->second.versions == versions)
+			return it->second.current->url;
+	}
+
+	auto bundle = build(name, ext, sources, versions);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto& slot = m_builds[key];
+	// recorded even if the content came out the same, e.g. after a touch, so the next call doesn't rebuild again
+	slot.sources = sources;
+	slot.versions = std::move(versions);
+	if (slot.current && slot.current->url == bundle->url)
+		return slot.current->url;
+	if (slot.previous)
+		m_files.erase(slot.previous->url.substr(std::strlen(BundlePrefix)));
+	slot.previous = std::move(slot.current);
+	slot.current = bundle;
+	m_files[bundle->url.substr(std::strlen(BundlePrefix))] = bundle;
+	return bundle->url;
+}
+auto AssetBundler::find(const string& file) const->shared_ptr<const Bundle> {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_files.find(file);
+	return it != m_files.end() ? it->second : nullptr;
+}
+auto AssetBundler::build(const string& name, const string& ext, const vector<string>& sources, vector<pair<uint64_t, std::time_t>>& versions)->shared_ptr<const Bundle> {
+	auto data = std::make_shared<string>();
+	for (size_t i = 0; i < sources.size(); ++i) {
+		auto path = source_path(sources[i]);
+		auto entry = m_cache.get(path);
+		if (!entry)
+			throw std::runtime_error("bundle source '" + sources[i] + "' not found");
+		versions[i] = {entry->size, entry->mtime};
+		string content;
+		if (entry->data)
+			content = *entry->data;
+		else {
+			// too large for the static cache to hold
+			std::ifstream file(path, std::ios::binary);
+			content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		}
+		if (ext == ".css")
+			content = rebase_css_urls(content, url_dir(sources[i]));
+		*data += content;
+		// a script missing its last semicolon mustn't run into the next one
+		*data += ext == ".js" ? "\n;\n" : "\n";
+	}
+
+	uint64_t hash[2];
+	MurmurHash3_x64_128(data->data(), static_cast<int>(data->size()), 0, hash);
+	auto bundle = std::make_shared<Bundle>();
+	bundle->url = fmt::format("{}{}.{:016x}{}", BundlePrefix, name, hash[0], ext);
+	bundle->etag = fmt::format("\"{:016x}{:016x}\"", hash[0], hash[1]);
+	bundle->content_type = get_content_type_by_extension(string(ltrim(ext, ".")));
+	bundle->data = std::move(data);
+	return bundle;
+}
\ No newline at end of file
@@ -0,0 +1,52 @@
+#pragma once
+#include <mutex>
+#include "common.h"
+
+namespace iTease {
+	class StaticCache;
+
+	/**
+	 * AssetBundler - concatenates lists of scripts or stylesheets into single files named by a hash of their content
+	 * A bundle is rebuilt when one of its sources changes on disk, its URL changes with it so clients may cache it forever
+	**/
+	class AssetBundler {
+	public:
+		struct Bundle {
+			// /bundle/<name>.<hash>.<ext>
+			string url;
+			// quoted hash of the content
+			string etag;
+			string content_type;
+			shared_ptr<const string> data;
+		};
+
+		AssetBundler(StaticCache&);
+		AssetBundler(const AssetBundler&) = delete;
+		auto operator=(const AssetBundler&)->AssetBundler& = delete;
+
+		// returns the URL of the bundle of the sources (URLs of files under web/, all of one type), building it if needed
+		auto bundle(const string& name, const vector<string>& sources)->string;
+		// finds a bundle by the last segment of its URL, recently superseded ones are still found
+		auto find(const string& file) const->shared_ptr<const Bundle>;
+
+	private:
+		struct Build {
+			vector<string> sources;
+			// size and mtime of each source when built
+			vector<pair<uint64_t, std::time_t>> versions;
+			shared_ptr<const Bundle> current;
+			// kept for pages rendered before the rebuild
+			shared_ptr<const Bundle> previous;
+		};
+
+		auto build(const string& name, const string& ext, const vector<string>& sources, vector<pair<uint64_t, std::time_t>>& versions)->shared_ptr<const Bundle>;
+
+	private:
+		StaticCache& m_cache;
+		mutable std::mutex m_mutex;
+		// by name and extension
+		unordered_map<string, Build> m_builds;
+		// by file name, current and previous bundles only
+		unordered_map<string, shared_ptr<const Bundle>> m_files;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,122 @@
+#include "stdinc.h"
+#include <zlib.h>
+#include "compression.h"
+
+using namespace iTease;
+
+constexpr size_t MaxCompressionCacheSize = 16 * 1024 * 1024; // 16MB
+constexpr size_t CompressionChunkSize = 16 * 1024;
+// zlib window bits, +16 selects the gzip wrapper
+constexpr int DeflateWindowBits = 15;
+constexpr int GzipWindowBits = 15 + 16;
+
+static const char* encoded_etag_suffixes[] = {"", "-gzip", "-deflate"};
+
+auto iTease::negotiate_encoding(const string& acceptEncoding)->ContentEncoding {
+	bool gzip = false, deflate = false;
+	string_view list = acceptEncoding;
+	while (!list.empty()) {
+		auto pos = list.find(',');
+		auto item = trim(list.substr(0, pos));
+		auto semi = item.find(';');
+		auto token = strtolower(string(trim(item.substr(0, semi))));
+		// a zero quality value means the client refuses the coding
+		bool refused = false;
+		if (semi != string_view::npos) {
+			auto param = trim(item.substr(semi + 1));
+			if (param.substr(0, 2) == "q=")
+				refused = std::atof(string(param.substr(2)).c_str()) <= 0.0;
+		}
+		if (!refused) {
+			if (token == "gzip" || token == "x-gzip") gzip = true;
+			else if (token == "deflate") deflate = true;
+		}
+		if (pos == string_view::npos) break;
+		list.remove_prefix(pos + 1);
+	}
+	return gzip ? ContentEncoding::Gzip : deflate ? ContentEncoding::Deflate : ContentEncoding::Identity;
+}
+auto iTease::encoding_name(ContentEncoding encoding)->const char* {
+	switch (encoding) {
+	case ContentEncoding::Gzip: return "gzip";
+	case ContentEncoding::Deflate: return "deflate";
+	default: return "identity";
+	}
+}
+auto iTease::is_compressible(const string& contentType)->bool {
+	string_view type = contentType;
+	type = trim(type.substr(0, type.find(';')));
+	if (type.substr(0, 5) == "text/")
+		return true;
+	return type == "application/javascript" || type == "application/json" || type == "application/xml"
+		|| type == "image/svg+xml" || type == "application/x-javascript";
+}
+auto iTease::compress(string_view data, ContentEncoding encoding)->string {
+	z_stream zs{};
+	auto bits = encoding == ContentEncoding::Gzip ? GzipWindowBits : DeflateWindowBits;
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		throw std::runtime_error("deflateInit2 failed");
+	string out;
+	out.resize(deflateBound(&zs, static_cast<uLong>(data.size())));
+	zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+	zs.avail_in = static_cast<uInt>(data.size());
+	int ret;
+	do {
+		if (zs.total_out == out.size())
+			out.resize(out.size() + CompressionChunkSize);
+		zs.next_out = reinterpret_cast<Bytef*>(&out[zs.total_out]);
+		zs.avail_out = static_cast<uInt>(out.size() - zs.total_out);
+		ret = deflate(&zs, Z_FINISH);
+	} while (ret == Z_OK || ret == Z_BUF_ERROR);
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END)
+		throw std::runtime_error("deflate failed");
+	out.resize(zs.total_out);
+	return out;
+}
+auto iTease::encoded_etag(const string& etag, ContentEncoding encoding)->string {
+	if (encoding == ContentEncoding::Identity || etag.empty() || etag.back() != '"')
+		return etag;
+	return etag.substr(0, etag.size() - 1) + encoded_etag_suffixes[static_cast<int>(encoding)] + "\"";
+}
+auto iTease::decoded_etag(string_view etag)->string {
+	if (!etag.empty() && etag.back() == '"') {
+		for (auto suffix : encoded_etag_suffixes) {
+			string_view sv = suffix;
+			if (sv.empty() || etag.size() < sv.size() + 2) continue;
+			if (etag.substr(etag.size() - sv.size() - 1, sv.size()) == sv)
+				return string(etag.substr(0, etag.size() - sv.size() - 1)) + "\"";
+		}
+	}
+	return string(etag);
+}
+
+auto CompressionCache::get(const string& hash, ContentEncoding encoding, const shared_ptr<const string>& content)->shared_ptr<const string> {
+	auto key = hash + encoding_name(encoding);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_slots.find(key);
+		if (it != m_slots.end()) {
+			m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+			return it->second.data;
+		}
+	}
+
+	// compress outside the lock, a concurrent miss on the same key just does the work twice
+	auto data = std::make_shared<const string>(compress(*content, encoding));
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_slots.find(key);
+	if (it != m_slots.end())
+		return it->second.data;
+	m_lru.push_front(key);
+	m_slots.emplace(key, Slot{data, m_lru.begin()});
+	m_dataSize += data->size();
+	while (m_dataSize > MaxCompressionCacheSize && m_lru.size() > 1) {
+		auto old = m_slots.find(m_lru.back());
+		m_dataSize -= old->second.data->size();
+		m_slots.erase(old);
+		m_lru.pop_back();
+	}
+	return data;
+}
\ No newline at end of file
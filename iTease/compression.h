@@ -0,0 +1,43 @@
+#pragma once
+#include <list>
+#include <mutex>
+#include "common.h"
+
+namespace iTease {
+	enum class ContentEncoding : int {
+		Identity, Gzip, Deflate
+	};
+
+	// picks the preferred encoding from an Accept-Encoding header, honouring q=0 exclusions
+	extern auto negotiate_encoding(const string& acceptEncoding)->ContentEncoding;
+	// returns the Content-Encoding token for an encoding
+	extern auto encoding_name(ContentEncoding)->const char*;
+	// returns true for textual content types worth compressing
+	extern auto is_compressible(const string& contentType)->bool;
+	// compresses a whole body, throws std::runtime_error on zlib failure
+	extern auto compress(string_view data, ContentEncoding)->string;
+	// returns the ETag of an encoded variant, distinct so caches don't mix variants up
+	extern auto encoded_etag(const string& etag, ContentEncoding)->string;
+	// strips an encoded variant's suffix from an ETag, so it validates against the identity ETag
+	extern auto decoded_etag(string_view etag)->string;
+
+	/**
+	 * CompressionCache - bounded LRU store of compressed bodies keyed by content hash and encoding, so each is compressed once
+	**/
+	class CompressionCache {
+	public:
+		// returns the cached variant of content identified by hash, compressing and storing it if it isn't cached
+		auto get(const string& hash, ContentEncoding, const shared_ptr<const string>& content)->shared_ptr<const string>;
+
+	private:
+		struct Slot {
+			shared_ptr<const string> data;
+			std::list<string>::iterator lru;
+		};
+
+		std::mutex m_mutex;
+		unordered_map<string, Slot> m_slots;
+		std::list<string> m_lru;
+		size_t m_dataSize = 0;
+	};
+}
\ No newline at end of file
@@ -1072,6 +1072,17 @@ namespace iTease {
 			return false;
 		}
 
+		// Returns the shared C++ object associated with a variant map representing a JS object or a nullptr if it isn't shared
+		template<typename T>
+		shared_ptr<T> to_shared(const VariantMap& vm) {
+			auto it = vm.find("\xff""\xff""js-ptr");
+			if (it != vm.end() && vm.find(T::JSName) != vm.end() && it->second.type() == typeid(VarPointer)) {
+				auto vp = std::any_cast<VarPointer>(it->second);
+				if (vp.type == PointerType::SharedPointer)
+					return *reinterpret_cast<shared_ptr<T>*>(vp.ptr);
+			}
+			return nullptr;
+		}
 		// Returns the C++ object associated with a variant map representing a JS object or a nullptr on invalid representation
 		template<typename T>
 		T* to_object(const VariantMap& vm) {
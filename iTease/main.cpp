@@ -3,6 +3,7 @@
 #include "cpp/string.h"
 #include "system.h"
 #include "application.h"
+#include "benchmark.h"
 #include "server.h"
 #include "logging.h"
 #include "resource.h"
@@ -43,6 +44,11 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 	MSG msg;
 	ZeroMemory(&msg, sizeof(MSG));
 	{
+		// the benchmark's copy of the working directory, removed last, whichever way the run ends
+		struct Fixture {
+			iTease::fs::path path;
+			~Fixture() { if (!path.empty()) iTease::Benchmark::remove_fixture(path); }
+		} fixture;
 		iTease::Application app(GetCommandLineW());
 		// Create a debug console like a badass
 		#ifdef _DEBUG
@@ -54,11 +60,50 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 
 		// Initialise app with command line params
 		app.opt.port = serverPort = std::stoi(app.get_args().at("port"));
+		auto workers = app.get_args().find("workers");
+		if (workers != app.get_args().end())
+			app.opt.workers = std::stoi(workers->second);
+		auto connections = app.get_args().find("connections");
+		if (connections != app.get_args().end())
+			app.opt.maxConnections = std::stoi(connections->second);
+		auto streams = app.get_args().find("streams");
+		if (streams != app.get_args().end())
+			app.opt.maxStreams = std::stoi(streams->second);
+
+		// -bench serves a copy of the working directory's scripts and files to a client of its own and prints a JSON report
+		std::unique_ptr<iTease::Benchmark> benchmark;
+		if (app.get_args().count("bench")) {
+			iTease::BenchmarkOptions options;
+			try {
+				auto it = app.get_args().find("bench-requests");
+				if (it != app.get_args().end()) options.requests = std::stoul(it->second);
+				it = app.get_args().find("bench-concurrency");
+				if (it != app.get_args().end()) options.concurrency = std::stoul(it->second);
+				it = app.get_args().find("bench-mix");
+				if (it != app.get_args().end()) options.parse_mix(it->second);
+				fixture.path = iTease::Benchmark::prepare_fixture();
+			}
+			catch (const std::exception& ex) {
+				ITEASE_LOGERROR("Failed to set up the benchmark: " << ex.what());
+				return 1;
+			}
+			benchmark = std::make_unique<iTease::Benchmark>(options);
+			// a single loopback client would be throttled as one abusive one
+			app.opt.admission = false;
+			app.opt.maxConnections = std::max<int>(app.opt.maxConnections, static_cast<int>(options.concurrency) * 2);
+			// the report goes to the console the benchmark was started from
+			if (!GetConsoleWindow() && AttachConsole(ATTACH_PARENT_PROCESS))
+				freopen("CONOUT$", "w", stdout);
+		}
 
 		if (app.init()) {
 			std::atomic<bool> exit = false;
 			std::mutex active_thread;
 			iTease::Server server(app);
+			if (benchmark) {
+				benchmark->prepare_user(app);
+				benchmark->start(app.opt.port);
+			}
 			/*auto server_thread = std::thread([&]() {
 				active_thread.lock();
 				active_thread.unlock();
@@ -113,7 +158,7 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 							server.run();
 							// run until app wants to exit
 							app.run();
-							if (exit || !app.is_running()) break;
+							if (exit || !app.is_running() || (benchmark && benchmark->finished())) break;
 						}
 						/*catch (iTease::JS::ExceptionInfo& ex) {
 							auto str = std::string("JavaScript exception:\n") + ex.what();
@@ -140,6 +185,9 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 			}
 			exit = true;
 			FindCloseChangeNotification(hFileUpdateWatcher);
+			if (benchmark) {
+				std::cout << benchmark->report().dump(2) << std::endl;
+			}
 			// we should probably wait for the other threads before getting out of here
 			console_thread.join();
 			//server_thread.join();
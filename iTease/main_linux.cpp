@@ -0,0 +1,158 @@
+#include "stdinc.h"
+#ifdef __linux__
+#include <csignal>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+#include "common.h"
+#include "application.h"
+#include "benchmark.h"
+#include "reactor.h"
+#include "server.h"
+#include "logging.h"
+
+using namespace iTease;
+
+// inotify events which should trigger a partial restart
+constexpr uint32_t SystemWatchEvents = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE;
+
+// watches the system directory tree, the equivalent of the Win32 build's change notification
+static auto watch_system_dir(int fd)->void {
+	inotify_add_watch(fd, "system", SystemWatchEvents);
+	std::error_code ec;
+	for (auto& entry : fs::recursive_directory_iterator("system", ec)) {
+		if (fs::is_directory(entry.path()))
+			inotify_add_watch(fd, entry.path().string().c_str(), SystemWatchEvents);
+	}
+}
+
+// headless entry point, everything is driven by a single epoll reactor
+int main(int argc, char* argv[]) {
+	// blocked before any thread starts, threads inherit the mask, so the signals only ever reach the signalfd
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	string cmdLine;
+	for (int i = 0; i < argc; ++i)
+		cmdLine += string(i ? " \"" : "\"") + argv[i] + "\"";
+
+	// the benchmark's copy of the working directory, removed last, whichever way the run ends
+	struct Fixture {
+		fs::path path;
+		~Fixture() { if (!path.empty()) Benchmark::remove_fixture(path); }
+	} fixture;
+	// outlives the application, whose modules unwatch their fds on destruction
+	Reactor reactor;
+	Application app(cmdLine);
+	auto& args = app.get_args();
+	auto it = args.find("port");
+	if (it != args.end()) app.opt.port = std::stoi(it->second);
+	it = args.find("workers");
+	if (it != args.end()) app.opt.workers = std::stoi(it->second);
+	it = args.find("connections");
+	if (it != args.end()) app.opt.maxConnections = std::stoi(it->second);
+	it = args.find("streams");
+	if (it != args.end()) app.opt.maxStreams = std::stoi(it->second);
+
+	// -bench serves a copy of the working directory's scripts and files to a client of its own and prints a JSON report
+	unique_ptr<Benchmark> benchmark;
+	if (args.count("bench")) {
+		BenchmarkOptions options;
+		try {
+			it = args.find("bench-requests");
+			if (it != args.end()) options.requests = std::stoul(it->second);
+			it = args.find("bench-concurrency");
+			if (it != args.end()) options.concurrency = std::stoul(it->second);
+			it = args.find("bench-mix");
+			if (it != args.end()) options.parse_mix(it->second);
+			fixture.path = Benchmark::prepare_fixture();
+		}
+		catch (const std::exception& ex) {
+			ITEASE_LOGERROR("Failed to set up the benchmark: " << ex.what());
+			return 1;
+		}
+		benchmark = std::make_unique<Benchmark>(options);
+		// a single loopback client would be throttled as one abusive one
+		app.opt.admission = false;
+		app.opt.maxConnections = std::max<int>(app.opt.maxConnections, static_cast<int>(options.concurrency) * 2);
+	}
+
+	// modules register their sockets and timers during init
+	app.set_reactor(&reactor);
+	if (!app.init())
+		return 1;
+
+	try {
+		Server server(app);
+		bool exit = false;
+		if (benchmark) {
+			benchmark->prepare_user(app);
+			benchmark->start(app.opt.port);
+		}
+
+		// shut down cleanly on SIGINT/SIGTERM
+		int signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (signalFd >= 0) {
+			reactor.watch(signalFd, EPOLLIN, [&](uint32_t) {
+				signalfd_siginfo info;
+				while (read(signalFd, &info, sizeof(info)) > 0);
+				exit = true;
+			});
+		}
+
+		// restart when system scripts change
+		int notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (notifyFd >= 0) {
+			watch_system_dir(notifyFd);
+			reactor.watch(notifyFd, EPOLLIN, [&](uint32_t) {
+				char buffer[4096];
+				while (read(notifyFd, buffer, sizeof(buffer)) > 0);
+				app.partial_restart();
+			});
+		}
+
+		// without a worker pool, requests are served when MHD's epoll fd is ready
+		auto serverFd = server.poll_fd();
+		if (serverFd >= 0)
+			reactor.watch(serverFd, EPOLLIN, [&](uint32_t) { server.run(); });
+
+		while (!exit && app.is_running() && !(benchmark && benchmark->finished())) {
+			auto timeout = app.next_tick();
+			if (auto serverTimeout = server.timeout()) {
+				if (!timeout || *serverTimeout < *timeout)
+					timeout = *serverTimeout;
+			}
+			reactor.run_once(timeout);
+			// handles MHD connection timeouts, cheap when there's nothing to do
+			server.run();
+			app.run();
+		}
+
+		if (serverFd >= 0) reactor.unwatch(serverFd);
+		if (notifyFd >= 0) {
+			reactor.unwatch(notifyFd);
+			close(notifyFd);
+		}
+		if (signalFd >= 0) {
+			reactor.unwatch(signalFd);
+			close(signalFd);
+		}
+		if (benchmark) {
+			std::cout << benchmark->report().dump(2) << std::endl;
+		}
+	}
+	catch (const std::bad_alloc&) {
+		ITEASE_LOGERROR("An out-of-memory error occurred.");
+		return 1;
+	}
+	catch (const std::exception& ex) {
+		ITEASE_LOGERROR("A fatal error occurred: " << ex.what());
+		return 1;
+	}
+	return 0;
+}
+#endif
\ No newline at end of file
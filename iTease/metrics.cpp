@@ -0,0 +1,119 @@
+#include "stdinc.h"
+#include <sstream>
+#include "metrics.h"
+
+using namespace iTease;
+
+static auto type_name(int type) {
+	static const char* names[] = {"counter", "gauge", "histogram"};
+	return names[type];
+}
+// formats a number of nanoseconds as seconds
+static auto format_seconds(uint64_t ns) {
+	char buf[32];
+	std::snprintf(buf, sizeof(buf), "%.9g", static_cast<double>(ns) / 1e9);
+	return string(buf);
+}
+static auto with_label(const string& labels, const string& label) {
+	return labels.empty() ? label : labels + "," + label;
+}
+
+auto Metrics::Histogram::bucket_of(uint64_t ns)->size_t {
+	// buckets are (lower, upper], so a value on a boundary counts toward the bucket it ends
+	if (ns <= (1ull << MinExponent))
+		return 0;
+	auto v = ns - 1;
+	int exponent = 63;
+	while (!(v >> exponent)) --exponent;
+	if (exponent >= MaxExponent)
+		return NumBuckets - 1;
+	auto sub = static_cast<size_t>((v >> (exponent - 2)) & (SubBuckets - 1));
+	return 1 + static_cast<size_t>(exponent - MinExponent) * SubBuckets + sub;
+}
+auto Metrics::Histogram::record(Clock::duration duration)->void {
+	auto ns = static_cast<uint64_t>(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()));
+	m_buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+	m_sumNs.fetch_add(ns, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+auto Metrics::find_series(const string& name, const string& help, Type type, const string& labels)->pair<Family*, void*> {
+	auto it = std::find_if(m_families.begin(), m_families.end(), [&name](auto& family) { return family->name == name; });
+	if (it == m_families.end()) {
+		m_families.emplace_back(std::make_unique<Family>(Family{name, help, type, {}}));
+		it = std::prev(m_families.end());
+	}
+	else if ((*it)->type != type)
+		throw std::logic_error("metric '" + name + "' registered with another type");
+	auto& family = **it;
+	for (auto& series : family.series) {
+		if (series.first == labels)
+			return {&family, series.second};
+	}
+	return {&family, nullptr};
+}
+auto Metrics::counter(const string& name, const string& help, const string& labels)->Counter& {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto found = find_series(name, help, Type::Counter, labels);
+	if (found.second)
+		return *static_cast<Counter*>(found.second);
+	auto& series = m_counters.emplace_back();
+	found.first->series.emplace_back(labels, &series);
+	return series;
+}
+auto Metrics::gauge(const string& name, const string& help, const string& labels)->Gauge& {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto found = find_series(name, help, Type::Gauge, labels);
+	if (found.second)
+		return *static_cast<Gauge*>(found.second);
+	auto& series = m_gauges.emplace_back();
+	found.first->series.emplace_back(labels, &series);
+	return series;
+}
+auto Metrics::histogram(const string& name, const string& help, const string& labels)->Histogram& {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto found = find_series(name, help, Type::Histogram, labels);
+	if (found.second)
+		return *static_cast<Histogram*>(found.second);
+	auto& series = m_histograms.emplace_back();
+	found.first->series.emplace_back(labels, &series);
+	return series;
+}
+auto Metrics::render() const->string {
+	std::ostringstream ss;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto& family : m_families) {
+		ss << "# HELP " << family->name << ' ' << family->help << '\n';
+		ss << "# TYPE " << family->name << ' ' << type_name(static_cast<int>(family->type)) << '\n';
+		for (auto& series : family->series) {
+			auto braced = series.first.empty() ? string() : "{" + series.first + "}";
+			switch (family->type) {
+			case Type::Counter:
+				ss << family->name << braced << ' ' << static_cast<const Counter*>(series.second)->value() << '\n';
+				break;
+			case Type::Gauge:
+				ss << family->name << braced << ' ' << static_cast<const Gauge*>(series.second)->value() << '\n';
+				break;
+			case Type::Histogram: {
+				// buckets are exposed per power of two, the sub-buckets only sharpen the sum of each
+				auto& histogram = *static_cast<const Histogram*>(series.second);
+				uint64_t cumulative = histogram.m_buckets[0].load(std::memory_order_relaxed);
+				for (int exponent = Histogram::MinExponent; exponent < Histogram::MaxExponent; ++exponent) {
+					ss << family->name << "_bucket{" << with_label(series.first, "le=\"" + format_seconds(1ull << exponent) + "\"") << "} " << cumulative << '\n';
+					auto first = 1 + static_cast<size_t>(exponent - Histogram::MinExponent) * Histogram::SubBuckets;
+					for (size_t i = 0; i < Histogram::SubBuckets; ++i)
+						cumulative += histogram.m_buckets[first + i].load(std::memory_order_relaxed);
+				}
+				ss << family->name << "_bucket{" << with_label(series.first, "le=\"" + format_seconds(1ull << Histogram::MaxExponent) + "\"") << "} " << cumulative << '\n';
+				cumulative += histogram.m_buckets[Histogram::NumBuckets - 1].load(std::memory_order_relaxed);
+				ss << family->name << "_bucket{" << with_label(series.first, "le=\"+Inf\"") << "} " << cumulative << '\n';
+				ss << family->name << "_sum" << braced << ' ' << format_seconds(histogram.m_sumNs.load(std::memory_order_relaxed)) << '\n';
+				// the count is taken from the buckets so they agree while recording goes on
+				ss << family->name << "_count" << braced << ' ' << cumulative << '\n';
+				break;
+			}
+			}
+		}
+	}
+	return ss.str();
+}
\ No newline at end of file
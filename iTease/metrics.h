@@ -0,0 +1,116 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include "common.h"
+
+namespace iTease {
+	/**
+	 * Metrics - a registry of counters, gauges and histograms, rendered in the Prometheus text format
+	 * Series are registered once (under a lock) and then updated with relaxed atomics only, so recording is safe and cheap from any thread
+	**/
+	class Metrics {
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		class alignas(64) Counter {
+		public:
+			auto add(uint64_t n = 1) { m_value.fetch_add(n, std::memory_order_relaxed); }
+			auto value() const { return m_value.load(std::memory_order_relaxed); }
+
+		private:
+			std::atomic<uint64_t> m_value{0};
+		};
+
+		class alignas(64) Gauge {
+		public:
+			auto set(int64_t v) { m_value.store(v, std::memory_order_relaxed); }
+			auto add(int64_t n = 1) { m_value.fetch_add(n, std::memory_order_relaxed); }
+			auto sub(int64_t n = 1) { m_value.fetch_sub(n, std::memory_order_relaxed); }
+			auto value() const { return m_value.load(std::memory_order_relaxed); }
+
+		private:
+			std::atomic<int64_t> m_value{0};
+		};
+
+		/**
+		 * Histogram - durations in log-linear buckets (4 per power of two, from 1us to about a minute), like an HDR histogram
+		**/
+		class Histogram {
+		public:
+			static constexpr int MinExponent = 10;		// 2^10ns, about 1us
+			static constexpr int MaxExponent = 36;		// 2^36ns, about 69s
+			static constexpr int SubBuckets = 4;
+			static constexpr size_t NumBuckets = (MaxExponent - MinExponent) * SubBuckets + 2;
+
+			auto record(Clock::duration)->void;
+			auto count() const { return m_count.load(std::memory_order_relaxed); }
+
+		private:
+			friend class Metrics;
+
+			// bucket 0 holds values up to 2^MinExponent, the last one values beyond 2^MaxExponent
+			static auto bucket_of(uint64_t ns)->size_t;
+
+			std::array<std::atomic<uint64_t>, NumBuckets> m_buckets{};
+			std::atomic<uint64_t> m_count{0};
+			std::atomic<uint64_t> m_sumNs{0};
+		};
+
+		/**
+		 * Timer - records the time from its construction to its destruction
+		**/
+		class Timer {
+		public:
+			Timer(Histogram& histogram) : m_histogram(&histogram), m_start(Clock::now())
+			{ }
+			Timer(const Timer&) = delete;
+			~Timer() {
+				if (m_histogram) m_histogram->record(Clock::now() - m_start);
+			}
+
+			// drops the measurement, e.g. when the timed work turned out not to happen
+			auto cancel() { m_histogram = nullptr; }
+
+		private:
+			Histogram* m_histogram;
+			Clock::time_point m_start;
+		};
+
+	public:
+		Metrics() = default;
+		Metrics(const Metrics&) = delete;
+		auto operator=(const Metrics&)->Metrics& = delete;
+
+		// returns the series of a metric, registering it on first use, labels are given in exposition form: code="200",method="GET"
+		// registering again (e.g. as modules restart) returns the same series
+		auto counter(const string& name, const string& help, const string& labels = "")->Counter&;
+		auto gauge(const string& name, const string& help, const string& labels = "")->Gauge&;
+		auto histogram(const string& name, const string& help, const string& labels = "")->Histogram&;
+
+		// renders every series in the Prometheus text exposition format (version 0.0.4)
+		auto render() const->string;
+
+	private:
+		enum class Type { Counter, Gauge, Histogram };
+		struct Family {
+			string name;
+			string help;
+			Type type;
+			// labels to series, in registration order
+			vector<pair<string, void*>> series;
+		};
+
+		auto find_series(const string& name, const string& help, Type, const string& labels)->pair<Family*, void*>;
+
+	private:
+		mutable std::mutex m_mutex;
+		vector<unique_ptr<Family>> m_families;
+		// series storage, never moved once registered
+		std::deque<Counter> m_counters;
+		std::deque<Gauge> m_gauges;
+		std::deque<Histogram> m_histograms;
+	};
+}
\ No newline at end of file
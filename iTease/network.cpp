@@ -3,6 +3,10 @@
 #include <curl/easy.h>
 #include "application.h"
 #include "network.h"
+#include "reactor.h"
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 using namespace iTease;
 
@@ -88,7 +92,10 @@ NetMultiRequest& NetMultiRequest::operator=(NetMultiRequest&& v) {
 	return *this;
 }
 auto NetMultiRequest::add(NetRequestOptions opts)->shared_ptr<Listener> {
+	std::lock_guard<std::recursive_mutex> lock(m_mutex);
 	auto ptr = std::make_shared<NetRequest>(opts);
+	// with the socket interface curl may start the transfer as soon as it's added
+	if (m_socketFunc) ptr->apply();
 	const CURLMcode code = curl_multi_add_handle(m_curl.get(), ptr->curl());
 	if (code != CURLM_OK) throw NetMultiException(code);
 	auto listener = std::make_shared<Listener>(std::move(Listener{*this, ptr.get()}));
@@ -96,11 +103,13 @@ auto NetMultiRequest::add(NetRequestOptions opts)->shared_ptr<Listener> {
 	return listener;
 }
 auto NetMultiRequest::remove(NetRequest* req)->void {
+	std::lock_guard<std::recursive_mutex> lock(m_mutex);
 	const CURLMcode code = curl_multi_remove_handle(m_curl.get(), req->curl());
 	if (code != CURLM_OK) throw NetMultiException(code);
 	m_handles.erase(req->curl());
 }
 auto NetMultiRequest::perform()->bool {
+	std::lock_guard<std::recursive_mutex> lock(m_mutex);
 	auto numActive = m_numActive;
 	auto num = m_handles.size();
 	if (!num) return true;
@@ -108,22 +117,52 @@ auto NetMultiRequest::perform()->bool {
 		h.second->apply();
 	}
 	const CURLMcode code = curl_multi_perform(m_curl.get(), &m_numActive);
-	if (numActive > m_numActive) {
-		CURLMsg* msg;
-		while ((msg = curl_multi_info_read(m_curl.get(), &m_numQueued))) {
-			if (msg->msg == CURLMSG_DONE) {
-				auto& handle = *m_handles[msg->easy_handle];
-				handle.OnRequestComplete(handle.shared_from_this(), NetResponseInfo(handle.shared_from_this(), msg));
-				remove(&handle);
-			}
-		}
-	}
+	if (numActive > m_numActive)
+		complete_requests();
 	if (code == CURLM_CALL_MULTI_PERFORM)
 		return false;
 	if (code != CURLM_OK)
 		throw NetMultiException(code);
 	return true;
 }
+auto NetMultiRequest::set_socket_callbacks(SocketFunction socketFunc, TimerFunction timerFunc)->void {
+	std::lock_guard<std::recursive_mutex> lock(m_mutex);
+	m_socketFunc = std::move(socketFunc);
+	m_timerFunc = std::move(timerFunc);
+	curl_multi_setopt(m_curl.get(), CURLMOPT_SOCKETFUNCTION, &NetMultiRequest::socket_func);
+	curl_multi_setopt(m_curl.get(), CURLMOPT_SOCKETDATA, this);
+	curl_multi_setopt(m_curl.get(), CURLMOPT_TIMERFUNCTION, &NetMultiRequest::timer_func);
+	curl_multi_setopt(m_curl.get(), CURLMOPT_TIMERDATA, this);
+}
+auto NetMultiRequest::socket_action(curl_socket_t socket, int events)->void {
+	std::lock_guard<std::recursive_mutex> lock(m_mutex);
+	auto numActive = m_numActive;
+	const CURLMcode code = curl_multi_socket_action(m_curl.get(), socket, events, &m_numActive);
+	if (numActive > m_numActive)
+		complete_requests();
+	if (code != CURLM_OK)
+		throw NetMultiException(code);
+}
+auto NetMultiRequest::complete_requests()->void {
+	CURLMsg* msg;
+	while ((msg = curl_multi_info_read(m_curl.get(), &m_numQueued))) {
+		if (msg->msg == CURLMSG_DONE) {
+			auto& handle = *m_handles[msg->easy_handle];
+			handle.OnRequestComplete(handle.shared_from_this(), NetResponseInfo(handle.shared_from_this(), msg));
+			remove(&handle);
+		}
+	}
+}
+auto NetMultiRequest::socket_func(CURL*, curl_socket_t socket, int what, void* userp, void*)->int {
+	auto multi = static_cast<NetMultiRequest*>(userp);
+	if (multi->m_socketFunc) multi->m_socketFunc(socket, what);
+	return 0;
+}
+auto NetMultiRequest::timer_func(CURLM*, long timeoutMS, void* userp)->int {
+	auto multi = static_cast<NetMultiRequest*>(userp);
+	if (multi->m_timerFunc) multi->m_timerFunc(timeoutMS);
+	return 0;
+}
 auto NetMultiRequest::get_info(NetRequest* req)->optional<NetResponseInfo> {
 	CURLMsg* msg = nullptr;
 	while ((msg = curl_multi_info_read(m_curl.get(), &m_numQueued))) {
@@ -153,21 +192,79 @@ NetResponseInfo::NetResponseInfo(NetRequestPtr ptr, const CURLMsg* msg) : messag
 NetResponseInfo::NetResponseInfo(NetRequestPtr ptr, CURLcode code) : request(ptr), code(code)
 { }
 
-Network::Network(Application& app) : Module("net"), m_app(app)
+Network::Network(Application& app) : Module("net"), m_app(app),
+	m_requestCount(app.metrics.counter("itease_net_requests_total", "Outgoing requests made with net.Request.")),
+	m_activeCount(app.metrics.gauge("itease_net_requests_active", "Outgoing requests in progress."))
 { }
-Network::~Network() { }
+Network::~Network() {
+	// cleaning up the multi handle reports its sockets removed, so do it while we can still unwatch them
+	m_requests.reset();
+	#ifdef __linux__
+	if (auto reactor = m_app.reactor()) {
+		for (auto socket : m_sockets)
+			reactor->unwatch(socket);
+		if (m_timer)
+			reactor->cancel_timer(*m_timer);
+	}
+	#endif
+}
 auto Network::run()->void {
 	m_requests->perform();
+	m_activeCount.set(m_requests->num_active());
 	//curl_multi_perform(m_curl, );
 	//curl_multi_wait(m_curl, nullptr, 0, 1000, )
 }
 auto Network::init_module(Application& app)->void {
 	m_requests = std::make_shared<NetMultiRequest>();
+	if (m_app.reactor()) {
+		init_reactor();
+		return;
+	}
 	m_onTick = m_app.add_interval_callback(100, [this](long long& interval) {
 		m_requests->perform();
+		m_activeCount.set(m_requests->num_active());
 		return true;
 	});
 }
+auto Network::init_reactor()->void {
+	#ifdef __linux__
+	auto& reactor = *m_app.reactor();
+	// completion handlers call into JS, so socket actions exclude the request workers like ticks do
+	auto action = [this](curl_socket_t socket, int events) {
+		auto lock = m_app.lock_js();
+		m_requests->socket_action(socket, events);
+		m_activeCount.set(m_requests->num_active());
+	};
+	m_requests->set_socket_callbacks([this, &reactor, action](curl_socket_t socket, int what) {
+		if (what == CURL_POLL_REMOVE) {
+			reactor.unwatch(socket);
+			m_sockets.erase(std::remove(m_sockets.begin(), m_sockets.end(), socket), m_sockets.end());
+			return;
+		}
+		uint32_t events = 0;
+		if (what & CURL_POLL_IN) events |= EPOLLIN;
+		if (what & CURL_POLL_OUT) events |= EPOLLOUT;
+		reactor.watch(socket, events, [socket, action](uint32_t ready) {
+			int events = 0;
+			if (ready & EPOLLIN) events |= CURL_CSELECT_IN;
+			if (ready & EPOLLOUT) events |= CURL_CSELECT_OUT;
+			if (ready & (EPOLLERR | EPOLLHUP)) events |= CURL_CSELECT_ERR;
+			action(socket, events);
+		});
+		if (std::find(m_sockets.begin(), m_sockets.end(), socket) == m_sockets.end())
+			m_sockets.push_back(socket);
+	}, [this, &reactor, action](long timeoutMS) {
+		if (m_timer) {
+			reactor.cancel_timer(*m_timer);
+			m_timer.reset();
+		}
+		if (timeoutMS < 0) return;
+		m_timer = reactor.add_timer(Reactor::Clock::now() + std::chrono::milliseconds(timeoutMS), [action] {
+			action(CURL_SOCKET_TIMEOUT, 0);
+		});
+	});
+	#endif
+}
 auto Network::init_js(JS::Context& ctx)->void {
 	using namespace std::placeholders;
 	JS::StackAssert sa(ctx, 1);
@@ -195,6 +292,7 @@ auto Network::init_js(JS::Context& ctx)->void {
 				else js.raise(JS::TypeError("function or object"));
 
 				auto listener = m_requests->add(opts);
+				m_requestCount.add();
 				js.construct(JS::Shared<NetRequestJS>{std::make_shared<NetRequestJS>(listener)});
 				js.push(JS::This{ });
 				//js.pop();
@@ -1,6 +1,7 @@
 #pragma once
 #include <curl/curl.h>
 #include "common.h"
+#include "metrics.h"
 #include "module.h"
 #include "event.h"
 #include "network_detail.h"
@@ -140,6 +141,10 @@ namespace iTease {
 		friend class Listener;
 
 		using HandleMap = unordered_map<CURL*, shared_ptr<NetRequest>>;
+		// called with a socket and the CURL_POLL_* events curl wants it watched for
+		using SocketFunction = std::function<void(curl_socket_t, int what)>;
+		// called with the ms until socket_action(CURL_SOCKET_TIMEOUT) is due, -1 to cancel
+		using TimerFunction = std::function<void(long timeoutMS)>;
 
 		// Listener class to remove unreferenced NetRequest pointers from the NetMultiRequest
 		class Listener {
@@ -208,6 +213,10 @@ namespace iTease {
 		auto add(NetRequestOptions)->shared_ptr<Listener>;
 		// perform active requests, returns true if all are complete
 		auto perform()->bool;
+		// use curl's socket interface, transfers are then driven by socket_action() rather than perform()
+		auto set_socket_callbacks(SocketFunction, TimerFunction)->void;
+		// performs transfers for a ready socket (or CURL_SOCKET_TIMEOUT) given CURL_CSELECT_* events
+		auto socket_action(curl_socket_t, int events)->void;
 		// get information on all requests
 		auto get_info()->vector<NetResponseInfo>;
 		// returns true if the request has finished
@@ -220,6 +229,11 @@ namespace iTease {
 		auto get_info(NetRequest*)->optional<NetResponseInfo>;
 		// remove the request, done when the Listener goes out of scope
 		auto remove(NetRequest*)->void;
+		// fires completion events for finished requests and removes them
+		auto complete_requests()->void;
+
+		static auto socket_func(CURL*, curl_socket_t, int what, void* userp, void* socketp)->int;
+		static auto timer_func(CURLM*, long timeoutMS, void* userp)->int;
 
 	private:
 		// deleter for the multi handle
@@ -234,6 +248,10 @@ namespace iTease {
 		int m_numActive = 0;
 		int m_numQueued = 0;
 		HandleMap m_handles;
+		// requests may be added from worker contexts while the main loop performs transfers
+		std::recursive_mutex m_mutex;
+		SocketFunction m_socketFunc;
+		TimerFunction m_timerFunc;
 	};
 
 	using NetListener = NetMultiRequest::Listener;
@@ -258,11 +276,19 @@ namespace iTease {
 
 		auto run()->void;
 
+	private:
+		// registers curl's sockets and timeout with the application's reactor
+		auto init_reactor()->void;
+
 	private:
 		bool m_init = false;
 		Application& m_app;
 		Application::OnTickEvent::Listener m_onTick;
 		shared_ptr<NetMultiRequest> m_requests;
+		vector<curl_socket_t> m_sockets;
+		optional<uint64_t> m_timer;
+		Metrics::Counter& m_requestCount;
+		Metrics::Gauge& m_activeCount;
 	};
 	
 	namespace JS {
@@ -0,0 +1,42 @@
+#include "stdinc.h"
+#include "page_updates.h"
+
+using namespace iTease;
+
+auto PageUpdates::open(string session, string selector, string content)->uint64_t {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_entries.push_back({++m_lastId, std::move(session), {std::move(selector), std::move(content)}});
+	return m_lastId;
+}
+auto PageUpdates::set(uint64_t id, const string& content, bool complete, bool pushed)->bool {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = std::find_if(m_entries.begin(), m_entries.end(), [id](auto& entry) { return entry.id == id; });
+	if (it == m_entries.end())
+		return false;
+	it->update.content = content;
+	it->update.complete = complete;
+	it->update.pushed = pushed;
+	return true;
+}
+template<typename Drop>
+auto PageUpdates::take(const string& session, bool content, Drop drop)->vector<Update> {
+	vector<Update> updates;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto it = m_entries.begin(); it != m_entries.end(); ) {
+		// other sessions' updates are never seen
+		if (!it->session.empty() && it->session != session) {
+			++it;
+			continue;
+		}
+		updates.push_back(it->update);
+		if (!content) updates.back().content.clear();
+		it = drop(it->update) ? m_entries.erase(it) : std::next(it);
+	}
+	return updates;
+}
+auto PageUpdates::collect(const string& session)->vector<Update> {
+	return take(session, true, [](const Update& update) { return update.complete; });
+}
+auto PageUpdates::prepare(const string& session)->vector<Update> {
+	return take(session, false, [](const Update& update) { return update.complete && update.pushed; });
+}
\ No newline at end of file
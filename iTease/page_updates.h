@@ -0,0 +1,45 @@
+#pragma once
+#include <mutex>
+#include "common.h"
+
+namespace iTease {
+	/**
+	 * PageUpdates - changes to pages made after their response was sent, held until the page polls for them
+	 * Kept natively rather than in a JS context, so a poll served by any worker sees updates made by the others
+	**/
+	class PageUpdates {
+	public:
+		struct Update {
+			string selector;
+			string content;
+			bool complete = false;
+			// a stream was sent the completed update, so polls only need to list it once
+			bool pushed = false;
+		};
+
+	public:
+		// adds an update for the pages of a session, or for any page polling if session is empty, returns its id
+		auto open(string session, string selector, string content = "")->uint64_t;
+		// changes an update, returns false if it was completed and collected already
+		auto set(uint64_t id, const string& content, bool complete, bool pushed)->bool;
+		// returns the updates a session's pages may apply, dropping the completed ones
+		auto collect(const string& session)->vector<Update>;
+		// lists the updates a session's pages should expect, without their content, dropping completed ones already pushed
+		auto prepare(const string& session)->vector<Update>;
+
+	private:
+		struct Entry {
+			uint64_t id;
+			string session;
+			Update update;
+		};
+
+		template<typename Drop>
+		auto take(const string& session, bool content, Drop drop)->vector<Update>;
+
+	private:
+		std::mutex m_mutex;
+		vector<Entry> m_entries;
+		uint64_t m_lastId = 0;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,133 @@
+#include "stdinc.h"
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "range.h"
+
+using namespace iTease;
+
+// more ranges than this in one request is treated as abuse and the whole body is sent instead
+constexpr size_t MaxRanges = 16;
+
+static auto parse_offset(string_view sv, uint64_t& v)->bool {
+	if (sv.empty()) return false;
+	v = 0;
+	for (auto c : sv) {
+		if (c < '0' || c > '9') return false;
+		if (v > (UINT64_MAX - 9) / 10) return false;
+		v = v * 10 + (c - '0');
+	}
+	return true;
+}
+
+auto iTease::parse_ranges(const string& header, uint64_t size, vector<ByteRange>& ranges)->RangeResult {
+	ranges.clear();
+	string_view spec = trim(header);
+	if (spec.substr(0, 6) != "bytes=")
+		return RangeResult::None;
+	spec.remove_prefix(6);
+	bool any = false;
+	while (!spec.empty()) {
+		auto pos = spec.find(',');
+		auto item = trim(spec.substr(0, pos));
+		if (!item.empty()) {
+			any = true;
+			auto dash = item.find('-');
+			if (dash == string_view::npos)
+				return RangeResult::None;
+			auto firstStr = trim(item.substr(0, dash)), lastStr = trim(item.substr(dash + 1));
+			uint64_t first, last;
+			if (firstStr.empty()) {
+				// suffix range, the final N bytes
+				if (!parse_offset(lastStr, last)) return RangeResult::None;
+				if (last > 0 && size > 0)
+					ranges.push_back({last >= size ? 0 : size - last, size - 1});
+			}
+			else {
+				if (!parse_offset(firstStr, first)) return RangeResult::None;
+				if (lastStr.empty()) last = size ? size - 1 : 0;
+				else if (!parse_offset(lastStr, last) || last < first) return RangeResult::None;
+				if (first < size)
+					ranges.push_back({first, std::min(last, size - 1)});
+			}
+			if (ranges.size() > MaxRanges)
+				return RangeResult::None;
+		}
+		if (pos == string_view::npos) break;
+		spec.remove_prefix(pos + 1);
+	}
+	if (!any) return RangeResult::None;
+	return ranges.empty() ? RangeResult::Unsatisfiable : RangeResult::Satisfiable;
+}
+
+RangeBody::RangeBody(int fd, uint64_t size) : m_fd(fd), m_size(size)
+{ }
+RangeBody::RangeBody(shared_ptr<const string> data) : m_data(std::move(data)), m_size(m_data->size())
+{ }
+RangeBody::~RangeBody() {
+	if (m_fd >= 0) {
+		#ifdef _MSC_VER
+		_close(m_fd);
+		#else
+		close(m_fd);
+		#endif
+	}
+}
+auto RangeBody::release_fd()->void {
+	m_fd = -1;
+}
+auto RangeBody::set_multipart(const vector<ByteRange>& ranges, const string& boundary, const string& contentType)->uint64_t {
+	m_parts.clear();
+	uint64_t pos = 0;
+	for (auto& range : ranges) {
+		auto header = "\r\n--" + boundary + "\r\n";
+		if (!contentType.empty())
+			header += "Content-Type: " + contentType + "\r\n";
+		header += fmt::format("Content-Range: bytes {}-{}/{}\r\n\r\n", range.first, range.last, m_size);
+		m_parts.push_back({std::move(header), range, pos});
+		pos += m_parts.back().header.size() + range.length();
+	}
+	m_trailer = "\r\n--" + boundary + "--\r\n";
+	m_trailerStart = pos;
+	return pos + m_trailer.size();
+}
+auto RangeBody::read_multipart(uint64_t pos, char* buf, size_t max)->int64_t {
+	if (pos >= m_trailerStart) {
+		auto offset = pos - m_trailerStart;
+		if (offset >= m_trailer.size()) return 0;
+		auto n = std::min<uint64_t>(max, m_trailer.size() - offset);
+		std::memcpy(buf, m_trailer.data() + offset, static_cast<size_t>(n));
+		return static_cast<int64_t>(n);
+	}
+	// find the part containing pos, parts are in body order
+	auto it = std::upper_bound(m_parts.begin(), m_parts.end(), pos, [](uint64_t p, const Part& part) {
+		return p < part.start;
+	});
+	auto& part = *(it - 1);
+	auto offset = pos - part.start;
+	if (offset < part.header.size()) {
+		auto n = std::min<uint64_t>(max, part.header.size() - offset);
+		std::memcpy(buf, part.header.data() + offset, static_cast<size_t>(n));
+		return static_cast<int64_t>(n);
+	}
+	offset -= part.header.size();
+	auto n = std::min<uint64_t>(max, part.range.length() - offset);
+	return read(part.range.first + offset, buf, static_cast<size_t>(n));
+}
+auto RangeBody::read(uint64_t offset, char* buf, size_t max)->int64_t {
+	if (m_data) {
+		if (offset >= m_data->size()) return 0;
+		auto n = std::min<uint64_t>(max, m_data->size() - offset);
+		std::memcpy(buf, m_data->data() + offset, static_cast<size_t>(n));
+		return static_cast<int64_t>(n);
+	}
+	#ifdef _MSC_VER
+	if (_lseeki64(m_fd, static_cast<__int64>(offset), SEEK_SET) < 0)
+		return -1;
+	return _read(m_fd, buf, static_cast<unsigned int>(std::min<size_t>(max, INT_MAX)));
+	#else
+	return pread(m_fd, buf, max, static_cast<off_t>(offset));
+	#endif
+}
\ No newline at end of file
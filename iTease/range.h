@@ -0,0 +1,67 @@
+#pragma once
+#include "common.h"
+
+namespace iTease {
+	// inclusive byte range of a body
+	struct ByteRange {
+		uint64_t first;
+		uint64_t last;
+
+		auto length() const { return last - first + 1; }
+	};
+
+	enum class RangeResult : int {
+		// no usable Range header, send the whole body
+		None,
+		Satisfiable,
+		Unsatisfiable
+	};
+
+	// parses a "bytes=" Range header against a body of the given size
+	extern auto parse_ranges(const string& header, uint64_t size, vector<ByteRange>& ranges)->RangeResult;
+
+	/**
+	 * RangeBody - reads a body from a file descriptor or a shared buffer at arbitrary offsets
+	 * Builds multipart/byteranges bodies part by part, so memory stays bounded whatever the file size
+	**/
+	class RangeBody {
+	public:
+		// takes ownership of the fd
+		RangeBody(int fd, uint64_t size);
+		RangeBody(shared_ptr<const string> data);
+		~RangeBody();
+		RangeBody(const RangeBody&) = delete;
+		auto operator=(const RangeBody&)->RangeBody& = delete;
+
+		auto size() const { return m_size; }
+		auto fd() const { return m_fd; }
+		auto data() const { return m_data; }
+		// hands the fd over to its new owner (e.g. MHD), the body no longer closes it
+		auto release_fd()->void;
+
+		// lays out a multipart/byteranges body for the ranges, returns its total length
+		auto set_multipart(const vector<ByteRange>&, const string& boundary, const string& contentType)->uint64_t;
+		// reads up to max bytes of the multipart body at pos, returns the number read, -1 on error
+		auto read_multipart(uint64_t pos, char* buf, size_t max)->int64_t;
+
+	private:
+		// reads up to max bytes of the underlying body at offset
+		auto read(uint64_t offset, char* buf, size_t max)->int64_t;
+
+	private:
+		struct Part {
+			// delimiter and part headers, preceding the data
+			string header;
+			ByteRange range;
+			// offset of the part in the multipart body
+			uint64_t start;
+		};
+
+		int m_fd = -1;
+		shared_ptr<const string> m_data;
+		uint64_t m_size = 0;
+		vector<Part> m_parts;
+		string m_trailer;
+		uint64_t m_trailerStart = 0;
+	};
+}
\ No newline at end of file
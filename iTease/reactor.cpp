@@ -0,0 +1,127 @@
+#include "stdinc.h"
+#include "reactor.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <system_error>
+
+using namespace iTease;
+
+constexpr int MaxEvents = 64;
+
+Reactor::Reactor() {
+	m_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epoll < 0)
+		throw std::system_error(errno, std::generic_category(), "epoll_create1");
+	m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_wakeFd < 0) {
+		close(m_epoll);
+		throw std::system_error(errno, std::generic_category(), "eventfd");
+	}
+	watch(m_wakeFd, EPOLLIN, [this](uint32_t) {
+		uint64_t v;
+		while (read(m_wakeFd, &v, sizeof(v)) > 0);
+	});
+}
+Reactor::~Reactor() {
+	close(m_wakeFd);
+	close(m_epoll);
+}
+auto Reactor::watch(int fd, uint32_t events, Handler handler)->void {
+	{
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		epoll_event ev{};
+		ev.events = events;
+		ev.data.fd = fd;
+		auto it = m_handlers.find(fd);
+		auto op = it != m_handlers.end() ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+		if (epoll_ctl(m_epoll, op, fd, &ev) < 0)
+			throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+		m_handlers[fd] = std::make_shared<Handler>(std::move(handler));
+	}
+	changed();
+}
+auto Reactor::unwatch(int fd)->void {
+	std::lock_guard<std::recursive_mutex> lock(m_mutex);
+	if (m_handlers.erase(fd))
+		epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+}
+auto Reactor::add_timer(Clock::time_point deadline, TimerHandler handler)->TimerID {
+	TimerID id;
+	{
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		id = m_nextTimer++;
+		m_timers.emplace(id, Timer{deadline, std::move(handler)});
+	}
+	changed();
+	return id;
+}
+auto Reactor::cancel_timer(TimerID id)->void {
+	std::lock_guard<std::recursive_mutex> lock(m_mutex);
+	m_timers.erase(id);
+}
+auto Reactor::run_once(optional<Clock::duration> timeout)->void {
+	{
+		// sleep until the earliest of the given timeout and the next timer
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		m_thread = std::this_thread::get_id();
+		auto now = Clock::now();
+		for (auto& pr : m_timers) {
+			auto remaining = std::max(pr.second.deadline - now, Clock::duration::zero());
+			if (!timeout || remaining < *timeout)
+				timeout = remaining;
+		}
+	}
+	int ms = -1;
+	if (timeout) {
+		// round up so we don't wake just before a deadline and spin
+		auto rounded = std::chrono::ceil<std::chrono::milliseconds>(std::max(*timeout, Clock::duration::zero()));
+		ms = static_cast<int>(std::min<long long>(rounded.count(), INT_MAX));
+	}
+
+	epoll_event events[MaxEvents];
+	auto n = epoll_wait(m_epoll, events, MaxEvents, ms);
+	if (n < 0 && errno != EINTR)
+		throw std::system_error(errno, std::generic_category(), "epoll_wait");
+	for (int i = 0; i < n; ++i) {
+		// handlers may unwatch fds (including their own) as they run, so look each one up as we go
+		shared_ptr<Handler> handler;
+		{
+			std::lock_guard<std::recursive_mutex> lock(m_mutex);
+			auto it = m_handlers.find(events[i].data.fd);
+			if (it == m_handlers.end()) continue;
+			handler = it->second;
+		}
+		(*handler)(events[i].events);
+	}
+	run_timers();
+}
+auto Reactor::wake()->void {
+	uint64_t v = 1;
+	write(m_wakeFd, &v, sizeof(v));
+}
+auto Reactor::changed()->void {
+	auto thread = m_thread.load();
+	if (thread != std::thread::id{} && thread != std::this_thread::get_id())
+		wake();
+}
+auto Reactor::run_timers()->void {
+	vector<TimerHandler> due;
+	{
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		auto now = Clock::now();
+		for (auto it = m_timers.begin(); it != m_timers.end(); ) {
+			if (it->second.deadline <= now) {
+				due.push_back(std::move(it->second.handler));
+				it = m_timers.erase(it);
+			}
+			else ++it;
+		}
+	}
+	for (auto& handler : due)
+		handler();
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,58 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "common.h"
+
+#ifdef __linux__
+namespace iTease {
+	/**
+	 * Reactor - waits on file descriptors and timer deadlines in a single epoll_wait
+	 * Watches and timers may be changed from any thread, handlers run on the thread calling run_once()
+	**/
+	class Reactor {
+	public:
+		using Clock = std::chrono::steady_clock;
+		using Handler = std::function<void(uint32_t events)>;
+		using TimerHandler = std::function<void()>;
+		using TimerID = uint64_t;
+
+		Reactor();
+		~Reactor();
+		Reactor(const Reactor&) = delete;
+		auto operator=(const Reactor&)->Reactor& = delete;
+
+		// watches fd for the EPOLL* events, replacing any existing handler for the fd
+		auto watch(int fd, uint32_t events, Handler)->void;
+		auto unwatch(int fd)->void;
+		// calls the handler once at the deadline, returns an ID for cancel_timer
+		auto add_timer(Clock::time_point deadline, TimerHandler)->TimerID;
+		auto cancel_timer(TimerID)->void;
+		// waits until an fd is ready, a timer is due or the timeout elapses (forever if none), then dispatches
+		auto run_once(optional<Clock::duration> timeout = std::nullopt)->void;
+		// interrupts a run_once() in progress, may be called from any thread
+		auto wake()->void;
+
+	private:
+		auto run_timers()->void;
+		// wakes the reactor if it's waiting on another thread, so it picks up the change
+		auto changed()->void;
+
+	private:
+		struct Timer {
+			Clock::time_point deadline;
+			TimerHandler handler;
+		};
+
+		int m_epoll = -1;
+		int m_wakeFd = -1;
+		std::atomic<std::thread::id> m_thread{};
+		std::recursive_mutex m_mutex;
+		TimerID m_nextTimer = 1;
+		unordered_map<int, shared_ptr<Handler>> m_handlers;
+		map<TimerID, Timer> m_timers;
+	};
+}
+#endif
\ No newline at end of file
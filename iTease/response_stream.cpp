@@ -0,0 +1,93 @@
+#include "stdinc.h"
+#include "response_stream.h"
+
+using namespace iTease;
+
+// how long a write waits for the client to make room before the response is abandoned
+constexpr auto StreamWriteTimeout = std::chrono::seconds(30);
+
+ResponseStream::Writer::Writer(ResponseStream& stream) : m_stream(stream) {
+	setp(m_buffer, m_buffer + sizeof(m_buffer));
+}
+ResponseStream::Writer::~Writer() {
+	sync();
+}
+auto ResponseStream::Writer::overflow(int_type c)->int_type {
+	if (sync() != 0)
+		return traits_type::eof();
+	if (!traits_type::eq_int_type(c, traits_type::eof())) {
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+	}
+	return traits_type::not_eof(c);
+}
+auto ResponseStream::Writer::sync()->int {
+	auto size = static_cast<size_t>(pptr() - pbase());
+	if (!size) return 0;
+	setp(m_buffer, m_buffer + sizeof(m_buffer));
+	return m_stream.write(string_view{m_buffer, size}) ? 0 : -1;
+}
+
+ResponseStream::ResponseStream(size_t capacity) : m_buffer(std::max<size_t>(capacity, 1))
+{ }
+auto ResponseStream::write(string_view data)->bool {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!data.empty()) {
+		if (!m_writable.wait_for(lock, StreamWriteTimeout, [this] { return m_state != State::Open || m_size < m_buffer.size(); })) {
+			m_state = State::Failed;
+			wake();
+		}
+		if (m_state != State::Open)
+			return false;
+		// copy into the free space after the buffered data, which may wrap around
+		auto tail = (m_head + m_size) % m_buffer.size();
+		auto n = std::min(data.size(), std::min(m_buffer.size() - m_size, m_buffer.size() - tail));
+		std::memcpy(&m_buffer[tail], data.data(), n);
+		m_size += n;
+		data.remove_prefix(n);
+		wake();
+	}
+	return true;
+}
+auto ResponseStream::close()->void {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_state == State::Open)
+		m_state = State::Closed;
+	wake();
+}
+auto ResponseStream::fail()->void {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_state = State::Failed;
+	m_writable.notify_all();
+	wake();
+}
+auto ResponseStream::read(char* buf, size_t max)->int64_t {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_state == State::Failed)
+		return -2;
+	if (!m_size) {
+		if (m_state == State::Closed)
+			return -1;
+		// the server thread moves on to other connections until the next write
+		if (!m_suspended && suspend) {
+			m_suspended = true;
+			suspend();
+		}
+		return 0;
+	}
+	auto n = std::min(max, std::min(m_size, m_buffer.size() - m_head));
+	std::memcpy(buf, &m_buffer[m_head], n);
+	m_head = (m_head + n) % m_buffer.size();
+	m_size -= n;
+	m_writable.notify_one();
+	return static_cast<int64_t>(n);
+}
+auto ResponseStream::cancel()->void {
+	fail();
+}
+auto ResponseStream::wake()->void {
+	if (m_suspended) {
+		m_suspended = false;
+		if (resume) resume();
+	}
+}
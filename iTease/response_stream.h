@@ -0,0 +1,72 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <streambuf>
+#include "common.h"
+
+namespace iTease {
+	/**
+	 * ResponseStream - bounded buffer between a producer writing a body and the server sending it
+	 * Writers block while the buffer is full, so a response holds at most its capacity however long the body
+	**/
+	class ResponseStream {
+	public:
+		static constexpr size_t DefaultCapacity = 64 * 1024;
+
+		/**
+		 * Writer - stream buffer writing to a ResponseStream, for producers rendering to std::ostream
+		**/
+		class Writer : public std::streambuf {
+		public:
+			Writer(ResponseStream&);
+			~Writer();
+
+		protected:
+			auto overflow(int_type c)->int_type override;
+			auto sync()->int override;
+
+		private:
+			ResponseStream& m_stream;
+			char m_buffer[4096];
+		};
+
+	public:
+		ResponseStream(size_t capacity = DefaultCapacity);
+		ResponseStream(const ResponseStream&) = delete;
+		auto operator=(const ResponseStream&)->ResponseStream& = delete;
+
+		// set by the server, called with the stream's lock held so a resume can never overtake its suspend
+		std::function<void()> suspend;
+		std::function<void()> resume;
+
+		// appends to the body, blocking while the buffer is full, returns false once the stream can't be written
+		auto write(string_view)->bool;
+		// ends the body
+		auto close()->void;
+		// ends the body with an error, the connection is dropped
+		auto fail()->void;
+
+		// copies buffered data to buf, suspending the connection if there is none
+		// returns the number of bytes copied (0 once suspended), -1 at the end of the body, -2 if it failed
+		auto read(char* buf, size_t max)->int64_t;
+		// called when the client is gone, unblocks and fails the writer
+		auto cancel()->void;
+
+	private:
+		enum class State { Open, Closed, Failed };
+
+		// resumes the connection if the reader suspended it, called with the lock held
+		auto wake()->void;
+
+	private:
+		std::mutex m_mutex;
+		std::condition_variable m_writable;
+		vector<char> m_buffer;
+		size_t m_head = 0;
+		size_t m_size = 0;
+		State m_state = State::Open;
+		bool m_suspended = false;
+	};
+}
@@ -0,0 +1,126 @@
+#include "stdinc.h"
+#include "router.h"
+#include "server.h"
+
+using namespace iTease;
+
+// pops the next non-empty segment off path
+static auto next_segment(string_view& path)->string_view {
+	while (!path.empty() && path.front() == '/')
+		path.remove_prefix(1);
+	auto pos = path.find('/');
+	auto segment = path.substr(0, pos);
+	path.remove_prefix(pos == string_view::npos ? path.size() : pos);
+	return segment;
+}
+
+auto Router::Route::operator=(Route&& other)->Route& {
+	reset();
+	m_router = std::move(other.m_router);
+	m_id = other.m_id;
+	other.m_router.reset();
+	return *this;
+}
+Router::Route::~Route() {
+	reset();
+}
+auto Router::Route::reset()->void {
+	if (auto router = m_router.lock())
+		(*router)->remove(m_id);
+	m_router.reset();
+}
+
+Router::Router() : m_self(std::make_shared<Router*>(this))
+{ }
+auto Router::add(const string& method, const string& pattern, Handler handler)->Route {
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	auto node = &m_root;
+	string_view path = pattern;
+	for (auto segment = next_segment(path); !segment.empty(); segment = next_segment(path)) {
+		if (segment.front() == ':') {
+			if (!node->param) {
+				node->param = std::make_unique<Node>();
+				node->param_name = string(segment.substr(1));
+			}
+			else if (node->param_name != segment.substr(1))
+				throw std::invalid_argument("route '" + pattern + "' renames parameter '" + node->param_name + "'");
+			node = node->param.get();
+		}
+		else if (segment.front() == '*') {
+			if (!path.empty() && next_segment(path).size())
+				throw std::invalid_argument("route '" + pattern + "' has segments after a wildcard");
+			if (!node->wildcard) {
+				node->wildcard = std::make_unique<Node>();
+				node->wildcard_name = string(segment.substr(1));
+			}
+			node = node->wildcard.get();
+			break;
+		}
+		else {
+			auto it = node->children.find(segment);
+			if (it == node->children.end())
+				it = node->children.emplace(string(segment), std::make_unique<Node>()).first;
+			node = it->second.get();
+		}
+	}
+	auto id = m_nextId++;
+	node->entries.push_back({id, strtoupper(method), std::make_shared<const Handler>(std::move(handler))});
+	return Route{*this, id};
+}
+auto Router::dispatch(const ServerRequest& request, ServerResponse& response) const->bool {
+	vector<Candidate> candidates;
+	{
+		std::shared_lock<std::shared_mutex> lock(m_mutex);
+		RouteParams params;
+		match(m_root, request.uri, request.method, params, candidates);
+	}
+	for (auto& candidate : candidates) {
+		if ((*candidate.handler)(request, response, candidate.params))
+			return true;
+	}
+	return false;
+}
+auto Router::remove(size_t id)->void {
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	// routes are few and rarely removed, so walking the whole trie is fine
+	std::function<bool(Node&)> erase = [&](Node& node) {
+		auto it = std::find_if(node.entries.begin(), node.entries.end(), [id](const Entry& e) { return e.id == id; });
+		if (it != node.entries.end()) {
+			node.entries.erase(it);
+			return true;
+		}
+		for (auto& child : node.children)
+			if (erase(*child.second)) return true;
+		return (node.param && erase(*node.param)) || (node.wildcard && erase(*node.wildcard));
+	};
+	erase(m_root);
+}
+auto Router::match(const Node& node, string_view path, const string& method, RouteParams& params, vector<Candidate>& candidates) const->void {
+	auto rest = path;
+	auto segment = next_segment(rest);
+	if (segment.empty())
+		collect(node, method, params, candidates);
+	else {
+		auto it = node.children.find(segment);
+		if (it != node.children.end())
+			match(*it->second, rest, method, params, candidates);
+		if (node.param) {
+			params.emplace_back(node.param_name, string(segment));
+			match(*node.param, rest, method, params, candidates);
+			params.pop_back();
+		}
+	}
+	if (node.wildcard) {
+		while (!path.empty() && path.front() == '/')
+			path.remove_prefix(1);
+		params.emplace_back(node.wildcard_name, string(path));
+		collect(*node.wildcard, method, params, candidates);
+		params.pop_back();
+	}
+}
+auto Router::collect(const Node& node, const string& method, const RouteParams& params, vector<Candidate>& candidates) const->void {
+	for (auto& entry : node.entries) {
+		if (entry.method == "*" || entry.method == method || (entry.method == "GET" && method == "HEAD"))
+			candidates.push_back({entry.handler, params});
+	}
+}
\ No newline at end of file
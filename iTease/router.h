@@ -0,0 +1,88 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include "common.h"
+
+namespace iTease {
+	struct ServerRequest;
+	struct ServerResponse;
+
+	// values captured by ":name" and "*name" segments of the matched route
+	using RouteParams = vector<pair<string, string>>;
+
+	/**
+	 * Router - trie over URI path segments resolving requests to handlers by method and path
+	 * Patterns are made of literal segments, ":name" segments matching any one segment and a trailing "*name" matching the rest
+	 * Literal segments take precedence over parameters, which take precedence over wildcards
+	**/
+	class Router {
+	public:
+		using Handler = std::function<bool(const ServerRequest&, ServerResponse&, const RouteParams&)>;
+
+		/**
+		 * Route - keeps a handler registered for as long as it lives, like an event listener
+		**/
+		class Route {
+			friend class Router;
+
+		public:
+			Route() = default;
+			Route(Route&&) = default;
+			auto operator=(Route&& other)->Route&;
+			~Route();
+
+			auto reset()->void;
+
+		private:
+			Route(const Router& router, size_t id) : m_router(router.m_self), m_id(id)
+			{ }
+
+		private:
+			std::weak_ptr<Router*> m_router;
+			size_t m_id = 0;
+		};
+
+	public:
+		Router();
+		Router(const Router&) = delete;
+		auto operator=(const Router&)->Router& = delete;
+
+		// registers a handler, method is "*" to match any, HEAD requests are also matched by GET routes
+		auto add(const string& method, const string& pattern, Handler)->Route;
+		// calls the handlers of routes matching the request until one handles it, returns true if one did
+		// handlers run without the router locked, so they may add and remove routes
+		auto dispatch(const ServerRequest&, ServerResponse&) const->bool;
+
+	private:
+		struct Entry {
+			size_t id;
+			string method;
+			// shared so a match can hold on to it past the lock, even should the route be removed
+			shared_ptr<const Handler> handler;
+		};
+		struct Candidate {
+			shared_ptr<const Handler> handler;
+			RouteParams params;
+		};
+		struct Node {
+			std::map<string, unique_ptr<Node>, std::less<>> children;
+			unique_ptr<Node> param;
+			string param_name;
+			unique_ptr<Node> wildcard;
+			string wildcard_name;
+			vector<Entry> entries;
+		};
+
+		auto remove(size_t id)->void;
+		// lists the handlers matching the path in the order they are to be tried
+		auto match(const Node&, string_view path, const string& method, RouteParams&, vector<Candidate>&) const->void;
+		auto collect(const Node&, const string& method, const RouteParams&, vector<Candidate>&) const->void;
+
+	private:
+		shared_ptr<Router*> m_self;
+		mutable std::shared_mutex m_mutex;
+		Node m_root;
+		size_t m_nextId = 1;
+	};
+}
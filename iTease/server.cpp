@@ -1,63 +1,137 @@
 #include "stdinc.h"
 #include <sstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include <ws2tcpip.h>
+#else
+#include <unistd.h>
+#include <netinet/in.h>
+#endif
 #include <libmicrohttpd/microhttpd.h>
 #include "server.h"
 #include "application.h"
+#include "range.h"
+#include "upload.h"
+#include "system.h"
 #include "logging.h"
 
 using namespace iTease;
 
 const char* msg_server_busy = "Too many requests, server busy";
+const char* msg_not_found = "404 Not Found";
+const char* msg_too_large = "413 Payload Too Large";
+const char* msg_upload_failed = "500 Upload Failed";
+// limits in-memory form fields, file parts are streamed to disk and limited separately
 constexpr int MaxPostSize = 8 * 1024 * 1024; // 8MB
+constexpr long long SessionTickInterval = 1000;
+constexpr long long EventsHeartbeatInterval = 15000;
+constexpr uint64_t MaxUploadSize = 1024ull * 1024 * 1024; // 1GB, all files of a request together
+constexpr size_t MaxUploadFiles = 64;
 constexpr int PostBufferSize = 1024;
+// smallest bodies worth compressing, dynamic output is compressed on every request so it needs to be larger
+constexpr size_t MinStaticCompressSize = 256;
+constexpr size_t MinDynamicCompressSize = 1024;
 constexpr int ConnectionTypeGET = 0;
 constexpr int ConnectionTypePOST = 1;
+constexpr const char* ResponseCountHelp = "HTTP responses queued, by status class.";
 
 namespace iTease {
+	// a request slot, slots live in a fixed pool so their addresses stay valid while MHD holds them
 	struct ServerConnection {
 		MHD_PostProcessor* processor = nullptr;
 		ServerRequest request;
 		ServerMethod method;
 		size_t input_size = 0;
-
+		// bytes of uploaded files, counted across the request's files
+		uint64_t upload_size = 0;
+		// set when the body was rejected, answered once it has been read
+		int error_status = 0;
+		bool last_posted_data_was_file = false;
+		// takes the socket once the response switching protocols has been sent
+		std::function<void(shared_ptr<WebSocket>)> upgrade;
+		// the buffered body moved out of the response, MHD sends it from here until the request finishes
+		string body;
+		// what the request was admitted as, static ones are served without a session
+		AdmissionControl::Budget budget = AdmissionControl::Budget::Static;
+		// place under the concurrency limit, taken once the body was read and held while the handler runs
+		AdmissionControl::Ticket ticket;
+		// the connection the slot is serving, cleared once the slot is back in the pool
+		std::atomic<MHD_Connection*> connection = nullptr;
+		// set once the request holds a place among the long-lived connections
+		bool stream = false;
+		// next slot in the free list
+		ServerConnection* next_free = nullptr;
+
+		// prepares the slot for a new request, keeping the capacity of its strings and maps
+		auto reset(MHD_Connection* con, const char* uri, const char* method)->void;
 		auto add_post_data(const char* key, const char* filename, const char* content_type, const char* transfer_encoding, const char* data, size_t size)->bool;
 		auto append_post_data(const char* key, const char* data, size_t size)->bool;
 	};
 }
 
+auto ServerConnection::reset(MHD_Connection* con, const char* uri, const char* method_str)->void {
+	processor = nullptr;
+	input_size = 0;
+	upload_size = 0;
+	error_status = 0;
+	last_posted_data_was_file = false;
+	upgrade = nullptr;
+	ticket.release(false);
+	connection = con;
+	stream = false;
+	method = std::strcmp(method_str, "POST") == 0 ? ServerMethod::POST : ServerMethod::GET;
+	request.uri.assign(uri);
+	request.method.assign(method_str);
+	request.headers.attach(con);
+	request.params.attach(con);
+	request.cookies.attach(con);
+	request.post_data.clear();
+	request.files.clear();
+	request.session = nullptr;
+}
 bool ServerConnection::add_post_data(const char* key, const char* filename, const char* content_type, const char* transfer_encoding, const char* data, size_t size) {
+	last_posted_data_was_file = filename != nullptr;
 	if (filename) {
-		// todo: implement temporary file manager
-		/*std::unique_ptr<FileInfo> file_info{
-			new FileInfo{key, filename, content_type ? content_type : "",
-			transfer_encoding ? transfer_encoding : ""}};
-		file_info->temp_file_name = GetTempFileManager()->CreateTempFileName(id_);
-		file_info->data_stream = brillo::FileStream::Open(
-			file_info->temp_file_name, brillo::Stream::AccessMode::READ_WRITE,
-			brillo::FileStream::Disposition::CREATE_ALWAYS, nullptr);
-		if (!file_info->data_stream ||
-			!file_info->data_stream->WriteAllBlocking(data, size, nullptr)) {
+		if (request.files.size() >= MaxUploadFiles || upload_size + size > MaxUploadSize) {
+			error_status = MHD_HTTP_PAYLOAD_TOO_LARGE;
 			return false;
 		}
-		file_info_.push_back(std::move(file_info));
-		last_posted_data_was_file_ = true;*/
+		upload_size += size;
+		auto file = std::make_shared<UploadedFile>(key, filename, content_type ? content_type : "");
+		if (!file->open(data_path() / "uploads") || !file->write(data, size)) {
+			error_status = MHD_HTTP_INTERNAL_SERVER_ERROR;
+			return false;
+		}
+		request.files.push_back(std::move(file));
 		return true;
 	}
 	string value{data, size};
 	input_size += size;
 	request.post_data.emplace(key, std::move(value));
-	//last_posted_data_was_file_ = false;
 	return true;
 }
 
 bool ServerConnection::append_post_data(const char* key, const char* data, size_t size) {
-	/*if (last_posted_data_was_file_) {
-		CHECK(!file_info_.empty());
-		CHECK(file_info_.back()->field_name == key);
-		FileInfo* file_info = file_info_.back().get();
-		return file_info->data_stream->WriteAllBlocking(data, size, nullptr);
-	}*/
+	if (last_posted_data_was_file) {
+		auto& file = *request.files.back();
+		if (upload_size + size > MaxUploadSize) {
+			error_status = MHD_HTTP_PAYLOAD_TOO_LARGE;
+			return false;
+		}
+		upload_size += size;
+		if (!file.write(data, size)) {
+			error_status = MHD_HTTP_INTERNAL_SERVER_ERROR;
+			return false;
+		}
+		return true;
+	}
 
+	if (input_size + size > MaxPostSize) {
+		error_status = MHD_HTTP_PAYLOAD_TOO_LARGE;
+		return false;
+	}
 	(--request.post_data.end()).value().append(data, size);
 	input_size += size;
 	return true;
@@ -66,12 +140,14 @@ bool ServerConnection::append_post_data(const char* key, const char* data, size_
 auto iterate_post(void* coninfo, MHD_ValueKind kind, const char* key, const char* filename, const char* content_type, const char* transfer_encoding, const char* data, uint64_t off, size_t size)->int {
 	ServerConnection* con = static_cast<ServerConnection*>(coninfo);
 
-	if ((con->input_size + size) > MaxPostSize)
-		return MHD_NO;
+	// file chunks are written through, only form fields accumulate in memory
 	if (off > 0)
-		return con->append_post_data(key, data, size);
-
-	return con->add_post_data(key, filename, content_type, transfer_encoding, data, size);
+		return con->append_post_data(key, data, size) ? MHD_YES : MHD_NO;
+	if (!filename && (con->input_size + size) > MaxPostSize) {
+		con->error_status = MHD_HTTP_PAYLOAD_TOO_LARGE;
+		return MHD_NO;
+	}
+	return con->add_post_data(key, filename, content_type, transfer_encoding, data, size) ? MHD_YES : MHD_NO;
 }
 
 static auto send_response(MHD_Connection* con, const void* data, size_t data_size, int status_code)->int {
@@ -85,53 +161,280 @@ static auto send_response(MHD_Connection* con, const void* data, size_t data_siz
 	MHD_destroy_response(response);
 	return ret;
 }
+// sheds a request, telling the client when to try again
+static auto send_busy(MHD_Connection* con, std::chrono::seconds retry_after)->int {
+	int ret;
+	MHD_Response *response;
+
+	response = MHD_create_response_from_buffer(strlen(msg_server_busy), const_cast<char*>(msg_server_busy), MHD_RESPMEM_PERSISTENT);
+	if (!response) return MHD_NO;
+	MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/html");
+	MHD_add_response_header(response, MHD_HTTP_HEADER_RETRY_AFTER, std::to_string(retry_after.count()).c_str());
+	ret = MHD_queue_response(con, MHD_HTTP_SERVICE_UNAVAILABLE, response);
+	MHD_destroy_response(response);
+	return ret;
+}
+// the client's address bytes, without the port so all of its connections share a budget
+static auto client_key(MHD_Connection* con)->string {
+	auto info = MHD_get_connection_info(con, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+	if (!info || !info->client_addr)
+		return "";
+	auto addr = info->client_addr;
+	if (addr->sa_family == AF_INET) {
+		auto& in = reinterpret_cast<const sockaddr_in*>(addr)->sin_addr;
+		return string(reinterpret_cast<const char*>(&in), sizeof(in));
+	}
+	if (addr->sa_family == AF_INET6) {
+		auto& in = reinterpret_cast<const sockaddr_in6*>(addr)->sin6_addr;
+		return string(reinterpret_cast<const char*>(&in), sizeof(in));
+	}
+	return "";
+}
+// returns true for clients on this machine
+static auto is_loopback(MHD_Connection* con)->bool {
+	auto info = MHD_get_connection_info(con, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+	if (!info || !info->client_addr)
+		return false;
+	auto addr = info->client_addr;
+	if (addr->sa_family == AF_INET)
+		return reinterpret_cast<const uint8_t*>(&reinterpret_cast<const sockaddr_in*>(addr)->sin_addr)[0] == 127;
+	if (addr->sa_family == AF_INET6) {
+		auto bytes = reinterpret_cast<const uint8_t*>(&reinterpret_cast<const sockaddr_in6*>(addr)->sin6_addr);
+		static const uint8_t loopback[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+		static const uint8_t mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+		return std::memcmp(bytes, loopback, 16) == 0 || (std::memcmp(bytes, mapped, 12) == 0 && bytes[12] == 127);
+	}
+	return false;
+}
+// opens a file body, empty on failure
+static auto open_file(const string& path)->unique_ptr<RangeBody> {
+	#ifdef _MSC_VER
+	int fd = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+	struct _stat64 st;
+	if (fd < 0) return nullptr;
+	if (_fstat64(fd, &st) != 0) {
+		_close(fd);
+		return nullptr;
+	}
+	#else
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0) return nullptr;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return nullptr;
+	}
+	#endif
+	return std::make_unique<RangeBody>(fd, static_cast<uint64_t>(st.st_size));
+}
+// creates a response reading from a buffer that's kept alive until MHD is done with it
+static auto create_shared_response(shared_ptr<const string> content, size_t offset, size_t length)->MHD_Response* {
+	struct SharedBody {
+		shared_ptr<const string> content;
+		size_t offset;
+	};
+	auto body = new SharedBody{std::move(content), offset};
+	auto resp = MHD_create_response_from_callback(length, 32 * 1024, [](void* cls, uint64_t pos, char* buf, size_t max)->ssize_t {
+		auto& body = *static_cast<SharedBody*>(cls);
+		auto start = body.offset + static_cast<size_t>(pos);
+		if (start >= body.content->size())
+			return MHD_CONTENT_READER_END_OF_STREAM;
+		auto size = std::min<size_t>(max, body.content->size() - start);
+		std::memcpy(buf, body.content->data() + start, size);
+		return static_cast<ssize_t>(size);
+	}, body, [](void* cls) {
+		delete static_cast<SharedBody*>(cls);
+	});
+	if (!resp) delete body;
+	return resp;
+}
+// creates a chunked response sending the stream as it is written, suspended whenever nothing is buffered
+static auto create_stream_response(MHD_Connection* con, shared_ptr<ResponseStream> stream)->MHD_Response* {
+	// MHD allows suspending from the content reader, as event streams do
+	stream->suspend = [con] { MHD_suspend_connection(con); };
+	stream->resume = [con] { MHD_resume_connection(con); };
+	auto holder = new shared_ptr<ResponseStream>(std::move(stream));
+	auto resp = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 32 * 1024, [](void* cls, uint64_t pos, char* buf, size_t max)->ssize_t {
+		auto n = (*static_cast<shared_ptr<ResponseStream>*>(cls))->read(buf, max);
+		if (n == -1) return MHD_CONTENT_READER_END_OF_STREAM;
+		if (n < 0) return MHD_CONTENT_READER_END_WITH_ERROR;
+		return static_cast<ssize_t>(n);
+	}, holder, [](void* cls) {
+		// also reached when the client goes away mid-body, which stops the writer
+		auto holder = static_cast<shared_ptr<ResponseStream>*>(cls);
+		(*holder)->cancel();
+		delete holder;
+	});
+	if (!resp) {
+		(*holder)->cancel();
+		delete holder;
+	}
+	return resp;
+}
+// creates a response holding the connection open as an event stream, suspended whenever nothing is pending
+static auto create_events_response(MHD_Connection* con, shared_ptr<ServerEvents::Subscriber> subscriber)->MHD_Response* {
+	subscriber->suspend = [con] { MHD_suspend_connection(con); };
+	subscriber->resume = [con] { MHD_resume_connection(con); };
+	auto holder = new shared_ptr<ServerEvents::Subscriber>(std::move(subscriber));
+	auto resp = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 4 * 1024, [](void* cls, uint64_t pos, char* buf, size_t max)->ssize_t {
+		auto n = (*static_cast<shared_ptr<ServerEvents::Subscriber>*>(cls))->read(buf, max);
+		if (n < 0) return MHD_CONTENT_READER_END_OF_STREAM;
+		return static_cast<ssize_t>(n);
+	}, holder, [](void* cls) {
+		auto holder = static_cast<shared_ptr<ServerEvents::Subscriber>*>(cls);
+		(*holder)->close();
+		delete holder;
+	});
+	if (!resp) {
+		(*holder)->close();
+		delete holder;
+	}
+	return resp;
+}
+// returns true if an If-Range validator still matches the response, so its Range may be honoured
+static auto if_range_matches(const string& ifRange, const ServerResponse& response)->bool {
+	if (ifRange.empty())
+		return true;
+	auto it = response.headers.find(ifRange[0] == '"' || ifRange[0] == 'W' ? "ETag" : "Last-Modified");
+	// weak validators never match
+	return it != response.headers.end() && it->second == ifRange && ifRange.substr(0, 2) != "W/";
+}
+// creates the response for a file or shared buffer body, serving Range requests from offsets of the body
+// sets size to the length of the body sent
+static auto create_body_response(const ServerRequest& request, ServerResponse& response, uint64_t& size)->MHD_Response* {
+	size = 0;
+	unique_ptr<RangeBody> body;
+	if (!response.file.empty()) {
+		body = open_file(response.file);
+		if (!body) return nullptr;
+	}
+	else body = std::make_unique<RangeBody>(response.shared_content);
+
+	// ranges apply to complete, unencoded bodies
+	vector<ByteRange> ranges;
+	auto result = RangeResult::None;
+	if (response.status == MHD_HTTP_OK && !response.headers.count("Content-Encoding")) {
+		response.headers[MHD_HTTP_HEADER_ACCEPT_RANGES] = "bytes";
+		auto range = request.header(MHD_HTTP_HEADER_RANGE);
+		if (!range.empty() && if_range_matches(request.header(MHD_HTTP_HEADER_IF_RANGE), response))
+			result = parse_ranges(range, body->size(), ranges);
+	}
+
+	MHD_Response* resp = nullptr;
+	if (result == RangeResult::Unsatisfiable) {
+		response.status = MHD_HTTP_RANGE_NOT_SATISFIABLE;
+		response.headers[MHD_HTTP_HEADER_CONTENT_RANGE] = fmt::format("bytes */{}", body->size());
+		return MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+	}
+	if (result == RangeResult::Satisfiable && ranges.size() > 1) {
+		// multipart/byteranges, parts are read from the body as MHD asks for them
+		auto boundary = rand_md5();
+		auto length = body->set_multipart(ranges, boundary, response.content_type);
+		size = length;
+		response.status = MHD_HTTP_PARTIAL_CONTENT;
+		response.content_type = "multipart/byteranges; boundary=" + boundary;
+		auto raw = body.release();
+		resp = MHD_create_response_from_callback(length, 32 * 1024, [](void* cls, uint64_t pos, char* buf, size_t max)->ssize_t {
+			auto n = static_cast<RangeBody*>(cls)->read_multipart(pos, buf, max);
+			if (n < 0) return MHD_CONTENT_READER_END_WITH_ERROR;
+			if (n == 0) return MHD_CONTENT_READER_END_OF_STREAM;
+			return static_cast<ssize_t>(n);
+		}, raw, [](void* cls) {
+			delete static_cast<RangeBody*>(cls);
+		});
+		if (!resp) delete raw;
+		return resp;
+	}
+
+	uint64_t offset = 0, length = body->size();
+	if (result == RangeResult::Satisfiable) {
+		response.status = MHD_HTTP_PARTIAL_CONTENT;
+		response.headers[MHD_HTTP_HEADER_CONTENT_RANGE] = fmt::format("bytes {}-{}/{}", ranges[0].first, ranges[0].last, body->size());
+		offset = ranges[0].first;
+		length = ranges[0].length();
+	}
+	size = length;
+	if (auto data = body->data())
+		return create_shared_response(data, static_cast<size_t>(offset), static_cast<size_t>(length));
+	// MHD sends it with sendfile() where available and closes the fd
+	resp = MHD_create_response_from_fd_at_offset64(length, body->fd(), offset);
+	if (resp) body->release_fd();
+	return resp;
+}
 auto Server::http_finish(void* cls, MHD_Connection* con, void** ptr, MHD_RequestTerminationCode tc)->void {
 	Server* server = reinterpret_cast<Server*>(cls);
 	auto con_info = static_cast<ServerConnection*>(*ptr);
 	if (!con_info)
 		return;
-
-	/*if (con_info->method == ServerMethod::POST) {
-		if (con_info->processor) {
-			MHD_destroy_post_processor(con_info->processor);
-			--server->m_numConnections;
-		}
-
-		con_info->input_size = 0;
-	}*/
-
 	*ptr = nullptr;
 
+	// a stream's slot went back to the pool when it was handed off, and may be serving another request by now
+	if (con_info->connection != con) {
+		server->release_stream();
+		return;
+	}
+	// an upgrade which never happened
+	if (con_info->stream)
+		server->release_stream();
+	server->end_request(*con_info);
+
 	if (tc == MHD_RequestTerminationCode::MHD_REQUEST_TERMINATED_COMPLETED_OK) {
 
 	}
 }
+auto Server::http_upgrade(void* cls, MHD_Connection* con, void* ptr, const char* extra_in, size_t extra_in_size, SocketHandle sock, MHD_UpgradeResponseHandle* urh)->void {
+	Server* server = reinterpret_cast<Server*>(cls);
+	auto con_info = static_cast<ServerConnection*>(ptr);
+	auto upgrade = std::move(con_info->upgrade);
+	con_info->upgrade = nullptr;
+	auto& session = con_info->request.session;
+	auto socket = std::make_shared<WebSocket>(session ? session->id : "", sock, string(extra_in ? extra_in : "", extra_in_size), [urh] {
+		MHD_upgrade_action(urh, MHD_UPGRADE_ACTION_CLOSE);
+	});
+	{
+		std::lock_guard<std::mutex> lock(server->m_upgradeMutex);
+		server->m_upgraded.erase(std::remove_if(server->m_upgraded.begin(), server->m_upgraded.end(), [](auto& weak) { return weak.expired(); }), server->m_upgraded.end());
+		server->m_upgraded.push_back(socket);
+	}
+	// the socket has all it needs, the slot can serve other requests while it stays open
+	server->end_request(*con_info);
+	// a socket nobody keeps is released by its destructor
+	if (upgrade) upgrade(std::move(socket));
+}
 auto Server::http_handler(void* cls, MHD_Connection* con, const char* uri, const char* method, const char* ver, const char* upload, size_t* upload_size, void** ptr)->int {
 	Server* server = reinterpret_cast<Server*>(cls);
 
 	if (*ptr == nullptr) {
-		auto& pr = server->m_connections.emplace_back();
-
 		// handle too many connections by blocking additional connections
-		if (server->m_numConnections >= server->m_connections.size())
-			return send_response(con, msg_server_busy, sizeof(*msg_server_busy), MHD_HTTP_SERVICE_UNAVAILABLE);
+		auto slot = server->acquire_connection();
+		server->m_requestCount.add();
+		if (!slot) {
+			server->m_shedCount.add();
+			server->count_response(MHD_HTTP_SERVICE_UNAVAILABLE);
+			return send_busy(con, std::chrono::seconds(1));
+		}
 
-		auto& con_info = server->m_connections[server->m_numConnections++];
-		con_info = ServerConnection();
+		auto& con_info = *slot;
+		con_info.reset(con, uri, method);
+		con_info.request.local = is_loopback(con);
+		// shed by rate before any of the body is read, each client has its own budget
+		con_info.budget = server->classify_request(con_info.request, uri, method);
+		auto retry_after = server->m_app.opt.admission ? server->m_admission.admit(client_key(con), con_info.budget) : std::nullopt;
+		if (retry_after) {
+			ITEASE_LOGDEBUG("HTTP " << method << " Request at " << uri << " shed, retry after " << retry_after->count() << "s");
+			server->end_request(con_info);
+			server->m_shedCount.add();
+			server->count_response(MHD_HTTP_SERVICE_UNAVAILABLE);
+			return send_busy(con, *retry_after);
+		}
 		*ptr = &con_info;
 
-		con_info.input_size = 0;
-		con_info.method = std::equal(method, method + 5, "POST") ? ServerMethod::POST : ServerMethod::GET;
-		con_info.request = ServerRequest(uri, method);
-
 		if (con_info.method == ServerMethod::POST) {
 			con_info.processor = MHD_create_post_processor(con, PostBufferSize, &iterate_post, &con_info);
-			if (!con_info.processor) {
-				--server->m_numConnections;
+			// http_finish returns the slot
+			if (!con_info.processor)
 				return MHD_NO;
-			}
 		}
-		else con_info.method = ServerMethod::GET;
 		return MHD_YES;
 	}
 
@@ -142,96 +445,253 @@ auto Server::http_handler(void* cls, MHD_Connection* con, const char* uri, const
 
 	if (con_info->method == ServerMethod::POST) {
 		if (*upload_size != 0) {
-			auto rc = MHD_post_process(con_info->processor, upload, *upload_size);
+			// once rejected, the rest of the body is read and dropped
+			if (!con_info->error_status)
+				MHD_post_process(con_info->processor, upload, *upload_size);
 			*upload_size = 0;
 			return MHD_YES;
 		}
 
 		if (con_info->processor) {
 			MHD_destroy_post_processor(con_info->processor);
-			--server->m_numConnections;
+			con_info->processor = nullptr;
 		}
 
 		con_info->input_size = 0;
+		if (con_info->error_status) {
+			request.files.clear();
+			auto msg = con_info->error_status == MHD_HTTP_PAYLOAD_TOO_LARGE ? msg_too_large : msg_upload_failed;
+			server->count_response(con_info->error_status);
+			return send_response(con, msg, strlen(msg), con_info->error_status);
+		}
+		for (auto& file : request.files)
+			file->finish();
 	}
 
-	ITEASE_LOGDEBUG("HTTP " << method << " Request at " << uri);
-
-	ServerRequest::HeaderMap headers;
-	ServerRequest::ParamMap params;
-	ServerRequest::CookieMap cookies;
-	ServerRequest::PostDataMap postData;
+	// handlers share a concurrency limit, which slow or large uploads mustn't fill while their body is read
+	if (server->m_app.opt.admission) {
+		if (auto retry_after = server->m_admission.enter(con_info->budget, con_info->ticket)) {
+			ITEASE_LOGDEBUG("HTTP " << method << " Request at " << uri << " shed, retry after " << retry_after->count() << "s");
+			request.files.clear();
+			server->m_shedCount.add();
+			server->count_response(MHD_HTTP_SERVICE_UNAVAILABLE);
+			return send_busy(con, *retry_after);
+		}
+	}
 
-	MHD_get_connection_values(con, MHD_ValueKind::MHD_HEADER_KIND, [](void* cls, MHD_ValueKind kind, const char* key, const char* val)->int {
-		if (key && val)
-			reinterpret_cast<ServerRequest::HeaderMap*>(cls)->emplace(key, val);
-		return MHD_YES;
-	}, &request.headers);
-	MHD_get_connection_values(con, MHD_ValueKind::MHD_GET_ARGUMENT_KIND, [](void* cls, MHD_ValueKind kind, const char* key, const char* val)->int {
-		if (key && val)
-			reinterpret_cast<ServerRequest::ParamMap*>(cls)->emplace(key, val);
-		return MHD_YES;
-	}, &request.params);
-	MHD_get_connection_values(con, MHD_ValueKind::MHD_COOKIE_KIND, [](void* cls, MHD_ValueKind kind, const char* key, const char* val)->int {
-		if (key && val)
-			reinterpret_cast<ServerRequest::CookieMap*>(cls)->emplace(key, val);
-		return MHD_YES;
-	}, &request.cookies);
-	MHD_get_connection_values(con, MHD_ValueKind::MHD_POSTDATA_KIND, [](void* cls, MHD_ValueKind kind, const char* key, const char* val)->int {
-		if (key && val)
-			reinterpret_cast<ServerRequest::PostDataMap*>(cls)->emplace(key, val);
-		return MHD_YES;
-	}, &request.post_data);
+	ITEASE_LOGDEBUG("HTTP " << method << " Request at " << uri);
 
-	server->set_cookies.clear();
-	server->redirection.first = 0;
-	server->redirection.second = "";
+	// headers, arguments and cookies are looked up on the connection as handlers read them
+	// POST fields are parsed into post_data as they arrive, MHD only holds any itself for a body it decoded without our processor
+	if (con_info->method == ServerMethod::POST && request.post_data.empty()) {
+		MHD_get_connection_values(con, MHD_ValueKind::MHD_POSTDATA_KIND, [](void* cls, MHD_ValueKind kind, const char* key, const char* val)->int {
+			if (key && val)
+				reinterpret_cast<ServerRequest::PostDataMap*>(cls)->emplace(key, val);
+			return MHD_YES;
+		}, &request.post_data);
+	}
 
-	// find session or create new one
-	Session* session = nullptr;
-	auto it = request.cookies.find("session");
-	session = it != request.cookies.end() ? server->get_session(it->second) : nullptr;
-	if (!session) {
-		session = &server->create_session();
-		server->set_cookies.emplace("session", session->id);
+	// find session or create new one, files and bundles don't need one, so clients without a cookie can't fill the store with them
+	shared_ptr<Session> session;
+	bool new_session = false;
+	if (con_info->budget != AdmissionControl::Budget::Static) {
+		auto name = request.cookies.get("session");
+		session = !name.empty() ? server->get_session(name) : nullptr;
+		if (!session) {
+			session = server->create_session();
+			new_session = true;
+		}
 	}
 	request.session = session;
 
-	assert(request.session);
-
-	if (auto response = server->send_request(request)) {
-		auto resp = MHD_create_response_from_buffer(response->content.size(), const_cast<char*>(response->content.c_str()), MHD_ResponseMemoryMode::MHD_RESPMEM_MUST_COPY);
+	// from the end of the upload until the response is queued
+	Metrics::Timer timer(server->m_requestTime);
+	// only the handler's own time is sampled, streamed bodies and upgraded sockets outlive it
+	auto response = server->send_request(request);
+	con_info->ticket.release();
+	if (response) {
+		server->encode_response(request, *response);
+		MHD_Response* resp = nullptr;
+		if (response->upgrade || response->events) {
+			// long-lived connections have their own budget, so open tabs can't lock out requests
+			if (!server->acquire_stream()) {
+				if (response->events) response->events->close();
+				server->count_response(MHD_HTTP_SERVICE_UNAVAILABLE);
+				return send_busy(con, std::chrono::seconds(1));
+			}
+			con_info->stream = true;
+		}
+		if (response->upgrade) {
+			con_info->upgrade = std::move(response->upgrade);
+			resp = MHD_create_response_for_upgrade(&http_upgrade, server);
+		}
+		else if (response->events)
+			resp = create_events_response(con, response->events);
+		else if (response->stream) {
+			resp = create_stream_response(con, response->stream);
+			std::lock_guard<std::mutex> lock(server->m_bodyStreamMutex);
+			server->m_bodyStreams.erase(std::remove_if(server->m_bodyStreams.begin(), server->m_bodyStreams.end(), [](auto& weak) { return weak.expired(); }), server->m_bodyStreams.end());
+			server->m_bodyStreams.push_back(response->stream);
+		}
+		else if (!response->file.empty() || response->shared_content) {
+			uint64_t size;
+			resp = create_body_response(request, *response, size);
+			if (!resp && !response->file.empty()) {
+				ITEASE_LOGDEBUG("Failed to open " << response->file);
+				server->count_response(MHD_HTTP_NOT_FOUND);
+				return send_response(con, msg_not_found, strlen(msg_not_found), MHD_HTTP_NOT_FOUND);
+			}
+			server->m_responseBytes.add(size);
+		}
+		else {
+			// the body changes hands rather than being copied, http_finish frees it
+			con_info->body = std::move(response->content);
+			resp = MHD_create_response_from_buffer(con_info->body.size(), const_cast<char*>(con_info->body.data()), MHD_ResponseMemoryMode::MHD_RESPMEM_PERSISTENT);
+			server->m_responseBytes.add(con_info->body.size());
+		}
+		if (!resp) return MHD_NO;
 		string str;
 		str.reserve(400);
 		if (!response->content_type.empty())
 			MHD_add_response_header(resp, "Content-Type", response->content_type.c_str());
-		if (!server->redirection.second.empty()) {
-			str = std::to_string(server->redirection.first) + "; url=" + server->redirection.second;
+		for (auto& header : response->headers)
+			MHD_add_response_header(resp, header.first.c_str(), header.second.c_str());
+		if (!response->redirection.second.empty()) {
+			str = std::to_string(response->redirection.first) + "; url=" + response->redirection.second;
 			MHD_add_response_header(resp, "Refresh", str.c_str());
 		}
-		for (auto& cookie : server->set_cookies) {
+		for (auto& cookie : response->set_cookies) {
 			str = cookie.first + "=" + cookie.second;
 			MHD_add_response_header(resp, MHD_HTTP_HEADER_SET_COOKIE, str.c_str());
 		}
-		ITEASE_LOGDEBUG("HTTP Response (" << response->status << ") " << response->content_type << ", size: " << response->content.size());
+		if (new_session) {
+			str = "session=" + session->id;
+			MHD_add_response_header(resp, MHD_HTTP_HEADER_SET_COOKIE, str.c_str());
+		}
+		ITEASE_LOGDEBUG("HTTP Response (" << response->status << ") " << response->content_type << (response->file.empty() ? ", size: " + std::to_string(con_info->body.size()) : ", file: " + response->file));
 		auto res = MHD_queue_response(con, response->status, resp);
 		MHD_destroy_response(resp);
+		server->count_response(response->status);
+		// the stream only needs the connection from here on
+		if (response->events && res == MHD_YES)
+			server->end_request(*con_info);
 		return res;
 	}
 	ITEASE_LOGDEBUG("No response");
 	return MHD_NO;
 }
 
+static auto mhd_value_kind(RequestValueKind kind) {
+	switch (kind) {
+	case RequestValueKind::Header: return MHD_HEADER_KIND;
+	case RequestValueKind::Argument: return MHD_GET_ARGUMENT_KIND;
+	default: return MHD_COOKIE_KIND;
+	}
+}
+
+auto RequestValues::get(const string& key) const->string {
+	return find(key).value_or("");
+}
+auto RequestValues::find(const string& key) const->optional<string> {
+	if (!m_state)
+		return std::nullopt;
+	std::lock_guard<std::mutex> lock(m_state->mutex);
+	if (m_state->connection) {
+		// MHD compares keys without regard to case
+		if (auto value = MHD_lookup_connection_value(m_state->connection, mhd_value_kind(m_kind), key.c_str()))
+			return string(value);
+		return std::nullopt;
+	}
+	auto it = m_state->values.find(key);
+	if (it != m_state->values.end())
+		return it->second;
+	return std::nullopt;
+}
+auto RequestValues::all() const->Map {
+	if (!m_state)
+		return {};
+	std::lock_guard<std::mutex> lock(m_state->mutex);
+	if (!m_state->connection)
+		return m_state->values;
+	Map values;
+	MHD_get_connection_values(m_state->connection, mhd_value_kind(m_kind), [](void* cls, MHD_ValueKind kind, const char* key, const char* val)->int {
+		if (key && val)
+			static_cast<Map*>(cls)->emplace(key, val);
+		return MHD_YES;
+	}, &values);
+	return values;
+}
+auto RequestValues::set(const string& key, string value)->void {
+	if (!m_state)
+		m_state = std::make_shared<State>();
+	std::lock_guard<std::mutex> lock(m_state->mutex);
+	m_state->values[key] = std::move(value);
+}
+auto RequestValues::attach(MHD_Connection* con)->void {
+	// a slot's view is reused unless a copy of the last request still holds it
+	if (!m_state || m_state.use_count() > 1)
+		m_state = std::make_shared<State>();
+	m_state->values.clear();
+	m_state->connection = con;
+}
+auto RequestValues::detach()->void {
+	if (!m_state || !m_state->connection)
+		return;
+	// copies outliving the request keep their values, which only now are copied
+	auto values = m_state.use_count() > 1 ? all() : Map{};
+	std::lock_guard<std::mutex> lock(m_state->mutex);
+	m_state->values = std::move(values);
+	m_state->connection = nullptr;
+}
+
 ServerRequest::ServerRequest(string uri, string method) : uri(uri), method(method)
 { }
-auto ServerRequest::header(string name) const->string {
-	auto it = headers.find(name);
-	return it != headers.end() ? it->second : "";
+auto ServerRequest::header(const string& name) const->string {
+	return headers.get(name);
 }
-ServerResponse::ServerResponse(string content, int status) : content(content), status(status)
+ServerResponse::ServerResponse(string content, int status) : content(std::move(content)), status(status)
 { }
 
-Server::Server(Application& app) : m_app(app) {
+auto ContentWriter::overflow(int_type c)->int_type {
+	if (!traits_type::eq_int_type(c, traits_type::eof()))
+		m_content.push_back(traits_type::to_char_type(c));
+	return traits_type::not_eof(c);
+}
+auto ContentWriter::xsputn(const char_type* s, std::streamsize n)->std::streamsize {
+	m_content.append(s, static_cast<size_t>(n));
+	return n;
+}
+
+Server::Server(Application& app) : m_app(app), m_admission(static_cast<size_t>(std::max(1, app.opt.maxConnections))), m_sessions(app.db.get(), app.metrics.histogram("itease_db_query_duration_seconds", "Time spent in database queries.", "module=\"sessions\"")),
+	m_requestCount(app.metrics.counter("itease_http_requests_total", "HTTP requests received.")),
+	m_shedCount(app.metrics.counter("itease_http_requests_shed_total", "HTTP requests turned away with 503 before being handled.")),
+	m_responseCounts{
+		&app.metrics.counter("itease_http_responses_total", ResponseCountHelp, "code=\"1xx\""),
+		&app.metrics.counter("itease_http_responses_total", ResponseCountHelp, "code=\"2xx\""),
+		&app.metrics.counter("itease_http_responses_total", ResponseCountHelp, "code=\"3xx\""),
+		&app.metrics.counter("itease_http_responses_total", ResponseCountHelp, "code=\"4xx\""),
+		&app.metrics.counter("itease_http_responses_total", ResponseCountHelp, "code=\"5xx\"")
+	},
+	m_responseBytes(app.metrics.counter("itease_http_response_bytes_total", "Bytes of response bodies of known length, streams are not counted.")),
+	m_requestTime(app.metrics.histogram("itease_http_request_duration_seconds", "Time from a request being read to its response being queued.")),
+	m_sessionCount(app.metrics.gauge("itease_sessions", "Sessions held in memory."))
+{
+	m_sessionTick = m_app.add_interval_callback(SessionTickInterval, [this](long long&) {
+		m_sessions.sweep();
+		m_sessionCount.set(static_cast<int64_t>(m_sessions.size()));
+		std::lock_guard<std::mutex> lock(m_app.m_internalMutex);
+		try {
+			m_sessions.flush();
+		}
+		catch (const sqlite::sqlite_exception& ex) {
+			ITEASE_LOGERROR("Failed to save sessions: " << ex.what());
+		}
+		return 1;
+	});
+	m_eventsHeartbeat = m_app.add_interval_callback(EventsHeartbeatInterval, [this](long long&) {
+		m_app.events.heartbeat();
+		return 1;
+	});
 	ITEASE_LOGINFO("Starting iTease web server on port " << app.opt.port);
 	if (!connect(app.opt.port)) {
 		ITEASE_LOGERROR("Failed to start iTease web server on port " << app.opt.port);
@@ -239,37 +699,200 @@ Server::Server(Application& app) : m_app(app) {
 	}
 }
 Server::~Server() {
+	// suspended connections must be resumed, and upgraded ones closed, before the daemon stops
+	m_app.events.close_all();
+	// nothing may be servicing a socket as it's released
+	m_app.OnServerStop();
+	{
+		std::lock_guard<std::mutex> lock(m_bodyStreamMutex);
+		for (auto& weak : m_bodyStreams) {
+			if (auto stream = weak.lock())
+				stream->cancel();
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_upgradeMutex);
+		for (auto& weak : m_upgraded) {
+			if (auto socket = weak.lock())
+				socket->release();
+		}
+	}
 	MHD_stop_daemon((MHD_Daemon*)m_daemon);
 }
 auto Server::connect(int port)->bool {
 	if (port) {
-		m_connections.resize(16);
-		m_daemon = MHD_start_daemon(/*MHD_USE_THREAD_PER_CONNECTION | MHD_USE_INTERNAL_POLLING_THREAD*/0
+		// with a worker pool, MHD polls in its own threads, one per worker
+		auto workers = static_cast<unsigned int>(m_app.num_workers());
+		m_threaded = workers > 0;
+		// the pool is allocated once, slots are never moved
+		auto maxConnections = static_cast<size_t>(std::max(1, m_app.opt.maxConnections));
+		m_connections = std::vector<ServerConnection>(maxConnections);
+		m_freeConnections = nullptr;
+		for (auto it = m_connections.rbegin(); it != m_connections.rend(); ++it) {
+			it->next_free = m_freeConnections;
+			m_freeConnections = &*it;
+		}
+		m_daemon = MHD_start_daemon((m_threaded ? MHD_USE_INTERNAL_POLLING_THREAD : 0)
+			// event streams are suspended while idle
+			| MHD_ALLOW_SUSPEND_RESUME
+			// WebSockets take over their connections
+			| MHD_ALLOW_UPGRADE
+			#ifdef __linux__
+			// exposes a single epoll fd for the application's reactor to wait on
+			| (m_threaded ? 0 : MHD_USE_EPOLL)
+			#endif
 			#ifdef _DEBUG
 			| MHD_USE_DEBUG
 			#endif
-			, port, NULL, NULL, &http_handler, this, MHD_OPTION_NOTIFY_COMPLETED, &http_finish, this, MHD_OPTION_END);
+			, port, NULL, NULL, &http_handler, this,
+			MHD_OPTION_NOTIFY_COMPLETED, &http_finish, this,
+			MHD_OPTION_THREAD_POOL_SIZE, m_threaded ? workers : 0u,
+			// streams hold their connections without a slot
+			MHD_OPTION_CONNECTION_LIMIT, static_cast<unsigned int>(maxConnections + std::max(1, m_app.opt.maxStreams)),
+			MHD_OPTION_END);
 	}
 	return !!m_daemon;
 }
+auto Server::classify_request(const ServerRequest& request, const char* uri, const char* method)->AdmissionControl::Budget {
+	// only a file or bundle which is really there is cheap, anything else may reach a handler
+	if (std::strcmp(method, "GET") == 0 || std::strcmp(method, "HEAD") == 0) {
+		// the modules answering are replaced by a restart
+		std::shared_lock<std::shared_mutex> lock(m_app.m_jsMutex);
+		if (m_app.OnStaticLookup(request.uri) > 0)
+			return AdmissionControl::Budget::Static;
+	}
+	auto name = request.cookies.get("session");
+	if (!name.empty()) {
+		auto session = m_sessions.find(name);
+		if (session && session->user_id != 0)
+			return AdmissionControl::Budget::Session;
+	}
+	return AdmissionControl::Budget::Anonymous;
+}
+auto Server::count_response(int status)->void {
+	auto index = status / 100 - 1;
+	if (index >= 0 && index < static_cast<int>(m_responseCounts.size()))
+		m_responseCounts[index]->add();
+}
+auto Server::acquire_connection()->ServerConnection* {
+	std::lock_guard<std::mutex> lock(m_connectionMutex);
+	auto slot = m_freeConnections;
+	if (slot) {
+		m_freeConnections = slot->next_free;
+		slot->next_free = nullptr;
+	}
+	return slot;
+}
+auto Server::release_connection(ServerConnection& slot)->void {
+	std::lock_guard<std::mutex> lock(m_connectionMutex);
+	slot.next_free = m_freeConnections;
+	m_freeConnections = &slot;
+}
+auto Server::end_request(ServerConnection& slot)->void {
+	// uploads may be cut off before the handler saw their end
+	if (slot.processor) {
+		MHD_destroy_post_processor(slot.processor);
+		slot.processor = nullptr;
+	}
+	// a handler that never ran (e.g. a cut off upload) leaves no latency sample
+	slot.ticket.release(false);
+	// MHD is done with the body once the request has finished
+	slot.body = string();
+	// removes the temporary files unless a handler still holds them
+	slot.request.files.clear();
+	slot.request.session = nullptr;
+	slot.request.headers.detach();
+	slot.request.params.detach();
+	slot.request.cookies.detach();
+	slot.connection = nullptr;
+	release_connection(slot);
+}
+auto Server::acquire_stream()->bool {
+	if (++m_streams <= std::max(1, m_app.opt.maxStreams))
+		return true;
+	--m_streams;
+	return false;
+}
+auto Server::release_stream()->void {
+	--m_streams;
+}
 auto Server::run()->void {
-	MHD_run((MHD_Daemon*)m_daemon);
+	if (!m_threaded)
+		MHD_run((MHD_Daemon*)m_daemon);
 }
-auto Server::create_session()->Session& {
-	auto sid = rand_md5();
-	auto pr = m_sessions.emplace(sid, Session{sid});
-	if (!pr.second) throw std::bad_alloc();
-	return pr.first->second;
+auto Server::encode_response(const ServerRequest& request, ServerResponse& response)->void {
+	if (!response.file.empty() || response.headers.count("Content-Encoding") || !is_compressible(response.content_type))
+		return;
+	// ranges are served from the identity body
+	if (response.shared_content && !request.header(MHD_HTTP_HEADER_RANGE).empty())
+		return;
+	auto size = response.shared_content ? response.shared_content->size() : response.content.size();
+	if (size < MinStaticCompressSize)
+		return;
+	response.headers["Vary"] = "Accept-Encoding";
+	auto encoding = negotiate_encoding(request.header("Accept-Encoding"));
+	if (encoding == ContentEncoding::Identity)
+		return;
+	try {
+		auto etag = response.headers.find("ETag");
+		if (response.shared_content && etag != response.headers.end()) {
+			response.shared_content = m_compressionCache.get(etag->second, encoding, response.shared_content);
+			etag->second = encoded_etag(etag->second, encoding);
+		}
+		else if (response.shared_content)
+			response.shared_content = std::make_shared<const string>(compress(*response.shared_content, encoding));
+		else if (size >= MinDynamicCompressSize)
+			response.content = compress(response.content, encoding);
+		else return;
+		response.headers["Content-Encoding"] = encoding_name(encoding);
+	}
+	catch (const std::exception& ex) {
+		// send it uncompressed
+		ITEASE_LOGERROR("Response compression failed: " << ex.what());
+	}
+}
+auto Server::poll_fd() const->int {
+	#ifdef __linux__
+	if (!m_threaded && m_daemon) {
+		if (auto info = MHD_get_daemon_info((MHD_Daemon*)m_daemon, MHD_DAEMON_INFO_EPOLL_FD))
+			return info->epoll_fd;
+	}
+	#endif
+	return -1;
+}
+auto Server::timeout() const->optional<std::chrono::milliseconds> {
+	MHD_UNSIGNED_LONG_LONG ms;
+	if (m_threaded || !m_daemon || MHD_get_timeout((MHD_Daemon*)m_daemon, &ms) != MHD_YES)
+		return std::nullopt;
+	return std::chrono::milliseconds(ms);
 }
-auto Server::get_session(const string& name)->Session* {
-	auto it = m_sessions.find(name);
-	return it != m_sessions.end() ? &it->second : nullptr;
+auto Server::create_session()->shared_ptr<Session> {
+	return m_sessions.create();
+}
+auto Server::get_session(const string& name)->shared_ptr<Session> {
+	if (auto session = m_sessions.find(name))
+		return session;
+	try {
+		// SQLite serialises statements on the connection itself, an unknown or forged id doesn't hold up the handlers' lock
+		if (auto userId = m_sessions.load(name)) {
+			// the user is resolved by whichever module owns users, under the lock their handlers share, and kept alive through a restart
+			std::shared_lock<std::shared_mutex> jsLock(m_app.m_jsMutex);
+			std::lock_guard<std::mutex> lock(m_app.m_internalMutex);
+			shared_ptr<void> user;
+			if (m_app.OnSessionRestore(userId, user) && user)
+				return m_sessions.restore(name, userId, std::move(user));
+		}
+	}
+	catch (const sqlite::sqlite_exception& ex) {
+		ITEASE_LOGERROR("Failed to restore session: " << ex.what());
+	}
+	return nullptr;
 }
 auto Server::send_request(const ServerRequest& request)->ServerResponsePtr {
-	static auto request404 = std::make_shared<ServerResponse>("404 Not Found", MHD_HTTP_NOT_FOUND);
 	auto response = std::make_shared<ServerResponse>("", MHD_HTTP_NOT_FOUND);
 	if (m_app.server_request(request, *response)) {
 		return response;
 	}
-	return request404;
+	// a response of its own each time, its body is moved out when it's queued
+	return std::make_shared<ServerResponse>("404 Not Found", MHD_HTTP_NOT_FOUND);
 }
\ No newline at end of file
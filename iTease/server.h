@@ -1,41 +1,106 @@
 #pragma once
+#include <chrono>
+#include <mutex>
+#include <streambuf>
 #include <unordered_map>
 #include "common.h"
+#include "admission.h"
+#include "metrics.h"
+#include "compression.h"
 #include "event.h"
+#include "response_stream.h"
+#include "server_events.h"
+#include "session_store.h"
+#include "websocket.h"
 
 namespace iTease {
 	class Application;
+	class UploadedFile;
 
 	enum class ServerMethod : int {
 		GET, POST
 	};
 
-	struct Session {
-		const string id;
-		shared_ptr<void> data;
+	enum class RequestValueKind : int {
+		Header, Argument, Cookie
+	};
+
+	/**
+	 * RequestValues - the headers, GET arguments or cookies of a request, looked up on its connection as they're read
+	 * Copies share the view, if one outlives the request the values are copied out of the connection as it finishes
+	 * Keys compare without regard to case, as MHD compares them, before and after the request finished
+	**/
+	class RequestValues {
+	public:
+		using Map = ci_map<string, string>;
+
+		RequestValues(RequestValueKind kind) : m_kind(kind)
+		{ }
+
+		// returns the value, empty if there's none
+		auto get(const string& key) const->string;
+		auto find(const string& key) const->optional<string>;
+		// returns every value, enumerating the connection's
+		auto all() const->Map;
+		// sets a value of a request made without a connection
+		auto set(const string& key, string value)->void;
+
+		// starts viewing a new connection's values, any previous values are dropped
+		auto attach(struct MHD_Connection*)->void;
+		// stops viewing the connection as it finishes
+		auto detach()->void;
+
+	private:
+		struct State {
+			std::mutex mutex;
+			struct MHD_Connection* connection = nullptr;
+			// values held once there's no connection to look them up on
+			Map values;
+		};
+
+		RequestValueKind m_kind;
+		shared_ptr<State> m_state;
 	};
 
 	struct ServerRequest {
-		using HeaderMap = unordered_map<string, string>;
-		using ParamMap = unordered_map<string, string>;
-		using CookieMap = unordered_map<string, string>;
 		using PostDataMap = ordered_map<string, string>;
 
 		ServerRequest() = default;
 		ServerRequest(string uri, string method = "GET");
 
-		auto header(string) const->string;		// returns empty string on failure
+		auto header(const string& name) const->string;		// returns empty string on failure
 
 		string uri;
 		string method;
-		HeaderMap headers;
-		ParamMap params;
-		CookieMap cookies;
+		RequestValues headers{RequestValueKind::Header};
+		RequestValues params{RequestValueKind::Argument};
+		RequestValues cookies{RequestValueKind::Cookie};
 		PostDataMap post_data;
-		Session* session;
+		// file parts of a multipart POST, in the order received
+		vector<shared_ptr<UploadedFile>> files;
+		// null for requests of existing files and bundles
+		shared_ptr<Session> session;
+		// set for clients on this machine
+		bool local = false;
 		//String version = "HTTP/1.1";
 	};
 
+	/**
+	 * ContentWriter - stream buffer appending to a string in place, so a body rendered to std::ostream needs no copying out
+	**/
+	class ContentWriter : public std::streambuf {
+	public:
+		ContentWriter(string& content) : m_content(content)
+		{ }
+
+	protected:
+		auto overflow(int_type c)->int_type override;
+		auto xsputn(const char_type* s, std::streamsize n)->std::streamsize override;
+
+	private:
+		string& m_content;
+	};
+
 	struct ServerResponse {
 	public:
 		ServerResponse() = default;
@@ -44,6 +109,21 @@ namespace iTease {
 		string content;
 		string content_type;
 		int status = 501;
+		// when set, the body is sent from this file by the kernel rather than from content
+		string file;
+		// when set, the body is sent from this buffer (shared with a cache) rather than from content
+		shared_ptr<const string> shared_content;
+		// when set, the body is sent chunked as it is written to the stream, e.g. by network callbacks after the handler returned
+		shared_ptr<ResponseStream> stream;
+		// when set, the connection is held open as an event stream which is suspended between events
+		shared_ptr<ServerEvents::Subscriber> events;
+		// when set, the connection is switched to the protocol in the headers (status 101), the socket is passed here once it has been
+		std::function<void(shared_ptr<WebSocket>)> upgrade;
+		// additional response headers
+		map<string, string> headers;
+		// per-request headers, kept with the response so concurrent workers don't share them
+		pair<int, string> redirection;
+		map<string, string> set_cookies;
 	};
 
 	using ServerResponsePtr = shared_ptr<ServerResponse>;
@@ -55,25 +135,68 @@ namespace iTease {
 		Server(Application& app);
 		~Server();
 		auto connect(int port)->bool;
+		// polls the daemon when requests are served from the main loop, no-op with a worker pool
 		auto run()->void;
+		// returns an fd which becomes readable when run() has work to do, -1 if unavailable (e.g. with a worker pool)
+		auto poll_fd() const->int;
+		// returns the longest time to wait before calling run() regardless of poll_fd(), empty if unbounded
+		auto timeout() const->optional<std::chrono::milliseconds>;
 		auto send_request(const ServerRequest&)->ServerResponsePtr;
-		auto create_session()->Session&;
-		auto get_session(const string& name)->Session*;
+		auto create_session()->shared_ptr<Session>;
+		// finds a live session, restoring a persisted one, nullptr if there is neither
+		auto get_session(const string& name)->shared_ptr<Session>;
 		auto& session() { return *m_session; }
 		auto& session() const { return *m_session; }
 
 		static auto http_handler(void* cls, struct MHD_Connection* con, const char* uri, const char* method, const char* ver, const char* upload, size_t* upload_size, void** ptr)->int;
 		static auto http_finish(void* cls, struct MHD_Connection* con, void** ptr, enum MHD_RequestTerminationCode tc)->void;
+		static auto http_upgrade(void* cls, struct MHD_Connection* con, void* ptr, const char* extra_in, size_t extra_in_size, SocketHandle sock, struct MHD_UpgradeResponseHandle* urh)->void;
 
-		pair<int, string> redirection;
-		map<string, string> set_cookies;
+	private:
+		// takes a request slot from the pool, nullptr if all are in use
+		auto acquire_connection()->struct ServerConnection*;
+		auto release_connection(struct ServerConnection&)->void;
+		// clears what a request left in its slot and returns the slot to the pool
+		auto end_request(struct ServerConnection&)->void;
+		// takes a place for a connection outliving its request, false if all are in use
+		auto acquire_stream()->bool;
+		auto release_stream()->void;
+		// picks the budget a request is admitted under, existing files are cheap and signed in users are kept apart from anonymous clients
+		auto classify_request(const ServerRequest&, const char* uri, const char* method)->AdmissionControl::Budget;
+		// compresses the body for clients accepting it, static bodies are compressed once and cached by ETag
+		auto encode_response(const ServerRequest&, ServerResponse&)->void;
+		// counts a queued response by its status class
+		auto count_response(int status)->void;
 
 	private:
 		Application& m_app;
 		void* m_daemon = nullptr;
-		size_t m_numConnections = 0;
+		bool m_threaded = false;
 		vector<struct ServerConnection> m_connections;
-		std::unordered_map<string, Session> m_sessions;
+		struct ServerConnection* m_freeConnections = nullptr;
+		std::mutex m_connectionMutex;
+		// event streams and upgraded sockets, which give their request slot back once they are handed off
+		std::atomic<int> m_streams = 0;
+		AdmissionControl m_admission;
+		SessionStore m_sessions;
+		// sweeps expired sessions and writes session bindings behind
+		Event<long long&>::Listener m_sessionTick;
+		// keeps idle event streams alive
+		Event<long long&>::Listener m_eventsHeartbeat;
+		CompressionCache m_compressionCache;
+		// upgraded sockets, which must be handed back before the daemon stops
+		vector<std::weak_ptr<WebSocket>> m_upgraded;
+		std::mutex m_upgradeMutex;
+		// streamed bodies, which may be suspended and must be ended before the daemon stops
+		vector<std::weak_ptr<ResponseStream>> m_bodyStreams;
+		std::mutex m_bodyStreamMutex;
 		Session* m_session = nullptr;
+		Metrics::Counter& m_requestCount;
+		Metrics::Counter& m_shedCount;
+		// by status class, 1xx to 5xx
+		std::array<Metrics::Counter*, 5> m_responseCounts;
+		Metrics::Counter& m_responseBytes;
+		Metrics::Histogram& m_requestTime;
+		Metrics::Gauge& m_sessionCount;
 	};
 }
\ No newline at end of file
@@ -0,0 +1,120 @@
+#include "stdinc.h"
+#include "server_events.h"
+
+using namespace iTease;
+
+// a stream this far behind is dropped rather than buffered without bound
+constexpr size_t MaxPendingEventData = 256 * 1024;
+
+auto ServerEvents::Subscriber::read(char* buf, size_t max)->int64_t {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_pendingOffset == m_pending.size()) {
+		m_pending.clear();
+		m_pendingOffset = 0;
+		if (m_closed)
+			return -1;
+		// idle streams cost nothing until the next push resumes them
+		if (!m_suspended && suspend) {
+			m_suspended = true;
+			suspend();
+		}
+		return 0;
+	}
+	auto n = std::min(max, m_pending.size() - m_pendingOffset);
+	std::memcpy(buf, m_pending.data() + m_pendingOffset, n);
+	m_pendingOffset += n;
+	return static_cast<int64_t>(n);
+}
+auto ServerEvents::Subscriber::close()->void {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_closed = true;
+	if (m_suspended) {
+		m_suspended = false;
+		if (resume) resume();
+	}
+}
+auto ServerEvents::Subscriber::push(const string& frame)->bool {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_closed)
+		return false;
+	if (m_pending.size() - m_pendingOffset + frame.size() > MaxPendingEventData) {
+		m_closed = true;
+		m_pending.clear();
+		m_pendingOffset = 0;
+	}
+	else m_pending += frame;
+	if (m_suspended) {
+		m_suspended = false;
+		if (resume) resume();
+	}
+	return !m_closed;
+}
+
+auto ServerEvents::subscribe(const string& session)->shared_ptr<Subscriber> {
+	auto subscriber = std::make_shared<Subscriber>(session);
+	// tells EventSource how long to wait before reconnecting
+	subscriber->m_pending = "retry: 3000\n\n";
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto& channel = m_channels[session];
+	// drop subscribers whose streams have ended while we're here
+	channel.erase(std::remove_if(channel.begin(), channel.end(), [](auto& sub) { return sub.expired(); }), channel.end());
+	channel.push_back(subscriber);
+	return subscriber;
+}
+auto ServerEvents::publish(const string& session, const string& event, const string& data)->size_t {
+	string frame;
+	if (!event.empty())
+		frame = "event: " + event + "\n";
+	// every line of the data gets its own field, the client joins them back with newlines
+	string_view sv = data;
+	do {
+		auto pos = sv.find('\n');
+		frame += "data: ";
+		frame.append(sv.substr(0, pos));
+		frame += "\n";
+		sv.remove_prefix(pos == string_view::npos ? sv.size() : pos + 1);
+	} while (!sv.empty());
+	frame += "\n";
+	return send(session, frame);
+}
+auto ServerEvents::heartbeat()->void {
+	send("", ":\n\n");
+}
+auto ServerEvents::close_all()->void {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto& channel : m_channels) {
+		for (auto& sub : channel.second) {
+			if (auto subscriber = sub.lock())
+				subscriber->close();
+		}
+	}
+	m_channels.clear();
+}
+auto ServerEvents::send(const string& session, const string& frame)->size_t {
+	size_t reached = 0;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto deliver = [&](vector<std::weak_ptr<Subscriber>>& channel) {
+		for (auto it = channel.begin(); it != channel.end(); ) {
+			auto subscriber = it->lock();
+			if (subscriber && subscriber->push(frame)) {
+				++reached;
+				++it;
+			}
+			else it = channel.erase(it);
+		}
+	};
+	if (session.empty()) {
+		for (auto it = m_channels.begin(); it != m_channels.end(); ) {
+			deliver(it->second);
+			it = it->second.empty() ? m_channels.erase(it) : std::next(it);
+		}
+	}
+	else {
+		auto it = m_channels.find(session);
+		if (it != m_channels.end()) {
+			deliver(it->second);
+			if (it->second.empty()) m_channels.erase(it);
+		}
+	}
+	return reached;
+}
\ No newline at end of file
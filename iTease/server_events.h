@@ -0,0 +1,62 @@
+#pragma once
+#include <mutex>
+#include "common.h"
+
+namespace iTease {
+	/**
+	 * ServerEvents - per-session channels of Server-Sent Events
+	 * Each open event stream is a subscriber whose connection is suspended while it has nothing to send
+	**/
+	class ServerEvents {
+	public:
+		/**
+		 * Subscriber - an open event stream, read by the server and written by publish()
+		**/
+		class Subscriber {
+			friend class ServerEvents;
+
+		public:
+			Subscriber(string session) : m_session(std::move(session))
+			{ }
+
+			// set by the server, called with the subscriber's lock held so a resume can never overtake its suspend
+			std::function<void()> suspend;
+			std::function<void()> resume;
+
+			// copies pending event data to buf, suspending the connection if there is none
+			// returns the number of bytes copied, 0 once suspended, -1 when the stream was closed
+			auto read(char* buf, size_t max)->int64_t;
+			// ends the stream, e.g. when the client went away
+			auto close()->void;
+
+		private:
+			// queues a frame and wakes the connection, returns false if the subscriber is closed or too far behind
+			auto push(const string& frame)->bool;
+
+		private:
+			std::mutex m_mutex;
+			string m_session;
+			string m_pending;
+			size_t m_pendingOffset = 0;
+			bool m_suspended = false;
+			bool m_closed = false;
+		};
+
+	public:
+		// opens an event stream for the session
+		auto subscribe(const string& session)->shared_ptr<Subscriber>;
+		// sends an event to the session's streams, or to every stream if session is empty, returns the number reached
+		auto publish(const string& session, const string& event, const string& data)->size_t;
+		// sends a comment to every stream, which keeps proxies from timing them out and finds clients that left
+		auto heartbeat()->void;
+		// ends every stream, their connections are resumed so the server can stop
+		auto close_all()->void;
+
+	private:
+		auto send(const string& session, const string& frame)->size_t;
+
+	private:
+		std::mutex m_mutex;
+		unordered_map<string, vector<std::weak_ptr<Subscriber>>> m_channels;
+	};
+}
\ No newline at end of file
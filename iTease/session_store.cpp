@@ -0,0 +1,170 @@
+#include "stdinc.h"
+#include "session_store.h"
+#include "db.h"
+#include "logging.h"
+
+using namespace iTease;
+
+constexpr size_t MaxSessions = 65536;
+// sessions idle this long are dropped from memory, bound ones can still be restored from the database
+constexpr auto SessionIdleTTL = std::chrono::minutes(30);
+// persisted bindings not seen this long are deleted
+constexpr auto PersistedSessionTTL = std::chrono::hours(24 * 30);
+// limits last-seen writes for busy sessions
+constexpr auto SeenWriteInterval = std::chrono::hours(1);
+constexpr auto PurgeInterval = std::chrono::hours(1);
+// sessions examined per sweep, keeps each tick short
+constexpr size_t SweepBatch = 256;
+constexpr size_t MaxSessionIdLength = 64;
+
+static auto unix_now()->int64_t {
+	return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+auto Session::bind(uint64_t userId, shared_ptr<void> user)->void {
+	std::atomic_store(&m_data, std::move(user));
+	user_id = userId;
+	if (m_store) m_store->queue_write(id, userId);
+}
+
+SessionStore::SessionStore(Database* db, Metrics::Histogram& queryTime) : m_db(db), m_queryTime(queryTime) {
+	if (m_db) {
+		*m_db << "CREATE TABLE IF NOT EXISTS sessions ("
+			"	'id'	TEXT(64)		PRIMARY KEY					NOT NULL,"
+			"	'user'	INTEGER			NOT NULL,"
+			"	'seen'	INTEGER			NOT NULL"
+			")";
+	}
+}
+SessionStore::~SessionStore() {
+	try {
+		flush();
+	}
+	catch (const sqlite::sqlite_exception& ex) {
+		ITEASE_LOGERROR("Failed to save sessions: " << ex.what());
+	}
+}
+auto SessionStore::create()->shared_ptr<Session> {
+	return insert(std::make_shared<Session>(rand_md5(), this));
+}
+auto SessionStore::find(const string& id)->shared_ptr<Session> {
+	auto& sh = shard(id);
+	auto now = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> lock(sh.mutex);
+	auto it = sh.nodes.find(id);
+	if (it == sh.nodes.end())
+		return nullptr;
+	auto& node = it->second;
+	node.accessed = now;
+	sh.lru.splice(sh.lru.begin(), sh.lru, node.lru);
+	if (auto userId = node.session->user_id.load()) {
+		if (now - node.persisted >= SeenWriteInterval) {
+			node.persisted = now;
+			queue_write(id, userId);
+		}
+	}
+	return node.session;
+}
+auto SessionStore::load(const string& id)->uint64_t {
+	if (!m_db || id.empty() || id.size() > MaxSessionIdLength)
+		return 0;
+	if (!std::all_of(id.begin(), id.end(), [](char c) { return std::isalnum(static_cast<unsigned char>(c)) != 0; }))
+		return 0;
+	int64_t userId = 0;
+	auto since = unix_now() - std::chrono::duration_cast<std::chrono::seconds>(PersistedSessionTTL).count();
+	Metrics::Timer timer(m_queryTime);
+	*m_db << "SELECT user FROM sessions WHERE id = ? AND seen >= ?"
+		<< id << since
+		>> [&](int64_t user) { userId = user; };
+	return static_cast<uint64_t>(userId);
+}
+auto SessionStore::restore(const string& id, uint64_t userId, shared_ptr<void> user)->shared_ptr<Session> {
+	auto session = std::make_shared<Session>(id, this);
+	// queues the binding again, refreshing its last-seen time, as the restoring request counts as a visit
+	session->bind(userId, std::move(user));
+	return insert(std::move(session));
+}
+auto SessionStore::sweep()->void {
+	auto& sh = m_shards[m_sweepShard];
+	m_sweepShard = (m_sweepShard + 1) % NumShards;
+	auto now = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> lock(sh.mutex);
+	for (size_t i = 0; i < SweepBatch && !sh.lru.empty(); ++i) {
+		auto it = sh.nodes.find(sh.lru.back());
+		// the list is ordered by access, so the first live session ends the sweep
+		if (now - it->second.accessed < SessionIdleTTL)
+			break;
+		sh.nodes.erase(it);
+		sh.lru.pop_back();
+	}
+}
+auto SessionStore::flush()->void {
+	if (!m_db) return;
+	unordered_map<string, uint64_t> pending;
+	{
+		std::lock_guard<std::mutex> lock(m_pendingMutex);
+		pending.swap(m_pending);
+	}
+	auto now = std::chrono::steady_clock::now();
+	bool purge = now - m_lastPurge >= PurgeInterval;
+	if (pending.empty() && !purge)
+		return;
+	auto seen = unix_now();
+	// the batch as a whole, it's written in one transaction
+	Metrics::Timer timer(m_queryTime);
+	*m_db << "BEGIN;";
+	try {
+		for (auto& pr : pending) {
+			if (pr.second) {
+				*m_db << "INSERT OR REPLACE INTO sessions (id, user, seen) VALUES (?, ?, ?)"
+					<< pr.first << static_cast<int64_t>(pr.second) << seen;
+			}
+			else *m_db << "DELETE FROM sessions WHERE id = ?" << pr.first;
+		}
+		if (purge) {
+			m_lastPurge = now;
+			*m_db << "DELETE FROM sessions WHERE seen < ?"
+				<< seen - std::chrono::duration_cast<std::chrono::seconds>(PersistedSessionTTL).count();
+		}
+		*m_db << "COMMIT;";
+	}
+	catch (...) {
+		*m_db << "ROLLBACK;";
+		throw;
+	}
+}
+auto SessionStore::size()->size_t {
+	size_t n = 0;
+	for (auto& sh : m_shards) {
+		std::lock_guard<std::mutex> lock(sh.mutex);
+		n += sh.nodes.size();
+	}
+	return n;
+}
+auto SessionStore::shard(const string& id)->Shard& {
+	return m_shards[std::hash<string>{}(id) % NumShards];
+}
+auto SessionStore::insert(shared_ptr<Session> session)->shared_ptr<Session> {
+	auto& sh = shard(session->id);
+	auto now = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> lock(sh.mutex);
+	auto it = sh.nodes.find(session->id);
+	if (it != sh.nodes.end()) {
+		// a concurrent restore of the same session got there first
+		sh.lru.splice(sh.lru.begin(), sh.lru, it->second.lru);
+		it->second.accessed = now;
+		return it->second.session;
+	}
+	// at capacity the least recently used session goes, requests using it keep their reference
+	if (sh.nodes.size() >= MaxSessions / NumShards) {
+		sh.nodes.erase(sh.lru.back());
+		sh.lru.pop_back();
+	}
+	sh.lru.push_front(session->id);
+	sh.nodes.emplace(session->id, Node{session, now, now, sh.lru.begin()});
+	return session;
+}
+auto SessionStore::queue_write(const string& id, uint64_t userId)->void {
+	std::lock_guard<std::mutex> lock(m_pendingMutex);
+	m_pending[id] = userId;
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include "common.h"
+#include "metrics.h"
+
+namespace iTease {
+	class Database;
+	class SessionStore;
+
+	struct Session {
+		const string id;
+		// user bound by bind(), 0 for anonymous sessions
+		std::atomic<uint64_t> user_id{0};
+
+		Session(string id, SessionStore* store) : id(std::move(id)), m_store(store)
+		{ }
+
+		// binds a user to the session, the binding is persisted so logins survive restarts
+		auto bind(uint64_t userId, shared_ptr<void> user)->void;
+		// the user bound to the session, read by workers serving its other requests while it's bound
+		auto data() const { return std::atomic_load(&m_data); }
+
+	private:
+		SessionStore* m_store;
+		shared_ptr<void> m_data;
+	};
+
+	/**
+	 * SessionStore - sharded, bounded store of sessions expiring after a period of inactivity
+	 * Least recently used sessions are evicted at capacity, user bindings are written behind to the database
+	**/
+	class SessionStore {
+		friend struct Session;
+
+	public:
+		SessionStore(Database*, Metrics::Histogram& queryTime);
+		~SessionStore();
+		SessionStore(const SessionStore&) = delete;
+		auto operator=(const SessionStore&)->SessionStore& = delete;
+
+		auto create()->shared_ptr<Session>;
+		// returns a session held in memory, refreshing its idle time
+		auto find(const string& id)->shared_ptr<Session>;
+		// returns the user bound to a persisted session, 0 if there is none or it expired, a single statement any thread may run
+		auto load(const string& id)->uint64_t;
+		// puts a persisted session back in memory with its user
+		auto restore(const string& id, uint64_t userId, shared_ptr<void> user)->shared_ptr<Session>;
+		// expires idle sessions of the next shard, call regularly
+		auto sweep()->void;
+		// writes pending bindings to the database, callers serialise database access
+		auto flush()->void;
+		auto size()->size_t;
+
+	private:
+		struct Node {
+			shared_ptr<Session> session;
+			std::chrono::steady_clock::time_point accessed;
+			// when the binding's last-seen time was last queued for writing
+			std::chrono::steady_clock::time_point persisted;
+			std::list<string>::iterator lru;
+		};
+		struct Shard {
+			std::mutex mutex;
+			unordered_map<string, Node> nodes;
+			// most recently used first
+			std::list<string> lru;
+		};
+		static constexpr size_t NumShards = 16;
+
+		auto shard(const string& id)->Shard&;
+		auto insert(shared_ptr<Session>)->shared_ptr<Session>;
+		// queues the session's binding for the next flush
+		auto queue_write(const string& id, uint64_t userId)->void;
+
+	private:
+		Database* m_db;
+		Metrics::Histogram& m_queryTime;
+		std::array<Shard, NumShards> m_shards;
+		size_t m_sweepShard = 0;
+		std::mutex m_pendingMutex;
+		// session id to bound user
+		unordered_map<string, uint64_t> m_pending;
+		std::chrono::steady_clock::time_point m_lastPurge;
+	};
+}
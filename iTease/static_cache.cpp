@@ -0,0 +1,159 @@
+#include "stdinc.h"
+#include <MurmurHash3/MurmurHash3.h>
+#include "static_cache.h"
+#include "application.h"
+#include "compression.h"
+
+using namespace iTease;
+
+// files above this size are streamed from disk rather than kept in memory
+constexpr uint64_t MaxCachedFileSize = 1024 * 1024; // 1MB
+constexpr size_t MaxCacheDataSize = 32 * 1024 * 1024; // 32MB
+constexpr size_t MaxCacheEntries = 4096;
+constexpr size_t MaxMissingEntries = 4096;
+// how long an entry is trusted before its file is stat'd again
+constexpr auto RevalidateInterval = std::chrono::seconds(1);
+constexpr const char* HttpDateFormat = "%a, %d %b %Y %H:%M:%S GMT";
+
+static auto strip_weak(string_view tag) {
+	tag = trim(tag);
+	if (tag.substr(0, 2) == "W/") tag.remove_prefix(2);
+	return tag;
+}
+
+auto StaticCache::get(const fs::path& path)->shared_ptr<const Entry> {
+	auto key = path.generic_string();
+	auto now = std::chrono::steady_clock::now();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_slots.find(key);
+		if (it != m_slots.end() && now - it->second.checked < RevalidateInterval) {
+			m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+			return it->second.entry;
+		}
+		auto missing = m_missing.find(key);
+		if (missing != m_missing.end() && now - missing->second < RevalidateInterval)
+			return nullptr;
+	}
+
+	// stat without holding the lock
+	std::error_code ec;
+	auto regular = fs::is_regular_file(path, ec);
+	auto size = regular ? fs::file_size(path, ec) : 0;
+	auto ftime = regular ? fs::last_write_time(path, ec) : fs::file_time_type{};
+	if (!regular || ec) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_slots.find(key);
+		if (it != m_slots.end()) {
+			if (it->second.entry->data) m_dataSize -= it->second.entry->data->size();
+			m_lru.erase(it->second.lru);
+			m_slots.erase(it);
+		}
+		// misses are as easy to make up as they are to send, expired ones go first and then the lot
+		if (m_missing.size() >= MaxMissingEntries) {
+			for (auto missing = m_missing.begin(); missing != m_missing.end();)
+				missing = now - missing->second < RevalidateInterval ? std::next(missing) : m_missing.erase(missing);
+			if (m_missing.size() >= MaxMissingEntries)
+				m_missing.clear();
+		}
+		m_missing[key] = now;
+		return nullptr;
+	}
+	auto mtime = decltype(ftime)::clock::to_time_t(ftime);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_missing.erase(key);
+		auto it = m_slots.find(key);
+		if (it != m_slots.end() && it->second.entry->size == size && it->second.entry->mtime == mtime) {
+			it->second.checked = now;
+			m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+			return it->second.entry;
+		}
+	}
+
+	auto entry = load(path, size, mtime);
+	if (!entry) return nullptr;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_slots.find(key);
+	if (it != m_slots.end()) {
+		if (it->second.entry->data) m_dataSize -= it->second.entry->data->size();
+		m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+	}
+	else {
+		m_lru.push_front(key);
+		it = m_slots.emplace(key, Slot{nullptr, now, m_lru.begin()}).first;
+	}
+	it->second.entry = entry;
+	it->second.checked = now;
+	if (entry->data) m_dataSize += entry->data->size();
+	evict();
+	return entry;
+}
+auto StaticCache::clear()->void {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_slots.clear();
+	m_lru.clear();
+	m_missing.clear();
+	m_dataSize = 0;
+}
+auto StaticCache::not_modified(const Entry& entry, const string& ifNoneMatch, const string& ifModifiedSince)->bool {
+	// If-None-Match takes precedence, If-Modified-Since is ignored when it's present
+	if (!ifNoneMatch.empty()) {
+		if (trim(ifNoneMatch) == "*")
+			return true;
+		auto etag = strip_weak(entry.etag);
+		string_view tags = ifNoneMatch;
+		while (!tags.empty()) {
+			auto pos = tags.find(',');
+			// encoded variants share the identity ETag's validity
+			if (decoded_etag(strip_weak(tags.substr(0, pos))) == etag)
+				return true;
+			if (pos == string_view::npos) break;
+			tags.remove_prefix(pos + 1);
+		}
+		return false;
+	}
+	if (!ifModifiedSince.empty()) {
+		std::istringstream ss(ifModifiedSince);
+		date::sys_seconds since;
+		ss >> date::parse(HttpDateFormat, since);
+		if (!ss.fail())
+			return std::chrono::system_clock::from_time_t(entry.mtime) <= since;
+	}
+	return false;
+}
+auto StaticCache::load(const fs::path& path, uint64_t size, std::time_t mtime)->shared_ptr<const Entry> {
+	auto entry = std::make_shared<Entry>();
+	entry->path = path.string();
+	entry->size = size;
+	entry->mtime = mtime;
+	entry->last_modified = date::format(HttpDateFormat, date::floor<std::chrono::seconds>(std::chrono::system_clock::from_time_t(mtime)));
+	entry->content_type = get_content_type_by_extension(string(ltrim(path.extension().string(), ".")));
+	if (size <= MaxCachedFileSize) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file.is_open()) return nullptr;
+		auto data = std::make_shared<string>();
+		data->resize(static_cast<size_t>(size));
+		if (!file.read(&(*data)[0], data->size()))
+			return nullptr;
+		uint64_t hash[2];
+		MurmurHash3_x64_128(data->data(), static_cast<int>(data->size()), 0, hash);
+		entry->etag = fmt::format("\"{:016x}{:016x}\"", hash[0], hash[1]);
+		entry->data = std::move(data);
+	}
+	// hashing would mean reading the whole file, so large files are validated by size and mtime
+	// the tag is strong so If-Range can resume downloads of them, only a rewrite of the same size within a second goes unnoticed
+	else entry->etag = fmt::format("\"{:x}-{:x}\"", size, static_cast<uint64_t>(mtime));
+	return entry;
+}
+auto StaticCache::evict()->void {
+	while ((m_dataSize > MaxCacheDataSize || m_slots.size() > MaxCacheEntries) && !m_lru.empty()) {
+		auto it = m_slots.find(m_lru.back());
+		if (it != m_slots.end()) {
+			if (it->second.entry->data) m_dataSize -= it->second.entry->data->size();
+			m_slots.erase(it);
+		}
+		m_lru.pop_back();
+	}
+}
\ No newline at end of file
@@ -0,0 +1,53 @@
+#pragma once
+#include <chrono>
+#include <list>
+#include <mutex>
+#include "common.h"
+
+namespace iTease {
+	/**
+	 * StaticCache - bounded LRU cache of static files keyed by path and revalidated against their mtime
+	 * Small files keep their content in memory, every entry carries validators for conditional requests
+	**/
+	class StaticCache {
+	public:
+		struct Entry {
+			string path;
+			uint64_t size = 0;
+			std::time_t mtime = 0;
+			// quoted and strong, MurmurHash3 of the content for cached files, size & mtime for larger ones
+			string etag;
+			// HTTP-date of mtime
+			string last_modified;
+			string content_type;
+			// file content, empty for files too large to cache
+			shared_ptr<const string> data;
+		};
+
+		// returns the entry for a regular file, loading or reloading it if it changed on disk
+		auto get(const fs::path&)->shared_ptr<const Entry>;
+		auto clear()->void;
+
+		// returns true if the request's If-None-Match / If-Modified-Since validators match the entry
+		static auto not_modified(const Entry&, const string& ifNoneMatch, const string& ifModifiedSince)->bool;
+
+	private:
+		struct Slot {
+			shared_ptr<const Entry> entry;
+			std::chrono::steady_clock::time_point checked;
+			std::list<string>::iterator lru;
+		};
+
+		auto load(const fs::path&, uint64_t size, std::time_t mtime)->shared_ptr<const Entry>;
+		auto evict()->void;
+
+	private:
+		std::mutex m_mutex;
+		unordered_map<string, Slot> m_slots;
+		// most recently used first
+		std::list<string> m_lru;
+		size_t m_dataSize = 0;
+		// paths found not to be files, with when they were checked, so misses aren't stat'd on every request
+		unordered_map<string, std::chrono::steady_clock::time_point> m_missing;
+	};
+}
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "stdinc.h"
+#include <shared_mutex>
 #include "template.h"
 #include "web.h"
 #include "cpp/string.h"
@@ -6,9 +7,87 @@
 using namespace iTease;
 using namespace iTease::Templating;
 
+// fragments kept per cached block, for pages rendering it with different inputs
+constexpr std::size_t FragmentSlots = 4;
+// FNV-1a primes, hashing the inputs of cached blocks to pick out the fragment to compare them with
+constexpr uint64_t HashBasis = 14695981039346656037ull;
+constexpr uint64_t HashPrime = 1099511628211ull;
+// minimum growth of a block's recorded inputs
+constexpr std::size_t RecordingStep = 512;
+
+auto Templating::intern(string_view name)->Symbol {
+	static std::shared_mutex mutex;
+	static std::unordered_map<string, Symbol> symbols;
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		auto it = symbols.find(string(name));
+		if (it != symbols.end()) return it->second;
+	}
+	std::unique_lock<std::shared_mutex> lock(mutex);
+	return symbols.emplace(string(name), static_cast<Symbol>(symbols.size())).first->second;
+}
+
+// template tags, matched case-insensitively
+enum class Tag {
+	None, Block, Var, Seg, Begin, End, If, EndIf, Opt
+};
+
+static auto parse_tag(string_view name) {
+	static constexpr pair<const char*, Tag> tags[] = {
+		{"block", Tag::Block}, {"var", Tag::Var}, {"seg", Tag::Seg}, {"begin", Tag::Begin},
+		{"end", Tag::End}, {"if", Tag::If}, {"endif", Tag::EndIf}, {"opt", Tag::Opt}
+	};
+	for (auto& pr : tags) {
+		string_view tag = pr.first;
+		if (tag.size() == name.size() && std::equal(tag.begin(), tag.end(), name.begin(), [](char a, char b) { return a == std::tolower(static_cast<unsigned char>(b)); }))
+			return pr.second;
+	}
+	return Tag::None;
+}
+static auto hash_of(string_view data) {
+	auto hash = HashBasis;
+	auto bytes = reinterpret_cast<const unsigned char*>(data.data());
+	auto size = data.size();
+	// a word at a time, folding the high bits back down as the multiply only carries upwards
+	for (; size >= sizeof(uint64_t); bytes += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+		uint64_t word;
+		std::memcpy(&word, bytes, sizeof(word));
+		hash = (hash ^ word) * HashPrime;
+		hash ^= hash >> 32;
+	}
+	for (; size; ++bytes, --size)
+		hash = (hash ^ *bytes) * HashPrime;
+	return hash;
+}
+static auto grow(Recording& inputs, std::size_t size)->void {
+	inputs.bytes.resize(std::max(inputs.bytes.size() * 2, inputs.size + size + RecordingStep));
+}
+// inline, as it's called for every value a cached block reads, the rare growth is kept out of it
+static inline auto record(Recording& inputs, const void* data, std::size_t size) {
+	if (inputs.bytes.size() - inputs.size < size) grow(inputs, size);
+	std::memcpy(&inputs.bytes[inputs.size], data, size);
+	inputs.size += size;
+}
+template<typename T>
+static inline auto record(Recording& inputs, T value)->std::enable_if_t<std::is_arithmetic_v<T>> {
+	record(inputs, &value, sizeof(value));
+}
+// unset values record differently from empty ones, and lengths go first so values can't run into each other
+static inline auto record(Recording& inputs, const string* value) {
+	record(inputs, value != nullptr);
+	if (!value) return;
+	record(inputs, value->size());
+	record(inputs, value->data(), value->size());
+}
+// true if the text only has whitespace, as trimmed by ltrim
+static auto is_blank(string_view text) {
+	return text.find_first_not_of(" \t\n\r") == string_view::npos;
+}
+
 Node::Node(const Node& v) : m_order(v.m_order), m_index(v.m_index), m_vars(v.m_vars), m_blocks(v.m_blocks), m_options(v.m_options), m_segments(v.m_segments), m_enabled(v.m_enabled) {
 	for (auto& el : v.m_elements) {
-		m_elements.emplace_back(el->copy());
+		// segments are never changed once loaded, so copies share them
+		m_elements.emplace_back(el->type() == ElementType::Segment ? el : el->copy());
 	}
 }
 auto Node::operator=(const Node& v)->Node& {
@@ -20,10 +99,12 @@ auto Node::operator=(const Node& v)->Node& {
 	m_options = v.m_options;
 	m_segments = v.m_segments;
 	m_enabled = v.m_enabled;
+	invalidate();
 
 	m_elements.clear();
 	for (auto& el : v.m_elements) {
-		m_elements.emplace_back(el->copy());
+		// segments are never changed once loaded, so copies share them
+		m_elements.emplace_back(el->type() == ElementType::Segment ? el : el->copy());
 	}
 	for (auto& pr : m_blocks) {
 		std::static_pointer_cast<Block>(m_elements[pr.second])->set_parent(this);
@@ -38,35 +119,85 @@ auto Node::clear()->void {
 	m_blocks.clear();
 	m_vars.clear();
 	m_order.clear();
+	m_index.clear();
 	m_error = "";
+	invalidate();
 }
 auto Node::load(std::istream& in)->bool {
+	// read in bulk and parse the whole buffer in one pass
+	auto data = std::make_shared<string>();
+	char chunk[16384];
+	while (in.read(chunk, sizeof(chunk)) || in.gcount())
+		data->append(chunk, static_cast<std::size_t>(in.gcount()));
+	return load(shared_ptr<const string>(std::move(data)));
+}
+auto Node::load(string_view data)->bool {
+	// copied once as a whole, for segments to keep views of
+	return load(std::make_shared<const string>(data));
+}
+auto Node::load(shared_ptr<const string> buffer)->bool {
+	string_view data = *buffer;
 	long ln = 0;
 	try {
-		in.unsetf(std::ios::skipws);
-		string buff;
-		buff.reserve(1024);
+		// content of the next segment, as spans of data
+		vector<string_view> buff;
+		auto append = [&buff](string_view span) {
+			if (span.empty()) return;
+			// spans continuing the last one (e.g. a line and its break) are merged into it
+			if (!buff.empty() && buff.back().data() + buff.back().size() == span.data())
+				buff.back() = string_view(buff.back().data(), buff.back().size() + span.size());
+			else buff.push_back(span);
+		};
+		// a segment is usually a single span, viewed in place, it's only joined if a line break was dropped within it
+		auto take = [&buff, &buffer]() {
+			Text text{buffer, buff.size() == 1 ? buff.front() : string_view()};
+			if (buff.size() > 1) {
+				auto joined = std::make_shared<string>();
+				std::size_t size = 0;
+				for (auto& span : buff) size += span.size();
+				joined->reserve(size);
+				for (auto& span : buff) joined->append(span.data(), span.size());
+				text.content = *joined;
+				text.buffer = std::move(joined);
+			}
+			buff.clear();
+			return text;
+		};
 		std::stack<Element*> blocks;
 		bool skipnl = false;
 		string segment = "";
-		for (string str; std::getline(in, str); ++ln) {
-			if (ln && !skipnl) buff += "\n";
-			auto start = str.begin();
+		auto last = data.data() + data.size();
+		// as with getline, a line break ending the data doesn't begin another line
+		for (auto line = data.data(); line < last; ++ln) {
+			auto eol = static_cast<const char*>(std::memchr(line, '\n', last - line));
+			auto line_end = eol ? eol : last;
+			if (ln && !skipnl) append(string_view(line - 1, 1));
+			auto start = line;
 			skipnl = false;
-			for (auto cur = str.begin(); cur != str.end();) {
-				auto it = std::find(cur, str.end(), '{');
-				if (it == str.end()) break;
+			// whether the text of the line up to start is all whitespace, tags aside
+			bool blank = true;
+			for (auto cur = line; cur < line_end;) {
+				auto it = static_cast<const char*>(std::memchr(cur, '{', line_end - cur));
+				if (!it) break;
 				auto beg = it++;
-				if (it != str.end() && *it == '%') {
-					auto it2 = std::find(++it, str.end(), '%');
-					if (it2 != str.end()) {
-						auto end = it2 + 1;
-						if (end != str.end() && *end++ == '}') {
-							string inside(it, it2);
-							auto p = std::find(inside.begin(), inside.end(), ':');
-							string name(inside.begin(), p),
-								param(p != inside.end() ? p + 1 : p, inside.end());
-							std::transform(name.begin(), name.end(), name.begin(), [](char c) { return std::tolower(c); });
+				if (it != line_end && *it == '%') {
+					auto it2 = static_cast<const char*>(std::memchr(it + 1, '%', line_end - (it + 1)));
+					if (!it2) break;
+					++it;
+					auto end = it2 + 1;
+					if (end != line_end && *end++ == '}') {
+						string_view inside(it, it2 - it);
+						auto colon = inside.find(':');
+						auto name_view = inside.substr(0, colon);
+						auto param_view = colon != string_view::npos ? inside.substr(colon + 1) : string_view();
+						auto tag = parse_tag(name_view);
+						auto valid = tag == Tag::Opt || std::all_of(param_view.begin(), param_view.end(), [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; });
+						if (valid && tag != Tag::None) {
+							string param(param_view);
+							blank = blank && is_blank(string_view(start, beg - start));
+							append(string_view(start, beg - start));
+							// the rest of the line, for tags which drop the line break if they're alone on their line
+							auto alone = blank && is_blank(string_view(end, line_end - end));
 
 							// get top stack block
 							auto topElement = !blocks.empty() ? blocks.top() : nullptr;
@@ -84,154 +215,130 @@ auto Node::load(std::istream& in)->bool {
 								}
 							}
 
-							// check tag
-							if (name != "block" && name != "var" && name != "seg" &&
-								name != "begin" && name != "end" &&
-								name != "if" && name != "endif" &&
-								name != "opt") name = "";
-							auto inv = name == "opt" ? param.end() : std::find_if_not(param.begin(), param.end(), [](char c) { return std::isalnum(c) || c == '_'; });
-							if (inv == param.end() && !name.empty()) {
-								// erase tag
-								str.replace(beg, end, "");
-
-								//auto cbeg = std::find_if(str.begin(), beg, [](char c) { return !std::isspace(c); });
-								//if (cbeg != beg) {
-								auto line_left = string(start, beg);
-								buff += /*(ln && name != "begin" && name != "end" ? "\n\r" : "") +*/ line_left;
-								//}
-
-								// process option tags
-								if (name == "opt") {
-									if (topNode) topNode->add_segment(buff);
-									else add_segment(buff);
-									auto p = std::find(param.begin(), param.end(), '=');
-									string optname(param.begin(), p),
-										optval(p != param.end() ? p + 1 : p, param.end());
-									if (topNode)
-										topNode->m_options.emplace(optname, optval);
-									else
-										m_options.emplace(optname, optval);
-									skipnl = ltrim(str).empty();
-								}
-								// process named segments
-								else if (name == "seg") {
-									if (topNode) topNode->add_segment(buff);
-									else add_segment(buff);
-									if (!segment.empty())
-										throw std::runtime_error("segments cannot be nested");
-									segment = param;
-									skipnl = ltrim(str).empty();
-								}
-								// process var/block tags
-								else if (name == "begin") {
-									if (!segment.empty())
-										throw std::runtime_error("cannot nest a block within a segment");
-									if (!blocks.empty()) topNode->add_segment(buff);
-									else add_segment(buff);
-									// begin a sub-block
-									if (param == "block" || param == "var" || param == "blocks" || param == "vars")
-										throw std::runtime_error("disallowed block/var name");
-									if (topNode)
-										blocks.push(topNode->add_block(param).get());
-									else
-										blocks.push(add_block(param).get());
-									skipnl = ltrim(str).empty();
+							// process option tags
+							if (tag == Tag::Opt) {
+								if (topNode) topNode->add_segment(take());
+								else add_segment(take());
+								auto p = param.find('=');
+								string optname = param.substr(0, p),
+									optval = p != string::npos ? param.substr(p + 1) : "";
+								if (topNode)
+									topNode->m_options.emplace(optname, optval);
+								else
+									m_options.emplace(optname, optval);
+								skipnl = alone;
+							}
+							// process named segments
+							else if (tag == Tag::Seg) {
+								if (topNode) topNode->add_segment(take());
+								else add_segment(take());
+								if (!segment.empty())
+									throw std::runtime_error("segments cannot be nested");
+								segment = param;
+								skipnl = alone;
+							}
+							// process var/block tags
+							else if (tag == Tag::Begin) {
+								if (!segment.empty())
+									throw std::runtime_error("cannot nest a block within a segment");
+								if (!blocks.empty()) topNode->add_segment(take());
+								else add_segment(take());
+								// begin a sub-block
+								if (param == "block" || param == "var" || param == "blocks" || param == "vars")
+									throw std::runtime_error("disallowed block/var name");
+								if (topNode)
+									blocks.push(topNode->add_block(param).get());
+								else
+									blocks.push(add_block(param).get());
+								skipnl = alone;
+							}
+							else if (tag == Tag::End) {
+								if (!segment.empty()) {
+									if (segment != param)
+										throw std::runtime_error("end of segment name mismatch, expected '" + segment + "'");
 								}
-								else if (name == "end") {
-									if (!segment.empty()) {
-										if (segment != param)
-											throw std::runtime_error("end of segment name mismatch, expected '" + segment + "'");
-									}
-									else if (!topBlock)
-										throw std::runtime_error("end found when not in a block or segment");
-									else if (param != topBlock->name())
-										throw std::runtime_error("end of block name mismatch, expected '" + topBlock->name() + "'");
+								else if (!topBlock)
+									throw std::runtime_error("end found when not in a block or segment");
+								else if (param != topBlock->name())
+									throw std::runtime_error("end of block name mismatch, expected '" + topBlock->name() + "'");
 
-									if (!segment.empty()) {
-										if (topNode) topNode->add_segment(buff, segment);
-										else add_segment(buff, segment);
-										segment = "";
-									}
-									else {
-										// end the sub-block
-										if (!buff.empty()) {
-											topBlock->add_segment(buff, segment);
-											buff = "";
-										}
-										blocks.pop();
-									}
-									skipnl = ltrim(str).empty();
+								if (!segment.empty()) {
+									if (topNode) topNode->add_segment(take(), segment);
+									else add_segment(take(), segment);
+									segment = "";
 								}
-								// process conditional segments
-								else if (name == "if") {
-									if (!segment.empty())
-										throw std::runtime_error("cannot nest an if-block within a segment");
-									if (!blocks.empty()) topNode->add_segment(buff);
-									else add_segment(buff);
-									// begin a conditional block
-									if (topNode)
-										blocks.push(topNode->add_conditional(param).get());
-									else
-										blocks.push(add_conditional(param).get());
-									skipnl = ltrim(str).empty();
-									//if (!blocks.empty()))
-									//blocks.push(blocks
-								}
-								else if (name == "endif") {
-									if (!param.empty())
-										throw std::runtime_error("unexpected param in endif tag");
-									if (!topConditional)
-										throw std::runtime_error("end of if-block found when not in an if-block");
-									if (!segment.empty())
-										throw std::runtime_error("end of if-block found while still in segment");
-
+								else {
 									// end the sub-block
-									if (!buff.empty()) {
-										topConditional->add_segment(buff, segment);
-										buff = "";
-									}
+									if (!buff.empty())
+										topBlock->add_segment(take(), segment);
 									blocks.pop();
-									skipnl = ltrim(str).empty();
 								}
-								else {
-									// if in a sub-block, add vars and blocks to it instead
-									if (param == "block" || param == "var" || param == "blocks" || param == "vars")
-										throw std::runtime_error("disallowed block/var name");
-									if (topNode) {
-										topNode->add_segment(buff, segment);
+								skipnl = alone;
+							}
+							// process conditional segments
+							else if (tag == Tag::If) {
+								if (!segment.empty())
+									throw std::runtime_error("cannot nest an if-block within a segment");
+								if (!blocks.empty()) topNode->add_segment(take());
+								else add_segment(take());
+								// begin a conditional block
+								if (topNode)
+									blocks.push(topNode->add_conditional(param).get());
+								else
+									blocks.push(add_conditional(param).get());
+								skipnl = alone;
+							}
+							else if (tag == Tag::EndIf) {
+								if (!param.empty())
+									throw std::runtime_error("unexpected param in endif tag");
+								if (!topConditional)
+									throw std::runtime_error("end of if-block found when not in an if-block");
+								if (!segment.empty())
+									throw std::runtime_error("end of if-block found while still in segment");
 
-										if (name == "var") topNode->add_variable(param);
-										else if (name == "block") topNode->add_block(param);
-									}
-									else {
-										add_segment(buff, segment);
+								// end the sub-block
+								if (!buff.empty())
+									topConditional->add_segment(take(), segment);
+								blocks.pop();
+								skipnl = alone;
+							}
+							else {
+								// if in a sub-block, add vars and blocks to it instead
+								if (param == "block" || param == "var" || param == "blocks" || param == "vars")
+									throw std::runtime_error("disallowed block/var name");
+								if (topNode) {
+									topNode->add_segment(take(), segment);
 
-										if (name == "var") add_variable(param);
-										else if (name == "block") add_block(param);
-									}
+									if (tag == Tag::Var) topNode->add_variable(param);
+									else if (tag == Tag::Block) topNode->add_block(param);
 								}
+								else {
+									add_segment(take(), segment);
 
-								buff = "";
-								start = cur = beg;
+									if (tag == Tag::Var) add_variable(param);
+									else if (tag == Tag::Block) add_block(param);
+								}
 							}
-							else cur = end;
+
+							buff.clear();
+							start = cur = end;
 						}
 						else cur = end;
 					}
-					else cur = it2;
+					else cur = end;
 				}
 				else {
 					cur = it;
 				}
 			}
-			if (start != str.end()) {
-				buff += string(start, str.end());
-			}
+			if (start != line_end) append(string_view(start, line_end - start));
+			line = eol ? eol + 1 : last;
 		}
 		if (!blocks.empty()) throw std::runtime_error("still in block at end of template");
 		if (!segment.empty()) throw std::runtime_error("still in segment at end of template");
-		if (!buff.empty()) add_segment(buff);
+		if (!buff.empty()) add_segment(take());
 		m_enabled = m_vars.empty();
+		invalidate();
 	}
 	catch (const std::exception& ex) {
 		throw Templating::LoadError(ex, ln);
@@ -239,46 +346,279 @@ auto Node::load(std::istream& in)->bool {
 	return true;
 }
 auto Node::render(Render out)->void {
-	// manage var scope
-	auto num_set_vars = 0;
+	Scope local;
+	auto compiled = program();
+	execute(*compiled, out.os, out.scope ? *out.scope : local, out.overlay ? out.overlay : Overlay::current(), top(this));
+}
+auto Node::program()->shared_ptr<const Program> {
+	// nodes overlaid for separate requests may be rendered by several threads at once
+	auto compiled = std::atomic_load(&m_program);
+	if (!compiled) {
+		compiled = compile();
+		std::atomic_store(&m_program, compiled);
+	}
+	return compiled;
+}
+auto Node::top(Node* node)->Node* {
+	while (node->parent())
+		node = node->parent();
+	return node;
+}
+auto Node::compile()->shared_ptr<const Program> {
+	auto compiled = std::make_shared<Program>();
+	emit(*compiled);
+	return compiled;
+}
+auto Node::emit(Program& program)->void {
+	auto enter = program.ops.size();
+	program.ops.push_back({OpCode::Enter});
+	program.ops.back().node = this;
+	// elements of named segments are emitted behind a guard, so overlays can toggle them without recompiling
+	std::unordered_map<std::size_t, Symbol> named;
+	for (auto& pr : m_segments)
+		named.emplace(pr.second, intern(pr.first));
+	// guarded text isn't merged with the text around it
+	std::size_t fence = 0;
+	for (auto i : m_order) {
+		// detect problems with managing m_order...
+		if (i >= m_index.size())
+			throw std::range_error("template element order index out of range");
+		auto pr = m_index[i];
+		if (pr.second >= m_elements.size())
+			throw std::range_error("template element order index out of range");
+		auto segment = named.find(i);
+		if (!pr.first && segment == named.end()) continue;
+		auto guard = program.ops.size();
+		if (segment != named.end()) {
+			program.ops.push_back({OpCode::Seg, pr.first ? 1u : 0u});
+			program.ops.back().symbol = segment->second;
+			program.ops.back().node = this;
+		}
+		auto& element = m_elements[pr.second];
+		switch (element->type()) {
+		case ElementType::Segment: {
+			auto content = static_cast<Segment&>(*element).content();
+			auto offset = program.literals.size();
+			program.literals += content;
+			// adjoining segments become a single span
+			if (program.ops.size() > fence && program.ops.back().code == OpCode::Text)
+				program.ops.back().size += static_cast<uint32_t>(content.size());
+			else {
+				program.ops.push_back({OpCode::Text, static_cast<uint32_t>(content.size()), static_cast<uint32_t>(offset)});
+			}
+			break;
+		}
+		case ElementType::Variable:
+			program.ops.push_back({OpCode::Var});
+			program.ops.back().element = element.get();
+			program.elements.push_back(element);
+			break;
+		case ElementType::Block:
+			program.ops.push_back({OpCode::Block});
+			program.ops.back().element = element.get();
+			program.elements.push_back(element);
+			break;
+		case ElementType::Conditional: {
+			// conditionals are inlined, skipping their ops when the var is empty
+			auto conditional = std::static_pointer_cast<Conditional>(element);
+			auto at = program.ops.size();
+			program.ops.push_back({OpCode::If});
+			program.ops.back().symbol = conditional->symbol();
+			program.elements.push_back(element);
+			conditional->emit(program);
+			program.ops[at].arg = static_cast<uint32_t>(program.ops.size());
+			break;
+		}
+		}
+		if (segment != named.end()) {
+			program.ops[guard].arg = static_cast<uint32_t>(program.ops.size());
+			fence = program.ops.size();
+		}
+	}
+	program.ops.push_back({OpCode::Exit});
+	program.ops[enter].arg = static_cast<uint32_t>(program.ops.size() - 1);
+}
+auto Node::enter_scope(Scope& scope, const Overlay* overlay, const map<string, string>* entry)->bool {
+	std::size_t num_set_vars = 0;
+	// vars set in the overlay, including ones the node doesn't declare, for its sub-blocks
+	auto own = overlay ? overlay->find_vars(*this) : nullptr;
+	if (own) {
+		for (auto& pr : *own)
+			scope.set(pr.first, pr.second.second);
+	}
 	for (auto& pr : m_vars) {
-		auto var = std::static_pointer_cast<Variable>(m_elements[pr.second]);
-		if (!var->has_value()) {
-			auto it = out.vars.find(pr.first);
-			if (it != out.vars.end())
-				var->set(it->second);
-			else
-				continue;
+		auto var = static_cast<Variable*>(m_elements[pr.second].get());
+		const string* value = nullptr;
+		if (entry) {
+			auto it = entry->find(pr.first);
+			if (it != entry->end()) value = &it->second;
 		}
-		else out.vars[pr.first] = var->value();
+		if (!value && own) {
+			auto it = own->find(var->symbol());
+			if (it != own->end()) value = &it->second.second;
+		}
+		if (!value && var->has_value()) value = &var->value();
+		if (value) scope.set(var->symbol(), *value);
+		// inherited from an enclosing node
+		else if (!scope.get(var->symbol())) continue;
 		++num_set_vars;
 	}
-	if (m_vars.size() == num_set_vars || m_enabled) {
-		for (auto i : m_order) {
-			// detect problems with managing m_order...
-			if (i >= m_index.size())
-				throw std::range_error("template element order index out of range");
-			auto pr = m_index[i];
-			i = pr.second;
-			if (i >= m_elements.size())
-				throw std::range_error("template element order index out of range");
-			if (!pr.first) continue;
-			auto& element = m_elements[i];
-			element->render(out);
+	if (entry) {
+		// array entries may also set vars the node doesn't use itself, for its sub-blocks
+		for (auto& pr : *entry) {
+			if (m_vars.find(pr.first) == m_vars.end())
+				scope.set(intern(pr.first), pr.second);
+		}
+	}
+	// setting a var enables the node, as set_var does
+	return m_vars.size() == num_set_vars || m_enabled || entry || (own && !own->empty());
+}
+auto Node::execute(const Program& program, std::ostream& os, Scope& scope, const Overlay* overlay, Node* root)->void {
+	auto ops = program.ops.data();
+	auto literals = program.literals.data();
+	// array of the block looping, the overlay's is held in case it's replaced while rendering
+	shared_ptr<const BlockArray> held;
+	const BlockArray* arr = nullptr;
+	const map<string, string>* entry = nullptr;
+	std::size_t iteration = 0;
+	for (std::size_t pc = 0, end = program.ops.size(); pc < end;) {
+		auto& op = ops[pc];
+		switch (op.code) {
+		case OpCode::Text:
+			os.write(literals + op.arg, op.size);
+			++pc;
+			break;
+		case OpCode::Var: {
+			// the node's own value or the inherited one, as resolved on entering it
+			if (auto value = scope.get(static_cast<Variable*>(op.element)->symbol()))
+				os.write(value->data(), value->size());
+			++pc;
+			break;
+		}
+		case OpCode::Enter:
+			scope.enter();
+			pc = op.node->enter_scope(scope, overlay, entry) ? pc + 1 : op.arg;
+			entry = nullptr;
+			break;
+		case OpCode::Exit:
+			scope.exit();
+			++pc;
+			break;
+		case OpCode::If: {
+			auto value = scope.get(op.symbol);
+			pc = value && !value->empty() ? pc + 1 : op.arg;
+			break;
+		}
+		case OpCode::Seg: {
+			auto enabled = overlay ? overlay->find_segment(*op.node, op.symbol) : std::nullopt;
+			pc = (enabled ? *enabled : op.size != 0) ? pc + 1 : op.arg;
+			break;
+		}
+		case OpCode::Block:
+			static_cast<Block*>(op.element)->run(os, scope, overlay, root);
+			++pc;
+			break;
+		case OpCode::Loop: {
+			auto block = static_cast<Block*>(op.element);
+			held = overlay ? overlay->find_array(*block) : nullptr;
+			arr = held ? held.get() : &block->get_array();
+			iteration = 0;
+			entry = !arr->empty() ? &arr->front() : nullptr;
+			++pc;
+			break;
+		}
+		case OpCode::Next:
+			if (++iteration < arr->size()) {
+				entry = &(*arr)[iteration];
+				pc = op.arg;
+			}
+			else ++pc;
+			break;
+		}
+	}
+}
+auto Node::fingerprint(const Program& program, Recording& inputs, const Scope& scope, const Overlay* overlay, Node* root)->bool {
+	// the structure, the same program renders the same elements
+	record(inputs, program.serial);
+	for (auto& op : program.ops) {
+		switch (op.code) {
+		case OpCode::Var:
+			// vars not set within the block are inherited from outside it
+			record(inputs, scope.get(static_cast<Variable*>(op.element)->symbol()));
+			break;
+		case OpCode::If:
+			record(inputs, scope.get(op.symbol));
+			break;
+		case OpCode::Seg: {
+			auto enabled = overlay ? overlay->find_segment(*op.node, op.symbol) : std::nullopt;
+			record(inputs, enabled ? *enabled : op.size != 0);
+			break;
+		}
+		case OpCode::Enter: {
+			auto node = op.node;
+			record(inputs, node->m_enabled);
+			auto own = overlay ? overlay->find_vars(*node) : nullptr;
+			record(inputs, own ? own->size() : 0);
+			if (own) {
+				for (auto& pr : *own) {
+					record(inputs, pr.first);
+					record(inputs, &pr.second.second);
+				}
+			}
+			for (auto& pr : node->m_vars) {
+				auto var = static_cast<Variable*>(node->m_elements[pr.second].get());
+				record(inputs, var->has_value() ? &var->value() : nullptr);
+				record(inputs, scope.get(var->symbol()));
+			}
+			break;
+		}
+		case OpCode::Loop: {
+			auto block = static_cast<Block*>(op.element);
+			auto held = overlay ? overlay->find_array(*block) : nullptr;
+			auto& arr = held ? *held : block->get_array();
+			record(inputs, arr.size());
+			for (auto& entry : arr) {
+				record(inputs, entry.size());
+				for (auto& pr : entry) {
+					record(inputs, &pr.first);
+					record(inputs, &pr.second);
+				}
+			}
+			break;
+		}
+		case OpCode::Block: {
+			auto block = static_cast<Block*>(op.element);
+			// a cached block's sub-blocks don't fire render events, so it's rendered in full if anything listens to them
+			if (block->OnRenderBlock.num_handlers() || (root && root != block && root->OnRenderBlock.num_handlers()))
+				return false;
+			auto enabled = overlay ? overlay->find_enabled(*block) : std::nullopt;
+			auto shown_enabled = enabled ? *enabled : block->enabled();
+			record(inputs, shown_enabled);
+			if (!shown_enabled) break;
+			auto shown = overlay ? overlay->find_block(*block) : nullptr;
+			if (!fingerprint(*(shown ? shown->program() : block->program()), inputs, scope, overlay, root))
+				return false;
+			break;
+		}
+		default:
+			break;
 		}
 	}
+	return true;
 }
 auto Node::enable_segment(const string& name)->void {
 	auto pr = m_segments.equal_range(name);
 	for (auto it = pr.first; it != pr.second; ++it) {
 		m_index[it->second].first = true;
 	}
+	if (pr.first != pr.second) invalidate();
 }
 auto Node::disable_segment(const string& name)->void {
 	auto pr = m_segments.equal_range(name);
 	for (auto it = pr.first; it != pr.second; ++it) {
 		m_index[it->second].first = false;
 	}
+	if (pr.first != pr.second) invalidate();
 }
 auto Node::block(const string& name)->shared_ptr<Block> {
 	auto it = m_blocks.find(name);
@@ -292,6 +632,7 @@ auto Node::add_block(const string& v)->shared_ptr<Block> {
 	m_blocks.emplace(v, idx);
 	m_order.emplace_back(m_index.size());
 	m_index.emplace_back(true, idx);
+	invalidate();
 	return std::static_pointer_cast<Block>(m_elements.back());
 }
 auto Node::insert_block(const string& v)->shared_ptr<Block> {
@@ -300,6 +641,7 @@ auto Node::insert_block(const string& v)->shared_ptr<Block> {
 	m_blocks.emplace(v, idx);
 	m_order.insert(m_order.begin(), m_index.size());
 	m_index.emplace_back(true, idx);
+	invalidate();
 	return std::static_pointer_cast<Block>(m_elements.back());
 }
 auto Node::add_block_at(const string& name, const string& after)->shared_ptr<Block> {
@@ -385,12 +727,13 @@ auto Node::has_var(const string& name) const->bool {
 auto Node::has_block(const string& name) const->bool {
 	return m_blocks.find(name) != m_blocks.end();
 }
-auto Node::add_segment(const string& v, const string& name)->void {
-	if (!v.empty()) {
-		m_elements.push_back(std::move(std::make_shared<Segment>(v)));
+auto Node::add_segment(Text text, const string& name)->void {
+	if (!text.content.empty()) {
+		m_elements.push_back(std::move(std::make_shared<Segment>(std::move(text))));
 		if (!name.empty()) m_segments.emplace(name, m_index.size());
 		m_order.emplace_back(m_index.size());
 		m_index.emplace_back(true, m_elements.size() - 1);
+		invalidate();
 	}
 }
 auto Node::add_variable(const string& v, const string& segment)->void {
@@ -406,12 +749,14 @@ auto Node::add_variable(const string& v, const string& segment)->void {
 	if (!segment.empty()) m_segments.emplace(segment, m_index.size());
 	m_order.emplace_back(m_index.size());
 	m_index.emplace_back(true, idx);
+	invalidate();
 }
 auto Node::add_conditional(const string& v)->std::shared_ptr<Conditional> {
 	auto idx = m_elements.size();
 	m_elements.push_back(std::move(std::make_shared<Conditional>(v)));
 	m_order.emplace_back(m_index.size());
 	m_index.emplace_back(true, idx);
+	invalidate();
 	return std::static_pointer_cast<Conditional>(m_elements.back());
 }
 void Node::load_block(Block& block) {
@@ -432,6 +777,7 @@ auto Node::insert_element_order(size_t i, size_t n, bool before)->void {
 		}
 	}
 	m_index.emplace_back(true, n);
+	invalidate();
 }
 auto Node::get_block_index(const string& name) const->Node::BlockIndexResult {
 	auto it = m_blocks.find(name);
@@ -456,6 +802,33 @@ void Node::new_child(Node& node) {
 	}
 	if (m_parent) m_parent->new_child(node);
 }
+auto Node::apply(const Overlay& overlay, const Node& original)->void {
+	if (auto vars = overlay.find_vars(original)) {
+		for (auto& pr : *vars)
+			set_var(pr.second.first, pr.second.second);
+	}
+	for (auto& pr : m_segments) {
+		if (auto enabled = overlay.find_segment(original, intern(pr.first)))
+			m_index[pr.second].first = *enabled;
+	}
+	invalidate();
+	// copies have the same elements in the same order
+	for (std::size_t i = 0; i < m_elements.size() && i < original.m_elements.size(); ++i) {
+		auto& from = *original.m_elements[i];
+		if (from.type() == ElementType::Block) {
+			auto& block = static_cast<Block&>(*m_elements[i]);
+			auto& source = static_cast<const Block&>(from);
+			auto substitute = overlay.find_block(source);
+			if (substitute) block = *substitute;
+			if (auto enabled = overlay.find_enabled(source)) block.enable(*enabled);
+			auto& shown = substitute ? *substitute : source;
+			if (auto arr = overlay.find_array(shown)) block.set_array(*arr);
+			block.apply(overlay, shown);
+		}
+		else if (from.type() == ElementType::Conditional)
+			static_cast<Conditional&>(*m_elements[i]).apply(overlay, static_cast<const Conditional&>(from));
+	}
+}
 
 Block::Block(const Block& v) : Node(v), Element(ElementType::Block), m_array(v.m_array) {
 	if (m_name.empty() && !v.m_name.empty())
@@ -472,36 +845,62 @@ auto Block::operator=(const Block& v)->Block& {
 	return *this;
 }
 auto Block::render(Render out)->void {
+	Scope local;
+	run(out.os, out.scope ? *out.scope : local, out.overlay ? out.overlay : Overlay::current(), top(this));
+}
+auto Block::notify_render(Node* root, const Overlay* overlay)->bool {
 	// we'll send 2 event notifications per block rendered, one for the block and one for the topmost node
-	auto top_parent = parent();
-	if (top_parent) {
-		while (top_parent->parent())
-			top_parent = top_parent->parent();
-	}
-	if (top_parent) top_parent->OnRenderBlock(*this);
+	if (root && root != this) root->OnRenderBlock(*this);
 
 	OnRenderBlock(*this);
-
-	if (enabled()) {
-		// add vars in this block to the scope if none already exist with a value
-		auto vec = vars();
-		for (auto& var : vec) {
-			if (var->has_value())
-				out.vars[var->name()] = var->value();
-		}
-		// render node
-		if (m_array.empty())
-			Node::render(std::move(out));
-		else {
-			// in the event of an array, render the node over and over with each set of values
-			for (auto& map : m_array) {
-				for (auto& pr : map) {
-					set_var(pr.first, pr.second);
-				}
-				Node::render(out);
-			}
-		}
+	if (overlay) {
+		if (auto enabled = overlay->find_enabled(*this))
+			return *enabled;
 	}
+	return enabled();
+}
+auto Block::run(std::ostream& os, Scope& scope, const Overlay* overlay, Node* root)->void {
+	// render events may restructure the block, so its program is taken afterwards
+	if (!notify_render(root, overlay)) return;
+	auto shown = overlay ? overlay->find_block(*this) : nullptr;
+	auto compiled = shown ? shown->program() : program();
+	if (!compiled->cached) {
+		execute(*compiled, os, scope, overlay, root);
+		return;
+	}
+	// recorded into the thread's scratch buffer, which only gives up its memory when the inputs are stored, sub-blocks find it empty meanwhile
+	static thread_local string scratch;
+	Recording inputs;
+	inputs.bytes.swap(scratch);
+	if (!fingerprint(*compiled, inputs, scope, overlay, root)) {
+		inputs.bytes.swap(scratch);
+		execute(*compiled, os, scope, overlay, root);
+		return;
+	}
+	// rendered with the same inputs before, the output is written in one go
+	auto key = hash_of(inputs.view());
+	auto content = compiled->fragments.find(key, inputs.view());
+	if (content) inputs.bytes.swap(scratch);
+	else {
+		std::ostringstream buffer;
+		execute(*compiled, buffer, scope, overlay, root);
+		content = std::make_shared<const string>(buffer.str());
+		inputs.bytes.resize(inputs.size);
+		compiled->fragments.store(key, std::move(inputs.bytes), content);
+	}
+	os.write(content->data(), content->size());
+}
+auto Block::compile()->shared_ptr<const Program> {
+	// in the event of an array, the node's ops are run over and over with each set of values
+	auto compiled = std::make_shared<Program>();
+	compiled->ops.push_back({OpCode::Loop});
+	compiled->ops.back().element = this;
+	auto body = compiled->ops.size();
+	emit(*compiled);
+	compiled->ops.push_back({OpCode::Next, 0, static_cast<uint32_t>(body)});
+	compiled->ops.back().element = this;
+	compiled->cached = options().count("cache") != 0;
+	return compiled;
 }
 auto Block::load_block(Block& block)->void {
 	block.m_path = m_path + "/" + block.m_path;
@@ -518,15 +917,201 @@ auto Block::prototype(JS::Context& js)->void {
 	js.get_property<void>(-1, JSName);
 	js.remove(-2);
 }
-Conditional::Conditional(const Conditional& v) : Node(v), Element(ElementType::Conditional), m_expr(v.m_expr)
+Conditional::Conditional(const Conditional& v) : Node(v), Element(ElementType::Conditional), m_expr(v.m_expr), m_symbol(v.m_symbol)
 { }
 auto Conditional::operator=(const Conditional& v)->Conditional& {
 	static_cast<Node&>(*this) = static_cast<const Node&>(v);
 	m_expr = v.m_expr;
+	m_symbol = v.m_symbol;
 	return *this;
 }
 auto Conditional::render(Render render)->void {
-	auto it = render.vars.find(m_expr);
-	if (it != render.vars.end() && !it->second.empty())
-		Node::render(std::move(render));
+	auto value = render.scope ? render.scope->get(m_symbol) : nullptr;
+	if (value && !value->empty())
+		Node::render(render);
+}
+
+Program::Program() {
+	static std::atomic<uint64_t> serials{0};
+	serial = ++serials;
+}
+
+auto FragmentCache::find(uint64_t key, string_view inputs) const->shared_ptr<const string> {
+	if (auto entries = std::atomic_load(&m_entries)) {
+		for (auto& fragment : *entries) {
+			// the hash only picks the candidate, the inputs have to match as well
+			if (fragment->key == key && fragment->inputs == inputs) return fragment->content;
+		}
+	}
+	return nullptr;
+}
+auto FragmentCache::store(uint64_t key, string inputs, shared_ptr<const string> content)->void {
+	// the newest first, dropping the oldest once full
+	auto entries = std::make_shared<Entries>();
+	entries->push_back(std::make_shared<const Fragment>(Fragment{key, std::move(inputs), std::move(content)}));
+	auto& stored = *entries->front();
+	if (auto previous = std::atomic_load(&m_entries)) {
+		for (auto& fragment : *previous) {
+			if (entries->size() == FragmentSlots) break;
+			if (fragment->key != stored.key || fragment->inputs != stored.inputs) entries->push_back(fragment);
+		}
+	}
+	std::atomic_store(&m_entries, shared_ptr<const Entries>(std::move(entries)));
+}
+
+static thread_local Overlay* currentOverlay = nullptr;
+
+Overlay::Activation::Activation(Overlay* overlay) : m_previous(currentOverlay) {
+	currentOverlay = overlay;
+}
+Overlay::Activation::~Activation() {
+	currentOverlay = m_previous;
+}
+auto Overlay::current()->Overlay* {
+	return currentOverlay;
+}
+auto Overlay::mutate()->State& {
+	if (!m_state) m_state = std::make_shared<State>();
+	else if (m_state.use_count() > 1) m_state = std::make_shared<State>(*m_state);
+	return *m_state;
+}
+auto Overlay::find_vars(const Node& node) const->const Vars* {
+	if (!m_state) return nullptr;
+	auto it = m_state->vars.find(&node);
+	return it != m_state->vars.end() ? &it->second : nullptr;
+}
+auto Overlay::find_var(const Node& node, Symbol symbol) const->const string* {
+	auto vars = find_vars(node);
+	if (!vars) return nullptr;
+	auto it = vars->find(symbol);
+	return it != vars->end() ? &it->second.second : nullptr;
+}
+auto Overlay::set_var(const Node& node, const string& name, string value)->void {
+	auto& var = mutate().vars[&node][intern(name)];
+	var.first = name;
+	var.second = std::move(value);
+}
+auto Overlay::find_segment(const Node& node, Symbol symbol) const->optional<bool> {
+	if (!m_state) return {};
+	auto it = m_state->segments.find(&node);
+	if (it == m_state->segments.end()) return {};
+	auto it2 = it->second.find(symbol);
+	if (it2 != it->second.end()) return it2->second;
+	return {};
+}
+auto Overlay::set_segment(const Node& node, const string& name, bool enabled)->void {
+	mutate().segments[&node][intern(name)] = enabled;
+}
+auto Overlay::find_enabled(const Block& block) const->optional<bool> {
+	if (!m_state) return {};
+	auto it = m_state->enabled.find(&block);
+	if (it != m_state->enabled.end()) return it->second;
+	return {};
+}
+auto Overlay::set_enabled(const Block& block, bool enabled)->void {
+	mutate().enabled[&block] = enabled;
+}
+auto Overlay::find_array(const Block& block) const->shared_ptr<const BlockArray> {
+	if (!m_state) return nullptr;
+	auto it = m_state->arrays.find(&block);
+	return it != m_state->arrays.end() ? it->second : nullptr;
+}
+auto Overlay::set_array(const Block& block, BlockArray arr)->void {
+	mutate().arrays[&block] = std::make_shared<const BlockArray>(std::move(arr));
+}
+auto Overlay::find_block(const Block& block) const->shared_ptr<Block> {
+	if (!m_state) return nullptr;
+	auto it = m_state->blocks.find(&block);
+	return it != m_state->blocks.end() ? it->second : nullptr;
+}
+auto Overlay::set_block(const Block& block, shared_ptr<Block> substitute)->void {
+	mutate().blocks[&block] = std::move(substitute);
+}
+auto Overlay::var_value(const Node& node, const string& name)->string {
+	if (auto overlay = current()) {
+		if (auto value = overlay->find_var(node, intern(name)))
+			return *value;
+	}
+	return node.get_var(name);
+}
+auto Overlay::assign_var(Node& node, const string& name, const string& value)->void {
+	if (auto overlay = current())
+		overlay->set_var(node, name, value);
+	else
+		node.set_var(name, value);
+}
+auto Overlay::assign_segment(Node& node, const string& name, bool enabled)->void {
+	if (auto overlay = current())
+		overlay->set_segment(node, name, enabled);
+	else if (enabled)
+		node.enable_segment(name);
+	else
+		node.disable_segment(name);
+}
+auto Overlay::is_enabled(const Block& block)->bool {
+	if (auto overlay = current()) {
+		if (auto enabled = overlay->find_enabled(block))
+			return *enabled;
+	}
+	return block.enabled();
+}
+auto Overlay::assign_enabled(Block& block, bool enabled)->void {
+	if (auto overlay = current())
+		overlay->set_enabled(block, enabled);
+	else
+		block.enable(enabled);
+}
+auto Overlay::array_of(const Block& block)->const BlockArray& {
+	if (auto overlay = current()) {
+		if (auto arr = overlay->find_array(block))
+			return *arr;
+	}
+	return block.get_array();
+}
+auto Overlay::assign_array(Block& block, BlockArray arr)->void {
+	if (auto overlay = current())
+		overlay->set_array(block, std::move(arr));
+	else
+		block.set_array(arr);
+}
+auto Overlay::add_to_array(Block& block, const map<string, string>& value)->void {
+	auto overlay = current();
+	if (!overlay) return block.add_to_array(value);
+	auto arr = array_of(block);
+	if (arr.empty()) {
+		for (auto& pr : value)
+			overlay->set_var(block, pr.first, pr.second);
+	}
+	arr.emplace_back(value);
+	overlay->set_array(block, std::move(arr));
+}
+auto Overlay::resolve(const shared_ptr<Block>& block)->shared_ptr<Block> {
+	if (auto overlay = current()) {
+		if (auto substitute = overlay->find_block(*block))
+			return substitute;
+	}
+	return block;
+}
+auto Overlay::resolve(Block& block)->Block& {
+	if (auto overlay = current()) {
+		if (auto substitute = overlay->find_block(block))
+			return *substitute;
+	}
+	return block;
+}
+auto Overlay::assign_block(Block& block, shared_ptr<Block> substitute)->bool {
+	auto overlay = current();
+	if (!overlay) return false;
+	overlay->set_block(block, std::move(substitute));
+	return true;
+}
+auto Overlay::detach(Block& block)->shared_ptr<Block> {
+	auto overlay = current();
+	if (!overlay) return nullptr;
+	auto& shown = resolve(block);
+	auto copy = std::make_shared<Block>(shown);
+	copy->set_parent(block.parent());
+	if (auto arr = overlay->find_array(shown)) copy->set_array(*arr);
+	copy->apply(*overlay, shown);
+	return copy;
 }
\ No newline at end of file
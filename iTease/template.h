@@ -6,11 +6,137 @@
 
 namespace iTease {
 	namespace Templating {
+		// var names are interned on load, so rendering looks them up by index
+		using Symbol = uint32_t;
+
+		// returns the symbol of a var name, the same name always maps to the same symbol
+		extern auto intern(string_view name)->Symbol;
+
+		/**
+		 * Scope - values of the vars visible to the node being rendered, indexed by symbol
+		 * Entering a node pushes a frame, leaving it restores every slot set since
+		**/
+		class Scope {
+		public:
+			auto get(Symbol symbol) const->const string* {
+				return symbol < m_slots.size() ? m_slots[symbol] : nullptr;
+			}
+			// the value is referenced, not copied, and must outlive the frame
+			auto set(Symbol symbol, const string& value)->void {
+				if (symbol >= m_slots.size()) m_slots.resize(symbol + 1);
+				m_trail.emplace_back(symbol, m_slots[symbol]);
+				m_slots[symbol] = &value;
+			}
+			auto enter()->void {
+				m_frames.push_back(m_trail.size());
+			}
+			auto exit()->void {
+				auto mark = m_frames.back();
+				m_frames.pop_back();
+				while (m_trail.size() > mark) {
+					auto& pr = m_trail.back();
+					m_slots[pr.first] = pr.second;
+					m_trail.pop_back();
+				}
+			}
+
+		private:
+			vector<const string*> m_slots;
+			// previous values of the slots set, undone back to the frame mark on exit
+			vector<pair<Symbol, const string*>> m_trail;
+			vector<std::size_t> m_frames;
+		};
+
+		class Element;
+		class Variable;
+		class Block;
+		class Node;
+		class Conditional;
+
+		using BlockArray = vector<map<string, string>>;
+
+		/**
+		 * Overlay - var values, enabled flags, arrays and block substitutions layered over a template without changing it
+		 * Copies share their state until one of them is written to, so forking one per request costs a pointer copy
+		 * Entries are keyed by element address, an overlay must not outlive the templates it was written for
+		**/
+		class Overlay {
+		public:
+			/**
+			 * Activation - makes an overlay the current one of the thread for its lifetime
+			**/
+			class Activation {
+			public:
+				Activation(Overlay*);
+				~Activation();
+				Activation(const Activation&) = delete;
+				Activation& operator=(const Activation&) = delete;
+
+			private:
+				Overlay* m_previous;
+			};
+
+		public:
+			// returns the overlay active on the calling thread, or nullptr if templates are used directly
+			static auto current()->Overlay*;
+
+			// names and values of the vars set on a node, by symbol
+			using Vars = map<Symbol, pair<string, string>>;
+
+			auto find_vars(const Node&) const->const Vars*;
+			auto find_var(const Node&, Symbol) const->const string*;
+			auto set_var(const Node&, const string& name, string value)->void;
+			auto find_segment(const Node&, Symbol) const->optional<bool>;
+			auto set_segment(const Node&, const string& name, bool)->void;
+			auto find_enabled(const Block&) const->optional<bool>;
+			auto set_enabled(const Block&, bool)->void;
+			auto find_array(const Block&) const->shared_ptr<const BlockArray>;
+			auto set_array(const Block&, BlockArray)->void;
+			// returns the block rendered in place of a block, if any
+			auto find_block(const Block&) const->shared_ptr<Block>;
+			auto set_block(const Block&, shared_ptr<Block>)->void;
+
+			// template accessors for bindings, going through the current overlay if there is one
+			static auto var_value(const Node&, const string& name)->string;
+			static auto assign_var(Node&, const string& name, const string& value)->void;
+			static auto assign_segment(Node&, const string& name, bool enabled)->void;
+			static auto is_enabled(const Block&)->bool;
+			static auto assign_enabled(Block&, bool)->void;
+			static auto array_of(const Block&)->const BlockArray&;
+			static auto assign_array(Block&, BlockArray)->void;
+			static auto add_to_array(Block&, const map<string, string>&)->void;
+			static auto resolve(const shared_ptr<Block>&)->shared_ptr<Block>;
+			static auto resolve(Block&)->Block&;
+			// substitutes a block in the current overlay, returns false if there is none
+			static auto assign_block(Block&, shared_ptr<Block>)->bool;
+			// returns a copy of the block as shown in the current overlay, which may be restructured and substituted for it, or nullptr if there is none
+			static auto detach(Block&)->shared_ptr<Block>;
+
+		private:
+			struct State {
+				// by node rather than by Variable, so vars a template doesn't declare are added here and not to it
+				unordered_map<const Node*, Vars> vars;
+				unordered_map<const Node*, map<Symbol, bool>> segments;
+				unordered_map<const Block*, bool> enabled;
+				unordered_map<const Block*, shared_ptr<const BlockArray>> arrays;
+				unordered_map<const Block*, shared_ptr<Block>> blocks;
+			};
+
+			// returns the state for writing, copying it first if it's shared with another overlay
+			auto mutate()->State&;
+
+		private:
+			shared_ptr<State> m_state;
+		};
+
 		struct Render {
 			std::ostream& os;
-			std::map<string, string> vars;
+			// vars set by the enclosing nodes, the rendered node starts an empty scope if there is none
+			Scope* scope = nullptr;
+			// values layered over the template, the current overlay if not set
+			const Overlay* overlay = nullptr;
 
-			Render(std::ostream& os) : os(os)
+			Render(std::ostream& os, Scope* scope = nullptr) : os(os), scope(scope)
 			{ }
 		};
 
@@ -24,10 +150,6 @@ namespace iTease {
 			long m_line;
 		};
 
-		class Block;
-		class Node;
-		class Conditional;
-
 		using OnTemplateRender = const Event<Node&>;
 		using OnBlockRender = const Event<Block&>;
 		using OnBlockLoad = const Event<Block&>;
@@ -36,6 +158,90 @@ namespace iTease {
 			Segment, Block, Variable, Conditional
 		};
 
+		enum class OpCode : uint8_t {
+			// write a span of the literal buffer
+			Text,
+			// write the value of a variable
+			Var,
+			// push a var scope for a node, jumps past its Exit if the node has unset vars
+			Enter,
+			// pop the var scope of a node
+			Exit,
+			// jumps past a conditional node if its var is empty
+			If,
+			// jumps past an element of a named segment if the segment is disabled
+			Seg,
+			// render a sub-block through its own program
+			Block,
+			// set the vars of the first array entry of a block
+			Loop,
+			// set the vars of the next array entry of a block and jump back, if there is one
+			Next
+		};
+
+		struct Op {
+			OpCode code;
+			// Text: length of the span, Seg: whether the segment is enabled in the template
+			uint32_t size = 0;
+			// Text: offset of the span, Enter/If/Seg/Next: index of the op to jump to
+			uint32_t arg = 0;
+			// If: the var tested, Seg: the segment's name
+			Symbol symbol = 0;
+			// Var/Block/Loop/Next: the element operated on
+			Element* element = nullptr;
+			// Enter: the node whose scope is entered, Seg: the node of the segment
+			Node* node = nullptr;
+		};
+
+		// the bytes fingerprint() records, the buffer grows in steps rather than with each value
+		struct Recording {
+			string bytes;
+			std::size_t size = 0;
+
+			auto view() const { return string_view(bytes.data(), size); }
+		};
+
+		/**
+		 * FragmentCache - output of a block rendered before, found by a hash of everything the rendering read and matched on all of it
+		 * Holds the few most recent fragments, several threads may look up and store at once
+		**/
+		class FragmentCache {
+		public:
+			// returns the output rendered from the same inputs, if it's still held
+			auto find(uint64_t key, string_view inputs) const->shared_ptr<const string>;
+			auto store(uint64_t key, string inputs, shared_ptr<const string> content)->void;
+
+		private:
+			struct Fragment {
+				uint64_t key;
+				// the inputs hashed into the key, compared on lookup so a collision can't show another page's output
+				string inputs;
+				shared_ptr<const string> content;
+			};
+			using Entries = vector<shared_ptr<const Fragment>>;
+
+			// replaced as a whole on store, readers keep the entries they loaded
+			shared_ptr<const Entries> m_entries;
+		};
+
+		/**
+		 * Program - a node tree lowered into a flat instruction array
+		**/
+		struct Program {
+			Program();
+
+			// unique to each compiled program, unlike its address which may be reused
+			uint64_t serial;
+			// set for blocks with the cache option, their output is kept in fragments
+			bool cached = false;
+			mutable FragmentCache fragments;
+			vector<Op> ops;
+			// all segment content, referenced by Text ops
+			string literals;
+			// keeps referenced elements alive while the program runs, even if the node is reassigned meanwhile
+			vector<std::shared_ptr<Element>> elements;
+		};
+
 		class Element {
 		public:
 			Element(ElementType type) : m_type(type)
@@ -56,9 +262,9 @@ namespace iTease {
 
 		class Variable : public Element {
 		public:
-			Variable(string name) : Element(ElementType::Variable), m_name(name)
+			Variable(string name) : Element(ElementType::Variable), m_name(name), m_symbol(intern(m_name))
 			{ }
-			Variable(string name, string value) : Element(ElementType::Variable), m_name(name), m_value(value)
+			Variable(string name, string value) : Element(ElementType::Variable), m_name(name), m_symbol(intern(m_name)), m_value(value)
 			{ }
 			
 			auto set(const string& value) {
@@ -67,6 +273,9 @@ namespace iTease {
 			auto name() const->const string& {
 				return m_name;
 			}
+			auto symbol() const {
+				return m_symbol;
+			}
 			auto value() const->const string& {
 				static string empty_string;
 				return m_value ? *m_value : empty_string;
@@ -86,16 +295,27 @@ namespace iTease {
 
 		private:
 			string m_name;
+			Symbol m_symbol;
 			optional<string> m_value;
 		};
 
+		// text of a template, a view of the buffer it was loaded from which it keeps alive
+		struct Text {
+			shared_ptr<const string> buffer;
+			string_view content;
+		};
+
 		class Segment : public Element {
 		public:
-			Segment(string content) : Element(ElementType::Segment), m_content(content)
+			Segment(Text text) : Element(ElementType::Segment), m_text(std::move(text))
 			{ }
 
+			auto content() const->string_view {
+				return m_text.content;
+			}
+
 			virtual auto render(Render out)->void override {
-				out.os << m_content;
+				out.os << m_text.content;
 			}
 
 		protected:
@@ -104,7 +324,7 @@ namespace iTease {
 			}
 
 		private:
-			string m_content;
+			Text m_text;
 		};
 
 		class Node : public std::enable_shared_from_this<Node> {
@@ -121,6 +341,10 @@ namespace iTease {
 			auto clear()->void;
 			// parse template from an input stream
 			auto load(std::istream&)->bool;
+			// parse template from a buffer
+			auto load(string_view)->bool;
+			// parse template from a buffer, which segments keep views of rather than copying their text
+			auto load(shared_ptr<const string>)->bool;
 			// enable segments matching name
 			auto enable_segment(const string&)->void;
 			// disable segments matching name
@@ -161,6 +385,10 @@ namespace iTease {
 			//auto error() const->const string&;
 			// renders the template to an output stream
 			virtual void render(Render);
+			// returns the compiled program of this node, compiling it if the structure changed since
+			auto program()->shared_ptr<const Program>;
+			// applies the values an overlay layers over a node and its sub-nodes to this copy of it
+			auto apply(const Overlay&, const Node& original)->void;
 
 			// callback called when a block is about to be rendered
 			OnBlockRender OnRenderBlock;
@@ -171,9 +399,23 @@ namespace iTease {
 
 		protected:
 			virtual void load_block(Block&);
+			// lowers this node into a new program
+			virtual auto compile()->shared_ptr<const Program>;
+			// appends the ops rendering this node, from Enter to Exit
+			auto emit(Program&)->void;
+			// drops the compiled program, called whenever elements or their order change
+			auto invalidate()->void { std::atomic_store(&m_program, shared_ptr<const Program>()); }
+			// resolves the vars of this node into a scope, array entry values first, returns false if the node should not render
+			auto enter_scope(Scope&, const Overlay*, const map<string, string>* entry)->bool;
+
+			// runs a program, firing block render events on root
+			static auto execute(const Program&, std::ostream&, Scope&, const Overlay*, Node* root)->void;
+			// records every input the output of a program depends on, returns false if its sub-block render events are observed
+			static auto fingerprint(const Program&, Recording& inputs, const Scope&, const Overlay*, Node* root)->bool;
+			static auto top(Node*)->Node*;
 
 		private:
-			auto add_segment(const string& value, const string& segment_id = "")->void;
+			auto add_segment(Text, const string& segment_id = "")->void;
 			auto add_variable(const string&, const string& segment_id = "")->void;
 			auto add_conditional(const string& expr)->std::shared_ptr<Conditional>;
 
@@ -199,6 +441,8 @@ namespace iTease {
 			std::unordered_map<string, std::size_t> m_blocks;
 			// map of options declared within the node
 			std::unordered_map<string, string> m_options;
+			// compiled form of the elements, rendered instead of walking them
+			shared_ptr<const Program> m_program;
 		};
 
 		class Block : public Node, public Element {
@@ -241,6 +485,10 @@ namespace iTease {
 			}
 			virtual void render(Render) override;
 			virtual void load_block(Block&) override;
+			// fires the render events of the block on itself and root, returns true if it is enabled
+			auto notify_render(Node* root, const Overlay*)->bool;
+			// renders the block, or the block substituted for it in the overlay
+			auto run(std::ostream&, Scope&, const Overlay*, Node* root)->void;
 
 			// JS
 			static constexpr const char* JSName = "\xff""\xff""WebTemplateBlock";
@@ -252,6 +500,7 @@ namespace iTease {
 			virtual auto copy() const->std::shared_ptr<Element> override {
 				return std::make_shared<Block>(*this);
 			}
+			virtual auto compile()->shared_ptr<const Program> override;
 
 		private:
 			string m_name;
@@ -262,11 +511,14 @@ namespace iTease {
 
 		class Conditional : public Node, public Element {
 		public:
-			Conditional(string varname) : Element(ElementType::Conditional), m_expr(varname)
+			Conditional(string varname) : Element(ElementType::Conditional), m_expr(varname), m_symbol(intern(m_expr))
 			{ }
 			Conditional(const Conditional&);
 			Conditional& operator=(const Conditional&);
 
+			auto& expr() const { return m_expr; }
+			auto symbol() const { return m_symbol; }
+
 			virtual void render(Render) override;
 
 		protected:
@@ -276,6 +528,7 @@ namespace iTease {
 
 		private:
 			string m_expr;
+			Symbol m_symbol;
 		};
 	}
 }
\ No newline at end of file
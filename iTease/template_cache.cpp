@@ -0,0 +1,77 @@
+#include "stdinc.h"
+#include "template_cache.h"
+
+using namespace iTease;
+
+// how long a template is trusted before its file is stat'd again
+constexpr auto RevalidateInterval = std::chrono::seconds(1);
+
+auto TemplateCache::get(const fs::path& path)->shared_ptr<const Templating::Block> {
+	auto name = path.generic_string();
+	auto now = std::chrono::steady_clock::now();
+	string key;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto alias = m_keys.find(name);
+		if (alias != m_keys.end()) {
+			key = alias->second;
+			auto it = m_slots.find(key);
+			if (it != m_slots.end() && now - it->second.checked < RevalidateInterval)
+				return it->second.tmpl;
+		}
+	}
+
+	std::error_code ec;
+	if (key.empty()) {
+		// resolved once per spelling of a path, a file that doesn't exist yet is keyed as given until it does
+		auto canonical = fs::canonical(path, ec);
+		key = ec ? name : canonical.generic_string();
+		if (!ec) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_keys.emplace(name, key);
+		}
+		ec.clear();
+	}
+
+	// stat without holding the lock
+	auto size = fs::file_size(path, ec);
+	auto ftime = !ec ? fs::last_write_time(path, ec) : fs::file_time_type{};
+	if (ec) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_slots.erase(key);
+		throw std::runtime_error("failed to open template '" + path.string() + "'");
+	}
+	auto mtime = decltype(ftime)::clock::to_time_t(ftime);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_slots.find(key);
+		if (it != m_slots.end() && it->second.size == size && it->second.mtime == mtime) {
+			it->second.checked = now;
+			return it->second.tmpl;
+		}
+	}
+
+	std::ifstream file(path);
+	if (!file.is_open()) throw std::runtime_error("failed to open template '" + path.string() + "'");
+	auto tmpl = std::make_shared<Templating::Block>();
+	tmpl->load(file);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto& slot = m_slots[key];
+	slot.tmpl = tmpl;
+	slot.size = size;
+	slot.mtime = mtime;
+	slot.checked = now;
+	return tmpl;
+}
+auto TemplateCache::instance(const fs::path& path)->shared_ptr<Templating::Block> {
+	auto tmpl = std::make_shared<Templating::Block>(*get(path));
+	// copies don't keep parents, so link the sub-blocks to the new tree
+	tmpl->set_parent(nullptr);
+	return tmpl;
+}
+auto TemplateCache::clear()->void {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_slots.clear();
+	m_keys.clear();
+}
\ No newline at end of file
@@ -0,0 +1,34 @@
+#pragma once
+#include <chrono>
+#include <mutex>
+#include "common.h"
+#include "template.h"
+
+namespace iTease {
+	/**
+	 * TemplateCache - parsed templates keyed by canonical path, parsed again only when their file changes on disk
+	 * Cached templates are never rendered or modified, callers get instances copied from them
+	**/
+	class TemplateCache {
+	public:
+		// returns the parsed template of a file, (re)loading it if needed, throws if it can't be opened or parsed
+		auto get(const fs::path&)->shared_ptr<const Templating::Block>;
+		// returns a new template instance of a file, a copy of the cached one's vars and blocks which shares its segment text
+		auto instance(const fs::path&)->shared_ptr<Templating::Block>;
+		auto clear()->void;
+
+	private:
+		struct Slot {
+			shared_ptr<const Templating::Block> tmpl;
+			uint64_t size = 0;
+			std::time_t mtime = 0;
+			std::chrono::steady_clock::time_point checked;
+		};
+
+	private:
+		std::mutex m_mutex;
+		unordered_map<string, Slot> m_slots;
+		// paths as given to get() to the canonical ones slots are keyed by
+		unordered_map<string, string> m_keys;
+	};
+}
\ No newline at end of file
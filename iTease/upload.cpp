@@ -0,0 +1,132 @@
+#include "stdinc.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <zlib.h>
+#include "upload.h"
+#include "logging.h"
+
+using namespace iTease;
+
+UploadedFile::UploadedFile(string field, string filename, string contentType) :
+	m_field(std::move(field)), m_filename(std::move(filename)), m_contentType(std::move(contentType)), m_crc(crc32(0L, Z_NULL, 0))
+{ }
+UploadedFile::~UploadedFile() {
+	close_fd();
+	if (!m_path.empty()) {
+		std::error_code ec;
+		fs::remove(m_path, ec);
+	}
+}
+auto UploadedFile::open(const fs::path& dir)->bool {
+	std::error_code ec;
+	fs::create_directories(dir, ec);
+	// a clash with a leftover file just picks another name
+	for (int tries = 0; tries < 4 && m_fd < 0; ++tries) {
+		auto path = (dir / ("upload-" + rand_md5() + ".tmp")).string();
+		#ifdef _MSC_VER
+		m_fd = _open(path.c_str(), _O_RDWR | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+		#else
+		m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		#endif
+		if (m_fd >= 0) m_path = std::move(path);
+	}
+	if (m_fd < 0) ITEASE_LOGERROR("Failed to create upload file in " << dir.string());
+	return m_fd >= 0;
+}
+auto UploadedFile::write(const char* data, size_t size)->bool {
+	if (m_fd < 0) return false;
+	size_t done = 0;
+	while (done < size) {
+		#ifdef _MSC_VER
+		auto n = _write(m_fd, data + done, static_cast<unsigned int>(size - done));
+		#else
+		auto n = ::write(m_fd, data + done, size - done);
+		#endif
+		if (n <= 0) {
+			ITEASE_LOGERROR("Failed to write upload file " << m_path);
+			// the file is unusable with part of a chunk missing, later writes and reads fail
+			close_fd();
+			return false;
+		}
+		done += static_cast<size_t>(n);
+	}
+	// only once the chunk is on disk, so size and hash describe the file's content
+	m_crc = crc32(m_crc, reinterpret_cast<const Bytef*>(data), static_cast<uInt>(size));
+	m_size += size;
+	return true;
+}
+auto UploadedFile::finish()->void {
+	if (m_fd < 0) return;
+	#ifdef _MSC_VER
+	_lseeki64(m_fd, 0, SEEK_SET);
+	#else
+	lseek(m_fd, 0, SEEK_SET);
+	#endif
+}
+auto UploadedFile::read(uint64_t offset, size_t max) const->string {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	string data;
+	if (m_fd < 0 || offset >= m_size)
+		return data;
+	data.resize(static_cast<size_t>(std::min<uint64_t>(max, m_size - offset)));
+	#ifdef _MSC_VER
+	_lseeki64(m_fd, static_cast<__int64>(offset), SEEK_SET);
+	#else
+	lseek(m_fd, static_cast<off_t>(offset), SEEK_SET);
+	#endif
+	size_t done = 0;
+	while (done < data.size()) {
+		#ifdef _MSC_VER
+		auto n = _read(m_fd, &data[done], static_cast<unsigned int>(data.size() - done));
+		#else
+		auto n = ::read(m_fd, &data[done], data.size() - done);
+		#endif
+		if (n <= 0) break;
+		done += static_cast<size_t>(n);
+	}
+	data.resize(done);
+	return data;
+}
+auto UploadedFile::move_to(const fs::path& path)->bool {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_path.empty())
+		return false;
+	// Windows won't rename an open file
+	close_fd();
+	std::error_code ec;
+	fs::rename(m_path, path, ec);
+	if (ec) {
+		// the uploads directory may be on another volume
+		ec.clear();
+		fs::copy_file(m_path, path, fs::copy_options::overwrite_existing, ec);
+		if (!ec) fs::remove(m_path, ec);
+	}
+	if (ec) {
+		ITEASE_LOGERROR("Failed to move upload file " << m_path << " to " << path.string() << ": " << ec.message());
+		#ifdef _MSC_VER
+		m_fd = _open(m_path.c_str(), _O_RDONLY | _O_BINARY);
+		#else
+		m_fd = ::open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+		#endif
+		return false;
+	}
+	m_path.clear();
+	return true;
+}
+auto UploadedFile::close_fd()->void {
+	if (m_fd < 0) return;
+	#ifdef _MSC_VER
+	_close(m_fd);
+	#else
+	close(m_fd);
+	#endif
+	m_fd = -1;
+}
+auto UploadedFile::hash() const->string {
+	return fmt::format("{:08x}", m_crc);
+}
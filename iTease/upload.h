@@ -0,0 +1,49 @@
+#pragma once
+#include <mutex>
+#include "common.h"
+
+namespace iTease {
+	/**
+	 * UploadedFile - a file part of a multipart POST, streamed to a temporary file as it arrives
+	 * Size and checksum are computed while writing, the file is removed with the last reference
+	**/
+	class UploadedFile {
+	public:
+		UploadedFile(string field, string filename, string contentType);
+		~UploadedFile();
+		UploadedFile(const UploadedFile&) = delete;
+		auto operator=(const UploadedFile&)->UploadedFile& = delete;
+
+		// creates the temporary file in dir, returns false on failure
+		auto open(const fs::path& dir)->bool;
+		// appends a chunk, returns false on write failure, after which the file can no longer be written or read
+		auto write(const char* data, size_t size)->bool;
+		// rewinds the file so readers start at the beginning
+		auto finish()->void;
+		// reads up to max bytes from offset, empty past the end or once the file was moved
+		auto read(uint64_t offset, size_t max) const->string;
+		// moves the temporary file to path, after which it is no longer removed, returns false on failure
+		auto move_to(const fs::path& path)->bool;
+
+		auto field() const->const string& { return m_field; }
+		auto filename() const->const string& { return m_filename; }
+		auto content_type() const->const string& { return m_contentType; }
+		auto size() const { return m_size; }
+		// hex CRC-32 of the content
+		auto hash() const->string;
+
+	private:
+		auto close_fd()->void;
+
+	private:
+		// the descriptor's offset is shared by readers
+		mutable std::mutex m_mutex;
+		string m_field;
+		string m_filename;
+		string m_contentType;
+		string m_path;
+		int m_fd = -1;
+		uint64_t m_size = 0;
+		unsigned long m_crc = 0;
+	};
+}
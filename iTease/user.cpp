@@ -126,9 +126,14 @@ auto User::prototype(JS::Context& js)->void {
 	js.remove(-2);
 }
 
-Users::Users(Application& app) : Module("users"), m_app(app) {
+Users::Users(Application& app) : Module("users"), m_app(app),
+	m_queryTime(app.metrics.histogram("itease_db_query_duration_seconds", "Time spent in database queries.", "module=\"users\"")),
+	m_userCount(app.metrics.gauge("itease_users", "Registered users."))
+{
 	// add event to auto-save users, called every 20 seconds
 	m_onTickEventListener = m_app.add_interval_callback(20000, [this](long long& delay)->int { 
+		// sign in and session restores add users and use the same statements on server threads
+		auto lock = m_app.lock_internal();
 		try {
 			for (auto& pr : m_users) {
 				save_user(*pr.second);
@@ -141,6 +146,7 @@ Users::Users(Application& app) : Module("users"), m_app(app) {
 	});
 }
 auto Users::save_user(User& user)->void {
+	Metrics::Timer timer(m_queryTime);
 	m_updateUserQuery << user.data().dob	// set
 		<< user.data().level
 		<< user.data().xp
@@ -150,6 +156,7 @@ auto Users::save_user(User& user)->void {
 }
 auto Users::get_usernames()->vector<string> {
 	vector<string> names;
+	Metrics::Timer timer(m_queryTime);
 	m_findAllUserNamesQuery >> [&](string name) { names.emplace_back(name); };
 	return names;
 }
@@ -157,6 +164,7 @@ auto Users::get_user(int64_t userid)->shared_ptr<User> {
 	auto it = m_users.find(userid);
 	if (it != m_users.end()) return it->second;
 	optional<UserData::TupleNoRefs> ud;
+	Metrics::Timer timer(m_queryTime);
 	m_findUserRowidQuery << userid >> ud;
 	return ud ? create_user_from_db(std::make_from_tuple<UserData>(*ud)) : nullptr;
 }
@@ -165,11 +173,13 @@ auto Users::get_user(const string& username)->shared_ptr<User> {
 	if (it != m_userNames.end()) return it->second;
 
 	optional<UserData::TupleNoRefs> ud;
+	Metrics::Timer timer(m_queryTime);
 	m_findUserNameQuery << username >> ud;
 	return ud ? create_user_from_db(std::make_from_tuple<UserData>(*ud)) : nullptr;
 }
 auto Users::get_user_by_email(const string& email)->shared_ptr<User> {
 	optional<UserData::TupleNoRefs> ud;
+	Metrics::Timer timer(m_queryTime);
 	m_findUserEmailQuery << email >> ud;
 	return ud ? create_user_from_db(std::make_from_tuple<UserData>(*ud)) : nullptr;
 }
@@ -177,10 +187,13 @@ auto Users::create_user(const string& username, const string& email, const strin
 	auto pass_hash = Password::hash(password);
 	try {
 		UserData::TupleNoRefs ud;
-		m_insertUserQuery << username << email << pass_hash << dob;
-		m_insertUserQuery++;
-		++m_numUsers;
-		m_findUserRowidQuery << m_app.db->connection()->last_insert_rowid() >> ud;
+		{
+			Metrics::Timer timer(m_queryTime);
+			m_insertUserQuery << username << email << pass_hash << dob;
+			m_insertUserQuery++;
+			m_findUserRowidQuery << m_app.db->connection()->last_insert_rowid() >> ud;
+		}
+		m_userCount.set(++m_numUsers);
 		return create_user_from_db(std::make_from_tuple<UserData>(ud));
 	}
 	catch (const sqlite::sqlite_exception& ex) {
@@ -200,145 +213,148 @@ auto Users::create_user_from_db(const UserData& ud)->shared_ptr<User> {
 }
 void Users::init_module(Application& app) {
 	*m_app.db << "SELECT COUNT(*) FROM users" >> m_numUsers;
-	m_onRequestEventListener = app.OnServerRequestInternal.listen([this](const ServerRequest& request, ServerResponse& response) {
-		if (request.uri == "/signin") {
-			auto unit = request.post_data.find("username");
-			auto pwit = request.post_data.find("password");
-			auto end = request.post_data.end();
-			json jsobj;
-			bool success = false;
-			if (unit != end && pwit != end) {
-				auto user = User::validate_email(unit.value()) == User::EmailValidation::OK ? get_user_by_email(unit.value()) : get_user(unit.value());
-				if (user) {
-					if (user->check_password(pwit.value())) {
-						success = true;
-						request.session->data = user;
-					}
-					else jsobj["errors"]["password"] = "Incorrect password";
+	m_userCount.set(m_numUsers);
+	m_onSessionRestoreListener = app.OnSessionRestore.listen([this](uint64_t userId, shared_ptr<void>& data) {
+		auto user = get_user(static_cast<int64_t>(userId));
+		if (!user) return 0;
+		data = user;
+		return 1;
+	});
+	m_routes.push_back(app.internalRoutes.add("POST", "/signin", [this](const ServerRequest& request, ServerResponse& response, const RouteParams&) {
+		auto unit = request.post_data.find("username");
+		auto pwit = request.post_data.find("password");
+		auto end = request.post_data.end();
+		json jsobj;
+		bool success = false;
+		if (unit != end && pwit != end) {
+			auto user = User::validate_email(unit.value()) == User::EmailValidation::OK ? get_user_by_email(unit.value()) : get_user(unit.value());
+			if (user) {
+				if (user->check_password(pwit.value())) {
+					success = true;
+					request.session->bind(user->id(), user);
 				}
-				else jsobj["errors"]["username"] = "Username/email not found";
+				else jsobj["errors"]["password"] = "Incorrect password";
 			}
-			else jsobj["errors"] = "Missing required fields";
-			jsobj["success"] = success;
-			response.content = jsobj.dump();
-			response.content_type = get_content_type_by_extension("json");
-			response.status = 200;
-			return true;
+			else jsobj["errors"]["username"] = "Username/email not found";
 		}
-		else if (request.uri == "/signup") {
-			auto unit = request.post_data.find("username");
-			auto emit = request.post_data.find("email");
-			auto pwit = request.post_data.find("password");
-			auto pcit = request.post_data.find("confirm_password");
-			auto dobit = request.post_data.find("dob");
-			auto end = request.post_data.end();
-			json jsobj;
-			bool success = false;
-			if (unit != end && emit != end && pwit != end && pcit != end && dobit != end) {
-				auto name = unit.value();
-				auto email = emit.value();
-				auto password = pwit.value();
-				auto cpassword = pcit.value();
-				auto dobstr = dobit.value();
-				auto nameval = User::validate_name(name);
-				auto emlval = User::validate_email(email);
-				auto pwval = User::validate_password(password);
-				date::year_month_day dob;
-				if (nameval == User::NameValidation::TooShort)
-					jsobj["errors"]["username"] = "Username too short";
-				else if (nameval == User::NameValidation::TooLong)
-					jsobj["errors"]["username"] = "Username too long";
-				else if (nameval == User::NameValidation::InvalidCharacters)
-					jsobj["errors"]["username"] = "Username contains invalid characters";
-				if (emlval == User::EmailValidation::Empty)
-					jsobj["errors"]["email"] = "Email required";
-				else if (emlval == User::EmailValidation::TooLong)
-					jsobj["errors"]["email"] = "Email too long";
-				else if (emlval == User::EmailValidation::Invalid)
-					jsobj["errors"]["email"] = "Invalid email";
-				if (pwval == User::PasswordValidation::TooShort)
-					jsobj["errors"]["password"] = password.empty() ? "Password required" : "Password too short";
-				else if (pwval == User::PasswordValidation::TooLong)
-					jsobj["errors"]["password"] = "Password too long";
-				if (password != cpassword)
-					jsobj["errors"]["confirm_password"] = "Passwords do not match";
-				auto dobss = std::istringstream(dobstr);
-				dobss >> date::parse("%F", dob);
-				if (!dobss) jsobj["errors"]["dob"] = "Invalid date";
-				else {
-					auto today = date::year_month_day{floor<date::days>(std::chrono::system_clock::now())};
-					auto age = today.year() - dob.year();
-					if (today.month() < dob.month() || (today.month() == dob.month() && today.day() < today.day())) --age;
-					// gotta have some fun
-					if (age.count() < 0) jsobj["errors"]["dob"] = "Sorry, this software does not yet support scenarios involving time travel";
-					else if (age.count() < 18) jsobj["errors"]["dob"] = "Sorry, but you should be 18 or older to use this software";
-					else if (age.count() > 120) jsobj["errors"]["dob"] = "Really? You don't look a day over 100!";
-				}
-				if (jsobj["errors"].find("username") == jsobj["errors"].end()) {
-					if (get_user(name))
-						jsobj["errors"]["username"] = "Username already registered";
-				}
-				if (jsobj["errors"].find("email") == jsobj["errors"].end()) {
-					if (get_user_by_email(name))
-						jsobj["errors"]["email"] = "Email already registered";
-				}
-				if (!jsobj["errors"].size()) {
-					if (auto user = create_user(name, email, password, dob)) {
-						request.session->data = user;
-						success = true;
-					}
-					else jsobj["errors"] = "Failed to create user";
+		else jsobj["errors"] = "Missing required fields";
+		jsobj["success"] = success;
+		response.content = jsobj.dump();
+		response.content_type = get_content_type_by_extension("json");
+		response.status = 200;
+		return true;
+	}));
+	m_routes.push_back(app.internalRoutes.add("POST", "/signup", [this](const ServerRequest& request, ServerResponse& response, const RouteParams&) {
+		auto unit = request.post_data.find("username");
+		auto emit = request.post_data.find("email");
+		auto pwit = request.post_data.find("password");
+		auto pcit = request.post_data.find("confirm_password");
+		auto dobit = request.post_data.find("dob");
+		auto end = request.post_data.end();
+		json jsobj;
+		bool success = false;
+		if (unit != end && emit != end && pwit != end && pcit != end && dobit != end) {
+			auto name = unit.value();
+			auto email = emit.value();
+			auto password = pwit.value();
+			auto cpassword = pcit.value();
+			auto dobstr = dobit.value();
+			auto nameval = User::validate_name(name);
+			auto emlval = User::validate_email(email);
+			auto pwval = User::validate_password(password);
+			date::year_month_day dob;
+			if (nameval == User::NameValidation::TooShort)
+				jsobj["errors"]["username"] = "Username too short";
+			else if (nameval == User::NameValidation::TooLong)
+				jsobj["errors"]["username"] = "Username too long";
+			else if (nameval == User::NameValidation::InvalidCharacters)
+				jsobj["errors"]["username"] = "Username contains invalid characters";
+			if (emlval == User::EmailValidation::Empty)
+				jsobj["errors"]["email"] = "Email required";
+			else if (emlval == User::EmailValidation::TooLong)
+				jsobj["errors"]["email"] = "Email too long";
+			else if (emlval == User::EmailValidation::Invalid)
+				jsobj["errors"]["email"] = "Invalid email";
+			if (pwval == User::PasswordValidation::TooShort)
+				jsobj["errors"]["password"] = password.empty() ? "Password required" : "Password too short";
+			else if (pwval == User::PasswordValidation::TooLong)
+				jsobj["errors"]["password"] = "Password too long";
+			if (password != cpassword)
+				jsobj["errors"]["confirm_password"] = "Passwords do not match";
+			auto dobss = std::istringstream(dobstr);
+			dobss >> date::parse("%F", dob);
+			if (!dobss) jsobj["errors"]["dob"] = "Invalid date";
+			else {
+				auto today = date::year_month_day{floor<date::days>(std::chrono::system_clock::now())};
+				auto age = today.year() - dob.year();
+				if (today.month() < dob.month() || (today.month() == dob.month() && today.day() < today.day())) --age;
+				// gotta have some fun
+				if (age.count() < 0) jsobj["errors"]["dob"] = "Sorry, this software does not yet support scenarios involving time travel";
+				else if (age.count() < 18) jsobj["errors"]["dob"] = "Sorry, but you should be 18 or older to use this software";
+				else if (age.count() > 120) jsobj["errors"]["dob"] = "Really? You don't look a day over 100!";
+			}
+			if (jsobj["errors"].find("username") == jsobj["errors"].end()) {
+				if (get_user(name))
+					jsobj["errors"]["username"] = "Username already registered";
+			}
+			if (jsobj["errors"].find("email") == jsobj["errors"].end()) {
+				if (get_user_by_email(name))
+					jsobj["errors"]["email"] = "Email already registered";
+			}
+			if (!jsobj["errors"].size()) {
+				if (auto user = create_user(name, email, password, dob)) {
+					request.session->bind(user->id(), user);
+					success = true;
 				}
+				else jsobj["errors"] = "Failed to create user";
 			}
-			else jsobj["errors"] = "Missing required fields";
-			jsobj["success"] = success;
-			response.content = jsobj.dump();
-			response.content_type = get_content_type_by_extension("json");
+		}
+		else jsobj["errors"] = "Missing required fields";
+		jsobj["success"] = success;
+		response.content = jsobj.dump();
+		response.content_type = get_content_type_by_extension("json");
+		response.status = 200;
+		return true;
+	}));
+	m_routes.push_back(app.internalRoutes.add("*", "/_password.json", [this](const ServerRequest& request, ServerResponse& response, const RouteParams&) {
+		if (request.params.find("test_generate")) {
+			auto start = std::chrono::high_resolution_clock::now();
+			std::chrono::high_resolution_clock::duration elapsed;
+			string hash;
+
+			unsigned cost = 8;
+			auto salt = Password::salt();
+			do {
+				cost <<= 1;
+				start = std::chrono::high_resolution_clock::now();
+				hash = Password::hash("password", salt, cost);
+				elapsed = std::chrono::high_resolution_clock::now() - start;
+				std::cout << cost << ": " << std::to_string((double)std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() / 1000.0) << "s" << std::endl;
+			} while (std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() < 500);
+			json js;
+			js["cost"] = cost;
+			js["time"] = std::to_string((double)std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() / 1000.0) + "s";
+			js["hash"] = Password::pack(hash, salt, cost);
+			response.content = js.dump();
 			response.status = 200;
+			response.content_type = get_content_type_by_extension("json");
 			return true;
 		}
-		else if (request.uri == "/_password.json") {
-			auto get_it = request.params.find("test_generate");
-			if (get_it != request.params.end()) {
-				auto start = std::chrono::high_resolution_clock::now();
-				std::chrono::high_resolution_clock::duration elapsed;
-				string hash;
-
-				unsigned cost = 8;
-				auto salt = Password::salt();
-				do {
-					cost <<= 1;
-					start = std::chrono::high_resolution_clock::now();
-					hash = Password::hash("password", salt, cost);
-					elapsed = std::chrono::high_resolution_clock::now() - start;
-					std::cout << cost << ": " << std::to_string((double)std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() / 1000.0) << "s" << std::endl;
-				} while (std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() < 500);
-				json js;
-				js["cost"] = cost;
-				js["time"] = std::to_string((double)std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() / 1000.0) + "s";
-				js["hash"] = Password::pack(hash, salt, cost);
-				response.content = js.dump();
-				response.status = 200;
-				response.content_type = get_content_type_by_extension("json");
-				return true;
+		else {
+			auto salt = Password::salt();
+			auto jsobj = json();
+			for (auto& pr : request.post_data) {
+				unsigned cost = 0;
+				jsobj[pr.first] = Password::hash(pr.second, salt, &cost);
 			}
-			else {
-				auto salt = Password::salt();
-				auto jsobj = json();
-				for (auto& pr : request.post_data) {
-					unsigned cost = 0;
-					jsobj[pr.first] = Password::hash(pr.second, salt, &cost);
-				}
 
-				response.content = jsobj.dump();
-				response.status = 200;
-				response.content_type = get_content_type_by_extension("json");
-				return true;
-			}
+			response.content = jsobj.dump();
+			response.status = 200;
+			response.content_type = get_content_type_by_extension("json");
 			return true;
 		}
-		return false;
-	});
+		return true;
+	}));
 
 	m_findAllUserNamesQuery = app.db->prepare("SELECT name FROM users");
 	m_findUserRowidQuery = app.db->prepare("SELECT id, name, email, pass, added, dob, level, xp, setup FROM users WHERE id = ? LIMIT 1");
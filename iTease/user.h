@@ -81,6 +81,7 @@ namespace iTease {
 		User(UserData data);
 
 		auto& data() const { return m_data; }
+		auto id() const { return m_data.id; }
 		auto& name() const { return m_data.name; }
 		auto& email() const { return m_data.email; }
 		auto& register_date() const { return m_data.registered; }
@@ -133,11 +134,14 @@ namespace iTease {
 
 	private:
 		Application& m_app;
-		Server::OnRequestEvent::Listener m_onRequestEventListener;
+		vector<Router::Route> m_routes;
 		map<int64_t, shared_ptr<User>> m_users;
 		map<string, shared_ptr<User>> m_userNames;
 		int m_numUsers = 0;
+		Metrics::Histogram& m_queryTime;
+		Metrics::Gauge& m_userCount;
 		Application::OnTickEvent::Listener m_onTickEventListener;
+		Application::OnSessionRestoreEvent::Listener m_onSessionRestoreListener;
 		vector<sqlite::database_binder> m_queries;
 		PreparedQuery m_findAllUserNamesQuery;
 		PreparedQuery m_findUserRowidQuery;
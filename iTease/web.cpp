@@ -2,9 +2,13 @@
 #include "web.h"
 #include "application.h"
 #include "user.h"
+#include "upload.h"
 
 using namespace iTease;
 
+// set on JS blocks reached through a block substituted in an overlay
+constexpr const char* MountedPath = "\xff""\xff""mountedPath";
+
 namespace iTease {
 	void js_add_to_block(Templating::Block* block, const JS::Variant& var) {
 		// process objects
@@ -12,19 +16,23 @@ namespace iTease {
 			auto vm = std::any_cast<JS::VariantMap>(var);
 
 			// if it's a WebTemplateFile, copy the template node into this templates block
+			// within a request it's only substituted for the block in the request's overlay
 			if (auto tf = JS::to_object<WebTemplateFile>(vm)) {
-				*static_cast<Templating::Block*>(block) = *tf->get_template();
+				if (!Templating::Overlay::assign_block(*block, tf->get_template()))
+					*static_cast<Templating::Block*>(block) = *tf->get_template();
 			}
 			else if (auto tblock = JS::to_object<Templating::Block>(vm)) {
-				*static_cast<Templating::Block*>(block) = *tblock;
+				if (!Templating::Overlay::assign_block(*block, JS::to_shared<Templating::Block>(vm)))
+					*static_cast<Templating::Block*>(block) = *tblock;
 			}
 			else {
+				block = &Templating::Overlay::resolve(*block);
 				for (auto& pr : vm) {
 					if (pr.first == "vars") {
 						if (pr.second.type() == typeid(JS::VariantMap)) {
 							auto& varmap = std::any_cast<JS::VariantMap>(pr.second);
 							for (auto& val : varmap) {
-								block->set_var(val.first, convert_any_to_string(val.second));
+								Templating::Overlay::assign_var(*block, val.first, convert_any_to_string(val.second));
 							}
 						}
 						else if (pr.second.type() == typeid(JS::VariantVector)) {
@@ -36,7 +44,7 @@ namespace iTease {
 									for (auto& pr2 : varmap) {
 										strmap.emplace(pr2.first, convert_any_to_string(pr2.second));
 									}
-									block->add_to_array(strmap);
+									Templating::Overlay::add_to_array(*block, strmap);
 								}
 							}
 						}
@@ -59,7 +67,7 @@ namespace iTease {
 					for (auto& pr2 : varmap) {
 						strmap.emplace(pr2.first, convert_any_to_string(pr2.second));
 					}
-					block->add_to_array(strmap);
+					Templating::Overlay::add_to_array(*block, strmap);
 				}
 			}
 		}
@@ -67,7 +75,37 @@ namespace iTease {
 		else if (var.type() == typeid(string)) {
 			auto str = std::any_cast<string>(var);
 			std::istringstream ss(str);
-			block->load(ss);
+			// within a request the block may be shared with others, so a copy of it is loaded into and shown in its place
+			if (auto copy = Templating::Overlay::detach(*block)) {
+				copy->load(ss);
+				Templating::Overlay::assign_block(*block, std::move(copy));
+			}
+			else block->load(ss);
+		}
+	}
+
+	// the blocks added would be part of a template shared by every request, so within one they can't be
+	static void reject_restructure(JS::Context& js) {
+		if (Templating::Overlay::current())
+			js.raise(JS::Error{"blocks can only be added to a template outside of a request"});
+	}
+
+	void js_push_block(JS::Context& js, const shared_ptr<Templating::Block>& block) {
+		// below a substituted block, paths continue from the path of the block substituted rather than the substitute's own
+		string path;
+		js.push(JS::This{ });
+		if (js.has_property(-1, MountedPath))
+			path = js.get_property<string>(-1, "path") + "/" + block->name();
+		js.pop();
+		auto shown = Templating::Overlay::resolve(block);
+		if (shown != block && path.empty())
+			path = block->path();
+		js.push(JS::Shared<Templating::Block>{shown});
+		if (!path.empty()) {
+			js.put_properties(-1,
+				JS::Property<string>{"path", path},
+				JS::Property<bool>{MountedPath, true}
+			);
 		}
 	}
 
@@ -92,6 +130,8 @@ namespace iTease {
 			return "image/gif";
 		else if (sv == "bmp")
 			return "image/bmp";
+		else if (sv == "svg")
+			return "image/svg+xml";
 		return "";
 	}
 }
@@ -107,10 +147,10 @@ auto WebRequest::prototype(JS::Context& js)->void {
 	);
 	// .session
 	if (m_request.session) {
-		if (m_request.session->data) {
+		if (auto data = m_request.session->data()) {
 			js.push_object(
 				JS::Property<string>{"id", m_request.session->id},
-				JS::Property<JS::Shared<User>>{"user", JS::Shared<User>{std::static_pointer_cast<User>(m_request.session->data)}}
+				JS::Property<JS::Shared<User>>{"user", JS::Shared<User>{std::static_pointer_cast<User>(std::move(data))}}
 			);
 		}
 		else {
@@ -129,30 +169,87 @@ auto WebRequest::prototype(JS::Context& js)->void {
 
 	js.put_property(-2, "session");
 
-	// .params
-	js.push(JS::Object{ });
-	for (auto& param : m_request.params) {
-		js.put_property(-1, param.first, param.second);
+	// .files, handles which keep their uploads after the request has finished
+	js.push(JS::Array{ });
+	for (size_t i = 0; i < m_request.files.size(); ++i) {
+		js.push(JS::Shared<UploadedFileJS>{std::make_shared<UploadedFileJS>(m_request.files[i])});
+		js.put_property(-2, static_cast<int>(i));
 	}
-	js.put_property(-2, "params");
-	// .cookies
+	js.put_property(-2, "files");
+	// .route, values of the matched route's parameters
 	js.push(JS::Object{ });
-	for (auto& param : m_request.cookies) {
+	for (auto& param : m_routeParams) {
 		js.put_property(-1, param.first, param.second);
 	}
-	js.put_property(-2, "cookies");
-	// .headers
-	js.push(JS::Object{ });
-	for (auto& param : m_request.headers) {
-		js.put_property(-1, param.first, param.second);
+	js.put_property(-2, "route");
+
+	// return prototype
+	js.get_global<void>("\xff""\xff""module-web");
+	js.get_property<void>(-1, JSName);
+	js.remove(-2);
+}
+auto WebRequest::push_values(JS::Context& js, const char* name)->int {
+	JS::StackAssert sa(js, 1);
+	// built on first use, then kept on the object
+	auto key = string("\xff""\xff") + name;
+	js.push(JS::This{ });
+	js.get_property<void>(-1, key);
+	if (js.is<JS::Object>(-1)) {
+		js.remove(-2);
+		return 1;
 	}
-	js.put_property(-2, "headers");
-	// .post
+	js.pop();
 	js.push(JS::Object{ });
-	for (auto& param : m_request.post_data) {
-		js.put_property(-1, param.first, param.second);
+	if (name == string("post")) {
+		for (auto& value : m_request.post_data)
+			js.put_property(-1, value.first, value.second);
 	}
-	js.put_property(-2, "post");
+	else {
+		auto& values = name == string("headers") ? m_request.headers : name == string("params") ? m_request.params : m_request.cookies;
+		for (auto& value : values.all())
+			js.put_property(-1, value.first, value.second);
+	}
+	js.dup(-1);
+	js.put_property(-3, key);
+	js.remove(-2);
+	return 1;
+}
+
+auto UploadedFileJS::prototype(JS::Context& js)->void {
+	JS::StackAssert sa(js, 1);
+
+	// set up object
+	js.pop();
+	js.push_object(
+		JS::Property<string>{"field", m_file->field()},
+		JS::Property<string>{"filename", m_file->filename()},
+		JS::Property<string>{"contentType", m_file->content_type()},
+		JS::Property<double>{"size", static_cast<double>(m_file->size())},
+		JS::Property<string>{"hash", m_file->hash()}
+	);
+
+	// return prototype
+	js.get_global<void>("\xff""\xff""module-web");
+	js.get_property<void>(-1, JSName);
+	js.remove(-2);
+}
+auto WebSocketJS::prototype(JS::Context& js)->void {
+	JS::StackAssert sa(js, 1);
+
+	// set up object
+	js.pop();
+	auto socket = m_socket;
+	js.push_object(
+		JS::Property<string>{"session", m_socket->session()},
+		JS::Property<double>{"bufferedAmount", JS::Function{[socket](JS::Context& js) {
+			js.push(static_cast<double>(socket->buffered_amount()));
+			return 1;
+		}, 0}, JS::Function{}},
+		JS::Property<bool>{"open", JS::Function{[socket](JS::Context& js) {
+			js.push(socket->is_open());
+			return 1;
+		}, 0}, JS::Function{}}
+	);
 
 	// return prototype
 	js.get_global<void>("\xff""\xff""module-web");
@@ -160,8 +257,115 @@ auto WebRequest::prototype(JS::Context& js)->void {
 	js.remove(-2);
 }
 
-Web::Web(Application& app) : Module("web"), m_app(app)
+// pages poll with XMLHttpRequest, plain requests for the same paths are page loads
+static auto is_ajax(const ServerRequest& request) {
+	return strtolower(request.header("X-Requested-With")) == "xmlhttprequest";
+}
+static auto updates_json(const vector<PageUpdates::Update>& updates, bool content) {
+	auto list = json::array();
+	for (auto& update : updates) {
+		if (content) list.push_back({{"selector", update.selector}, {"content", update.content}, {"complete", update.complete}});
+		else list.push_back({{"selector", update.selector}, {"complete", update.complete}});
+	}
+	return list;
+}
+
+Web::Web(Application& app) : Module("web"), m_app(app),
+	m_renderTime(app.metrics.histogram("itease_template_render_duration_seconds", "Time spent rendering templates.")),
+	m_sockets(app)
 { }
+void Web::init_module(Application& app) {
+	// static files are answered natively, before any JS handler runs
+	m_staticRoute = app.nativeRoutes.add("GET", "/*path", [this](const ServerRequest& request, ServerResponse& response, const RouteParams&) {
+		return serve_static_file(request, response);
+	});
+	// each session's event stream, fed by web.push()
+	m_eventsRoute = app.nativeRoutes.add("GET", "/events", [this](const ServerRequest& request, ServerResponse& response, const RouteParams&) {
+		response.events = m_app.events.subscribe(request.session->id);
+		response.content_type = "text/event-stream";
+		response.headers["Cache-Control"] = "no-cache";
+		response.status = 200;
+		return true;
+	});
+	// bundles are named by their content, so they never change and may be cached for good
+	m_bundleRoute = app.nativeRoutes.add("GET", "/bundle/:file", [this](const ServerRequest& request, ServerResponse& response, const RouteParams& params) {
+		auto bundle = m_bundler.find(params.front().second);
+		if (!bundle)
+			return false;
+		response.headers["ETag"] = bundle->etag;
+		response.headers["Cache-Control"] = "public, max-age=31536000, immutable";
+		if (request.header("If-None-Match") == bundle->etag) {
+			response.status = 304;
+			return true;
+		}
+		response.shared_content = bundle->data;
+		response.content_type = bundle->content_type;
+		response.status = 200;
+		return true;
+	});
+	// lets the server admit requests for files and bundles as cheap ones, once it's known they exist
+	m_staticLookup = app.OnStaticLookup.listen([this](const string& uri) {
+		return is_static_uri(uri) ? 1 : 0;
+	});
+	// sockets are closed before the server hands their connections back
+	m_serverStop = app.OnServerStop.listen([this] {
+		m_sockets.stop();
+		return 1;
+	});
+	// updates polled by pages, /update lists the session's open ones and /updates hands over their content
+	m_updateRoute = app.nativeRoutes.add("*", "/update/*path", [this](const ServerRequest& request, ServerResponse& response, const RouteParams&) {
+		if (!is_ajax(request))
+			return false;
+		response.content = json{{"update", updates_json(m_updates.prepare(request.session ? request.session->id : ""), false)}}.dump();
+		response.content_type = get_content_type_by_extension("json");
+		response.status = 200;
+		return true;
+	});
+	m_updatesRoute = app.nativeRoutes.add("*", "/updates/*path", [this](const ServerRequest& request, ServerResponse& response, const RouteParams&) {
+		if (!is_ajax(request))
+			return false;
+		response.content = json{{"updates", updates_json(m_updates.collect(request.session ? request.session->id : ""), true)}}.dump();
+		response.content_type = get_content_type_by_extension("json");
+		response.status = 200;
+		return true;
+	});
+	// the metrics of every module, for a Prometheus on this machine to scrape, they're nobody else's business
+	m_metricsRoute = app.nativeRoutes.add("GET", "/metrics", [this](const ServerRequest& request, ServerResponse& response, const RouteParams&) {
+		if (!request.local)
+			return false;
+		response.content = m_app.metrics.render();
+		response.content_type = "text/plain; version=0.0.4; charset=utf-8";
+		response.headers["Cache-Control"] = "no-store";
+		response.status = 200;
+		return true;
+	});
+}
+bool Web::is_static_uri(const string& uri) {
+	constexpr string_view BundlePrefix = "/bundle/";
+	if (uri.compare(0, BundlePrefix.size(), BundlePrefix) == 0)
+		return m_bundler.find(uri.substr(BundlePrefix.size())) != nullptr;
+	// misses are remembered by the cache, so made-up paths don't stat the disk each time
+	return uri.find("..") == string::npos && m_staticCache.get(fs::path("web") / uri) != nullptr;
+}
+bool Web::serve_static_file(const ServerRequest& request, ServerResponse& response) {
+	if (request.uri.find("..") != string::npos)
+		return false;
+	auto entry = m_staticCache.get(fs::path("web") / request.uri);
+	if (!entry)
+		return false;
+	if (StaticCache::not_modified(*entry, request.header("If-None-Match"), request.header("If-Modified-Since"))) {
+		response.status = 304;
+		response.headers["ETag"] = entry->etag;
+		response.headers["Last-Modified"] = entry->last_modified;
+		response.headers["Cache-Control"] = "no-cache";
+		return true;
+	}
+	response.file = entry->path;
+	response.content_type = entry->content_type;
+	response.status = 200;
+	apply_static_cache(response);
+	return true;
+}
 
 void Web::init_js(JS::Context& ctx) {
 	using namespace std::placeholders;
@@ -178,21 +382,22 @@ void Web::init_js(JS::Context& ctx) {
 			}, 2}},
 			JS::Property<JS::Function>{"enable", JS::Function{[this](JS::Context& js) {
 				auto block = js.self<JS::Shared<Templating::Block>>();
-				block->enable_segment(js.require<string>(0));
+				Templating::Overlay::assign_segment(*block, js.require<string>(0), true);
 				return 0;
 			}, 1}},
 			JS::Property<JS::Function>{"disable", JS::Function{[this](JS::Context& js) {
 				auto block = js.self<JS::Shared<Templating::Block>>();
-				block->disable_segment(js.require<string>(0));
+				Templating::Overlay::assign_segment(*block, js.require<string>(0), false);
 				return 0;
 			}, 1}},
 			JS::Property<JS::Function>{"addBlock", JS::Function{[this](JS::Context& js) {
+				reject_restructure(js);
 				auto block = js.self<JS::Shared<Templating::Block>>();
 				auto name = js.require<string>(0);
 				auto target = js.get<string>(1);
 				auto new_block = target.empty() ? block->add_block(name) : block->insert_block_at(name, target);
 				js.push_this_object(JS::Property<JS::Shared<Templating::Block>>{name, JS::Function{[new_block](JS::Context& js)->duk_ret_t {
-					js.push(JS::Shared<Templating::Block>{new_block});
+					js_push_block(js, new_block);
 					return 1;
 				}, 0}, JS::Function{[new_block](JS::Context& js)->duk_ret_t {
 					auto obj = js.get<JS::Object>(0);
@@ -218,12 +423,13 @@ void Web::init_js(JS::Context& ctx) {
 				return 1;
 			}, 2}},
 			JS::Property<JS::Function>{"insertBlock", JS::Function{[this](JS::Context& js) {
+				reject_restructure(js);
 				auto block = js.self<JS::Shared<Templating::Block>>();
 				auto name = js.require<string>(0);
 				auto target = js.get<string>(1);
 				auto new_block = target.empty() ? block->insert_block(name) : block->add_block_at(name, target);
 				js.push_this_object(JS::Property<JS::Shared<Templating::Block>>{name, JS::Function{[new_block](JS::Context& js)->duk_ret_t {
-					js.push(JS::Shared<Templating::Block>{new_block});
+					js_push_block(js, new_block);
 					return 1;
 				}, 0}, JS::Function{[new_block](JS::Context& js)->duk_ret_t {
 					auto obj = js.get<JS::Object>(0);
@@ -249,9 +455,12 @@ void Web::init_js(JS::Context& ctx) {
 			}, 2}},
 			JS::Property<JS::Function>{"render", JS::Function{[this](JS::Context& js) {
 				auto block = js.self<JS::Shared<Templating::Block>>();
-				std::stringstream ss;
-				block->render(ss);
-				js.push(ss.str());
+				string content;
+				ContentWriter writer(content);
+				std::ostream os(&writer);
+				Metrics::Timer timer(m_renderTime);
+				block->render(os);
+				js.push(content);
 				return 1;
 			}, 0}},
 			JS::Property<JS::Function>{"onRender", JS::Function{[this](JS::Context& js) {
@@ -263,7 +472,101 @@ void Web::init_js(JS::Context& ctx) {
 		)},
 		// web.__WebRequest (prototype)
 		JS::Property<JS::Object>{WebRequest::JSName, ctx.push_object(
-			JS::Property<bool>{WebRequest::JSName, true}
+			JS::Property<bool>{WebRequest::JSName, true},
+			// .params, .cookies, .headers and .post are only built for handlers which use them
+			JS::Property<bool>{"params", JS::Function{[](JS::Context& js) {
+				return js.self<JS::Shared<WebRequest>>()->push_values(js, "params");
+			}, 0}, JS::Function{}},
+			JS::Property<bool>{"cookies", JS::Function{[](JS::Context& js) {
+				return js.self<JS::Shared<WebRequest>>()->push_values(js, "cookies");
+			}, 0}, JS::Function{}},
+			JS::Property<bool>{"headers", JS::Function{[](JS::Context& js) {
+				return js.self<JS::Shared<WebRequest>>()->push_values(js, "headers");
+			}, 0}, JS::Function{}},
+			JS::Property<bool>{"post", JS::Function{[](JS::Context& js) {
+				return js.self<JS::Shared<WebRequest>>()->push_values(js, "post");
+			}, 0}, JS::Function{}},
+			// single values, looked up without building the objects above
+			JS::Property<JS::Function>{"header", JS::Function{[](JS::Context& js) {
+				js.push(js.self<JS::Shared<WebRequest>>()->request().headers.get(js.require<string>(0)));
+				return 1;
+			}, 1}},
+			JS::Property<JS::Function>{"param", JS::Function{[](JS::Context& js) {
+				js.push(js.self<JS::Shared<WebRequest>>()->request().params.get(js.require<string>(0)));
+				return 1;
+			}, 1}},
+			JS::Property<JS::Function>{"cookie", JS::Function{[](JS::Context& js) {
+				js.push(js.self<JS::Shared<WebRequest>>()->request().cookies.get(js.require<string>(0)));
+				return 1;
+			}, 1}}
+		)},
+		// web.__WebSocket (prototype)
+		JS::Property<JS::Object>{WebSocketJS::JSName, ctx.push_object(
+			JS::Property<bool>{WebSocketJS::JSName, true},
+			JS::Property<JS::Function>{"send", JS::Function{[](JS::Context& js) {
+				auto socket = js.self<JS::Shared<WebSocketJS>>()->socket();
+				auto data = js.is<string>(0) ? js.get<string>(0) : js.encode(0);
+				js.push(socket->send(data));
+				return 1;
+			}, 1}},
+			JS::Property<JS::Function>{"close", JS::Function{[](JS::Context& js) {
+				auto socket = js.self<JS::Shared<WebSocketJS>>()->socket();
+				auto code = js.is<int>(0) ? js.get<int>(0) : 1000;
+				socket->close(static_cast<uint16_t>(code), js.is<string>(1) ? js.get<string>(1) : "");
+				return 0;
+			}, 2}},
+			// .on('message', fn(data)) or .on('close', fn(code, reason)), handlers run in the context the socket was opened in
+			JS::Property<JS::Function>{"on", JS::Function{[](JS::Context& js) {
+				auto event = js.require<string>(0);
+				if (!js.is<JS::Function>(1))
+					js.raise(JS::TypeError{"function"});
+				auto socket = js.self<JS::Shared<WebSocketJS>>()->socket();
+				js.push(JS::This{});
+				if (event == "message") {
+					auto cb = std::make_shared<JS::CallbackMethod<string>>(js);
+					socket->on_message = [cb, next = std::move(socket->on_message)](const string& data, bool binary) {
+						if (next) next(data, binary);
+						auto& js = cb->context();
+						JS::StackAssert sa(js);
+						(*cb)(string(data));
+						js.pop();
+					};
+				}
+				else if (event == "close") {
+					auto cb = std::make_shared<JS::CallbackMethod<int, string>>(js);
+					socket->on_close = [cb, next = std::move(socket->on_close)](uint16_t code, const string& reason) {
+						if (next) next(code, reason);
+						auto& js = cb->context();
+						JS::StackAssert sa(js);
+						(*cb)(static_cast<int>(code), string(reason));
+						js.pop();
+					};
+				}
+				else {
+					js.pop();
+					js.raise(JS::Error{"unknown socket event '" + event + "'"});
+				}
+				js.pop();
+				return 0;
+			}, 2}}
+		)},
+		// web.__UploadedFile (prototype)
+		JS::Property<JS::Object>{UploadedFileJS::JSName, ctx.push_object(
+			JS::Property<bool>{UploadedFileJS::JSName, true},
+			// .read([offset[, length]]), the rest of the file by default
+			JS::Property<JS::Function>{"read", JS::Function{[](JS::Context& js) {
+				auto& file = js.self<JS::Shared<UploadedFileJS>>()->file();
+				auto offset = js.is<double>(0) ? static_cast<uint64_t>(std::max(0.0, js.get<double>(0))) : 0;
+				auto length = js.is<double>(1) ? static_cast<uint64_t>(std::max(0.0, js.get<double>(1))) : file->size();
+				js.push(file->read(offset, static_cast<size_t>(std::min<uint64_t>(length, file->size()))));
+				return 1;
+			}, 2}},
+			// .moveTo(path), keeps the upload, returns false on failure
+			JS::Property<JS::Function>{"moveTo", JS::Function{[](JS::Context& js) {
+				auto& file = js.self<JS::Shared<UploadedFileJS>>()->file();
+				js.push(file->move_to(js.require<string>(0)));
+				return 1;
+			}, 1}}
 		)},
 		// web.__WebResponse (prototype)
 		JS::Property<JS::Object>{WebResponse::JSName, ctx.push_object(
@@ -372,8 +675,8 @@ void Web::init_js(JS::Context& ctx) {
 
 				auto path = js.require<string>(0);
 				try {
-					shared_ptr<WebTemplateFile> tfile = js.is<JS::Object>(1) ? std::make_shared<WebTemplateFile>(std::move(path), std::move(js.get<JS::Object>(1)))
-						: std::make_shared<WebTemplateFile>(std::move(path));
+					shared_ptr<WebTemplateFile> tfile = js.is<JS::Object>(1) ? std::make_shared<WebTemplateFile>(m_templateCache, std::move(path), std::move(js.get<JS::Object>(1)))
+						: std::make_shared<WebTemplateFile>(m_templateCache, std::move(path));
 					js.construct(JS::Shared<WebTemplateFile>{tfile});
 					js.construct(*tfile->get_template());
 					js.push(JS::This{ });
@@ -436,28 +739,33 @@ void Web::init_js(JS::Context& ctx) {
 				}, 1}},
 				JS::Property<JS::Function>{"enable", JS::Function{[this](JS::Context& js) {
 					auto tfile = js.self<JS::Shared<WebTemplateFile>>();
-					tfile->get_template()->enable_segment(js.require<string>(0));
+					Templating::Overlay::assign_segment(*tfile->get_template(), js.require<string>(0), true);
 					return 0;
 				}, 1}},
 				JS::Property<JS::Function>{"disable", JS::Function{[this](JS::Context& js) {
 					auto tfile = js.self<JS::Shared<WebTemplateFile>>();
-					tfile->get_template()->disable_segment(js.require<string>(0));
+					Templating::Overlay::assign_segment(*tfile->get_template(), js.require<string>(0), false);
 					return 0;
 				}, 1}},
 				JS::Property<JS::Function>{"render", JS::Function{[this](JS::Context& js) {
 					auto tfile = js.self<JS::Shared<WebTemplateFile>>();
-					std::stringstream ss;
-					tfile->get_template()->render(ss);
-					js.push(ss.str());
+					string content;
+					ContentWriter writer(content);
+					std::ostream os(&writer);
+					Metrics::Timer timer(m_renderTime);
+					tfile->get_template()->render(os);
+					js.push(content);
 					return 1;
 				}, 0}},
 				JS::Property<JS::Function>{"addBlock", JS::Function{[this](JS::Context& js) {
+					reject_restructure(js);
 					auto tfile = js.self<JS::Shared<WebTemplateFile>>();
 					auto block = tfile->get_template()->add_block_at(js.get<string>(0), js.get<string>(1));
 					js.push(JS::Shared<Templating::Block>{block});
 					return 1;
 				}, 2}},
 				JS::Property<JS::Function>{"insertBlock", JS::Function{[this](JS::Context& js) {
+					reject_restructure(js);
 					auto tfile = js.self<JS::Shared<WebTemplateFile>>();
 					auto block = tfile->get_template()->insert_block_at(js.get<string>(0), js.get<string>(1));
 					js.push(JS::Shared<Templating::Block>{block});
@@ -495,6 +803,24 @@ void Web::init_js(JS::Context& ctx) {
 		JS::Property<JS::Function>{"addController", JS::Function{std::bind(&Web::add_controller_js, this, _1), 1}},
 		// web.listen
 		JS::Property<JS::Function>{"listen", JS::Function{std::bind(&Web::add_listener_js, this, _1), 2}},
+		// web.route
+		JS::Property<JS::Function>{"route", JS::Function{std::bind(&Web::add_route_js, this, _1), 3}},
+		// web.push
+		JS::Property<JS::Function>{"push", JS::Function{std::bind(&Web::push_js, this, _1), 3}},
+		// web.openUpdate
+		JS::Property<JS::Function>{"openUpdate", JS::Function{std::bind(&Web::open_update_js, this, _1), 3}},
+		// web.setUpdate
+		JS::Property<JS::Function>{"setUpdate", JS::Function{std::bind(&Web::set_update_js, this, _1), 4}},
+		// web.collectUpdates
+		JS::Property<JS::Function>{"collectUpdates", JS::Function{std::bind(&Web::collect_updates_js, this, _1), 1}},
+		// web.prepareUpdates
+		JS::Property<JS::Function>{"prepareUpdates", JS::Function{std::bind(&Web::prepare_updates_js, this, _1), 1}},
+		// web.socket
+		JS::Property<JS::Function>{"socket", JS::Function{std::bind(&Web::add_socket_js, this, _1), 2}},
+		// web.broadcast
+		JS::Property<JS::Function>{"broadcast", JS::Function{std::bind(&Web::broadcast_js, this, _1), 2}},
+		// web.bundle
+		JS::Property<JS::Function>{"bundle", JS::Function{std::bind(&Web::bundle_js, this, _1), 2}},
 		// web.isStaticFile
 		JS::Property<JS::Function>{"isStaticFile", JS::Function{std::bind(&Web::is_static_file_js, this, _1), 1}},
 		// web.createStaticResponse
@@ -506,24 +832,44 @@ void Web::init_js(JS::Context& ctx) {
 WebResponse Web::create_static_response(const fs::path& path) {
 	ServerResponse response;
 	auto fpath = fs::path("web") / path;
-	if (fs::is_regular_file(fpath) || fs::is_symlink(fpath)) {
-		std::ifstream file(fpath, std::ios::binary);
-		if (file.is_open()) {
-			auto fsize = fs::file_size(fpath);
-			file.unsetf(std::ios::skipws);
-			response.content.reserve(static_cast<size_t>(fsize));
-			response.content.insert(response.content.begin(), std::istream_iterator<char>(file), std::istream_iterator<char>());
-			response.content_type = get_content_type_by_extension(string(ltrim(fpath.extension().string(), ".")));
-			response.status = 200;
-		}
+	if (auto entry = m_staticCache.get(fpath)) {
+		// the body is attached from the cache (or streamed from the file) once the response leaves JS
+		response.file = entry->path;
+		response.content_type = entry->content_type;
+		response.status = 200;
 	}
 	return response;
 }
+void Web::apply_static_cache(ServerResponse& response) {
+	if (response.file.empty())
+		return;
+	auto entry = m_staticCache.get(response.file);
+	if (!entry)
+		return;
+	response.headers["ETag"] = entry->etag;
+	response.headers["Last-Modified"] = entry->last_modified;
+	// browsers may keep the file but must revalidate it, which costs them a 304
+	response.headers["Cache-Control"] = "no-cache";
+	if (entry->data) {
+		response.shared_content = entry->data;
+		response.file.clear();
+	}
+}
 void Web::add_controller(shared_ptr<WebController> ptr) {
 	m_controllers.emplace_back(ptr);
 }
+void Web::add_route(const string& method, const string& pattern, Router::Handler func) {
+	if (auto worker = Application::current_worker())
+		m_routes.push_back(worker->routes.add(method, pattern, func));
+	else
+		m_routes.push_back(m_app.routes.add(method, pattern, func));
+}
 void Web::add_listener(Server::OnRequestEvent::Handler func) {
-	m_serverRequestListeners.push_back(m_app.OnServerRequest.listen(func));
+	// listeners added while a worker's context is initialising serve that worker's requests
+	if (auto worker = Application::current_worker())
+		m_serverRequestListeners.push_back(worker->OnServerRequest.listen(func));
+	else
+		m_serverRequestListeners.push_back(m_app.OnServerRequest.listen(func));
 }
 int Web::create_static_response_js(JS::Context& js) {
 	JS::StackAssert sa(js, 1);
@@ -545,32 +891,186 @@ int Web::add_listener_js(JS::Context& js) {
 		auto& js = listenerCB->context();
 		JS::StackAssert sa(js);
 		(*listenerCB)(JS::Shared<WebRequest>{std::move(std::make_shared<WebRequest>(req))});
-		if (js.is<WebResponse>(-1)) {
-			resp = js.get<WebResponse>(-1).response;
-			js.pop();
-			return true;
+		return js_response(js, req, resp);
+	});
+	return 0;
+}
+int Web::add_route_js(JS::Context& js) {
+	auto method = js.require<string>(0);
+	auto pattern = js.require<string>(1);
+	if (!js.is<JS::Function>(2))
+		js.raise(JS::TypeError{"function"});
+
+	auto routeCB = std::make_shared<JS::Callback<JS::Shared<WebRequest>>>(js, 2);
+	try {
+		add_route(method, pattern, [this, routeCB](const ServerRequest& req, ServerResponse& resp, const RouteParams& params) {
+			auto& js = routeCB->context();
+			JS::StackAssert sa(js);
+			(*routeCB)(JS::Shared<WebRequest>{std::make_shared<WebRequest>(req, params)});
+			return js_response(js, req, resp);
+		});
+	}
+	catch (const std::invalid_argument& ex) {
+		js.raise(JS::Error{ex.what()});
+	}
+	return 0;
+}
+int Web::push_js(JS::Context& js) {
+	JS::StackAssert sa(js, 1);
+	// a null session sends to every open stream
+	auto session = js.is<string>(0) ? js.get<string>(0) : "";
+	auto event = js.require<string>(1);
+	auto data = js.is<string>(2) ? js.get<string>(2) : js.encode(2);
+	js.push(static_cast<int>(m_app.events.publish(session, event, data)));
+	return 1;
+}
+int Web::open_update_js(JS::Context& js) {
+	JS::StackAssert sa(js, 1);
+	// a null session lets any page polling apply the update
+	auto session = js.is<string>(0) ? js.get<string>(0) : "";
+	auto selector = js.require<string>(1);
+	auto content = js.is<string>(2) ? js.get<string>(2) : "";
+	js.push(static_cast<double>(m_updates.open(session, selector, content)));
+	return 1;
+}
+int Web::set_update_js(JS::Context& js) {
+	JS::StackAssert sa(js, 1);
+	auto id = static_cast<uint64_t>(js.require<double>(0));
+	auto content = js.is<string>(1) ? js.get<string>(1) : "";
+	js.push(m_updates.set(id, content, js.is<bool>(2) && js.get<bool>(2), js.is<bool>(3) && js.get<bool>(3)));
+	return 1;
+}
+static auto push_updates(JS::Context& js, const vector<PageUpdates::Update>& updates, bool content) {
+	js.push(JS::Array{ });
+	for (size_t i = 0; i < updates.size(); ++i) {
+		if (content) {
+			js.push_object(
+				JS::Property<string>{"selector", updates[i].selector},
+				JS::Property<string>{"content", updates[i].content},
+				JS::Property<bool>{"complete", updates[i].complete}
+			);
 		}
 		else {
-			js.get_global<void>("\xff""\xff""module-web");
-			js.get_property<void>(-1, "Controller");
-			if (js.instanceof(-3, -1)) {
-				js.pop(2);
-
-				auto controller = js.get<JS::Shared<WebController>>(-1);
-				auto result = controller->request(js, req, resp);
-				js.pop();
-				return result;
-			}
-			else js.pop(3);
+			js.push_object(
+				JS::Property<string>{"selector", updates[i].selector},
+				JS::Property<bool>{"complete", updates[i].complete}
+			);
 		}
-		return false;
-	});
+		js.put_property(-2, static_cast<int>(i));
+	}
+}
+int Web::collect_updates_js(JS::Context& js) {
+	JS::StackAssert sa(js, 1);
+	push_updates(js, m_updates.collect(js.is<string>(0) ? js.get<string>(0) : ""), true);
+	return 1;
+}
+int Web::prepare_updates_js(JS::Context& js) {
+	JS::StackAssert sa(js, 1);
+	push_updates(js, m_updates.prepare(js.is<string>(0) ? js.get<string>(0) : ""), false);
+	return 1;
+}
+int Web::add_socket_js(JS::Context& js) {
+	auto pattern = js.require<string>(0);
+	if (!js.is<JS::Function>(1))
+		js.raise(JS::TypeError{"function"});
+
+	auto openCB = std::make_shared<JS::Callback<JS::Shared<WebSocketJS>, JS::Shared<WebRequest>>>(js, 1);
+	try {
+		add_route("GET", pattern, [this, openCB](const ServerRequest& req, ServerResponse& resp, const RouteParams& params) {
+			if (!accept_websocket(req, resp))
+				return false;
+			if (resp.status != 101)
+				return true;
+			resp.upgrade = [this, openCB, req, params](shared_ptr<WebSocket> socket) {
+				m_sockets.add(std::move(socket), [openCB, req, params](const shared_ptr<WebSocket>& socket) {
+					auto& js = openCB->context();
+					JS::StackAssert sa(js);
+					(*openCB)(JS::Shared<WebSocketJS>{std::make_shared<WebSocketJS>(socket)}, JS::Shared<WebRequest>{std::make_shared<WebRequest>(req, params)});
+					js.pop();
+				});
+			};
+			return true;
+		});
+	}
+	catch (const std::invalid_argument& ex) {
+		js.raise(JS::Error{ex.what()});
+	}
 	return 0;
 }
+int Web::broadcast_js(JS::Context& js) {
+	JS::StackAssert sa(js, 1);
+	// a null session sends to every open socket
+	auto session = js.is<string>(0) ? js.get<string>(0) : "";
+	auto data = js.is<string>(1) ? js.get<string>(1) : js.encode(1);
+	int sent = 0;
+	for (auto& socket : m_sockets.sockets(session)) {
+		if (socket->send(data))
+			++sent;
+	}
+	js.push(sent);
+	return 1;
+}
+bool Web::accept_websocket(const ServerRequest& req, ServerResponse& resp) {
+	if (strtolower(req.header("Upgrade")) != "websocket")
+		return false;
+	auto key = req.header("Sec-WebSocket-Key");
+	if (key.empty()) {
+		resp.status = 400;
+		return true;
+	}
+	if (req.header("Sec-WebSocket-Version") != "13") {
+		resp.status = 426;
+		resp.headers["Sec-WebSocket-Version"] = "13";
+		return true;
+	}
+	resp.status = 101;
+	resp.headers["Upgrade"] = "websocket";
+	resp.headers["Connection"] = "Upgrade";
+	resp.headers["Sec-WebSocket-Accept"] = websocket_accept_key(key);
+	return true;
+}
+bool Web::js_response(JS::Context& js, const ServerRequest& req, ServerResponse& resp) {
+	if (js.is<WebResponse>(-1)) {
+		resp = js.get<WebResponse>(-1).response;
+		js.pop();
+		apply_static_cache(resp);
+		return true;
+	}
+	else {
+		js.get_global<void>("\xff""\xff""module-web");
+		js.get_property<void>(-1, "Controller");
+		if (js.instanceof(-3, -1)) {
+			js.pop(2);
+
+			auto controller = js.get<JS::Shared<WebController>>(-1);
+			auto result = controller->request(js, req, resp, m_renderTime);
+			js.pop();
+			return result;
+		}
+		else js.pop(3);
+	}
+	return false;
+}
 int Web::is_static_file_js(JS::Context& js) {
 	JS::StackAssert sa(js, 1);
 	auto path = fs::path("web") / js.require<string>(0);
-	js.push<bool>(fs::is_regular_file(path));
+	js.push<bool>(m_staticCache.get(path) != nullptr);
+	return 1;
+}
+int Web::bundle_js(JS::Context& js) {
+	JS::StackAssert sa(js, 1);
+	auto name = js.require<string>(0);
+	if (!js.is<JS::Array>(1))
+		js.raise(JS::TypeError("array"));
+	vector<string> sources;
+	for (int i = 0, n = js.length(1); i < n; ++i)
+		sources.push_back(js.get_property<string>(1, i));
+	try {
+		js.push(m_bundler.bundle(name, sources));
+	}
+	catch (const std::exception& ex) {
+		js.raise(JS::Error{ex.what()});
+	}
 	return 1;
 }
 int Web::add_controller_js(JS::Context& js) {
@@ -630,15 +1130,11 @@ int Web::add_controller_js(JS::Context& js) {
 	return 0;
 }
 
-WebTemplateFile::WebTemplateFile(string path) : m_template(std::make_shared<Templating::Block>()) {
-	std::ifstream file(path);
-	if (!file.is_open()) throw(std::runtime_error("failed to open template '" + path + "'"));
-	m_template->load(file);
-}
-WebTemplateFile::WebTemplateFile(string path, const JS::VariantMap& data) : m_template(std::make_shared<Templating::Block>()) {
-	std::ifstream file(path);
-	if (!file.is_open()) throw(std::runtime_error("failed to open template '" + path + "'"));
-	m_template->load(file);
+WebTemplateFile::WebTemplateFile(TemplateCache& cache, string path) : m_template(cache.instance(path))
+{ }
+WebTemplateFile::WebTemplateFile(TemplateCache& cache, string path, const JS::VariantMap& data) : m_template(cache.instance(path)) {
+	// the data is the template's own, even when it's constructed within a request
+	Templating::Overlay::Activation activation(nullptr);
 	auto it = data.find("vars");
 	if (it != data.end()) {
 		if (it->second.type() == typeid(JS::VariantMap))
@@ -655,10 +1151,10 @@ WebTemplateFile::~WebTemplateFile() {
 	if (m_cacheFile.size()) fs::remove(m_cacheFile);
 }
 void WebTemplateFile::set_var(const string& name, const string& value) {
-	m_template->set_var(name, value);
+	Templating::Overlay::assign_var(*m_template, name, value);
 }
 string WebTemplateFile::get_var(const string& name) const {
-	return m_template->has_var(name) ? m_template->var(name).value() : "";
+	return Templating::Overlay::var_value(*m_template, name);
 }
 shared_ptr<Templating::Block> WebTemplateFile::get_block(const string& name) const {
 	if (auto block = m_template->block(name)) {
@@ -739,12 +1235,16 @@ void WebTemplateFile::add_to_block(Templating::Block* block, const JS::Variant&
 }
 
 WebController::WebController(shared_ptr<WebTemplateFile> templateFile) : m_template(templateFile) { }
-auto WebController::request(JS::Context& js, const ServerRequest& req, ServerResponse& resp)->bool {
+auto WebController::request(JS::Context& js, const ServerRequest& req, ServerResponse& resp, Metrics::Histogram& renderTime)->bool {
 	JS::StackAssert sa(js);
-	std::ostringstream ss;
+	// template writes made while handling the request go to its own overlay, leaving the controller's template as it was
+	auto overlay = std::make_shared<Templating::Overlay>();
+	Templating::Overlay::Activation activation(overlay.get());
 	js.dup();
 	js.get_property<void>(-1, "onRequest");
-	auto block = m_template->get_template().get();
+	// keeps a returned block alive while it renders
+	shared_ptr<Templating::Block> shared = m_template->get_template();
+	auto block = shared.get();
 
 	if (js.is<JS::Function>(-1)) {
 		js.swap(-1, -2);
@@ -755,9 +1255,11 @@ auto WebController::request(JS::Context& js, const ServerRequest& req, ServerRes
 			if (js.is<JS::Object>(-1)) {
 				auto vm = js.get<JS::Object>(-1);
 				if (auto tf = JS::to_object<WebTemplateFile>(vm)) {
-					block = tf->get_template().get();
+					shared = tf->get_template();
+					block = shared.get();
 				}
 				else if (auto tb = JS::to_object<Templating::Block>(vm)) {
+					shared = JS::to_shared<Templating::Block>(vm);
 					block = tb;
 				}
 				else if (js.is<WebResponse>(-1)) {
@@ -797,24 +1299,29 @@ auto WebController::request(JS::Context& js, const ServerRequest& req, ServerRes
 	js.dup();
 	js.get_property<void>(-1, "onRenderBlock");
 
-	{
-		shared_ptr<JS::CallbackMethod<Templating::Block&>> jsOnRenderCB;
-		Templating::OnBlockRender::Listener onRenderBlock;
-		if (js.is<JS::Function>(-1)) {
-			js.swap(-1, -2);
-			jsOnRenderCB = std::make_shared<JS::CallbackMethod<Templating::Block&>>(js);
-			js.pop(2);
+	shared_ptr<JS::CallbackMethod<Templating::Block&>> jsOnRenderCB;
+	if (js.is<JS::Function>(-1)) {
+		js.swap(-1, -2);
+		jsOnRenderCB = std::make_shared<JS::CallbackMethod<Templating::Block&>>(js);
+		js.pop(2);
+	}
+	else js.pop(2);
 
-			onRenderBlock = m_template->get_template()->OnRenderBlock.listen([&js, jsOnRenderCB](Templating::Block& block) {
-				(*jsOnRenderCB)(block);
-				js.pop();
-				return true;
-			});
-		}
-		block->render(ss);
+	Metrics::Timer timer(renderTime);
+	Templating::OnBlockRender::Listener onRenderBlock;
+	if (jsOnRenderCB) {
+		onRenderBlock = m_template->get_template()->OnRenderBlock.listen([&js, jsOnRenderCB](Templating::Block& block) {
+			(*jsOnRenderCB)(block);
+			js.pop();
+			return true;
+		});
 	}
-	resp.content = ss.str();
 	resp.status = 200;
 	resp.content_type = get_content_type_by_extension("html");
+	// rendered on the worker straight into the body, which the server then compresses or hands to MHD without copying
+	resp.content.clear();
+	ContentWriter writer(resp.content);
+	std::ostream os(&writer);
+	block->render(os);
 	return true;
 }
\ No newline at end of file
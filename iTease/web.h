@@ -1,10 +1,18 @@
 #pragma once
+#include "bundle.h"
+#include "metrics.h"
 #include "module.h"
+#include "page_updates.h"
 #include "server.h"
+#include "router.h"
+#include "static_cache.h"
 #include "template.h"
+#include "template_cache.h"
 
 namespace iTease {
 	extern void js_add_to_block(Templating::Block*, const JS::Variant&);
+	// pushes a sub-block of the block at 'this', or the block substituted for it in the current overlay
+	extern void js_push_block(JS::Context&, const shared_ptr<Templating::Block>&);
 
 	class WebTemplateBase {
 	public:
@@ -15,8 +23,9 @@ namespace iTease {
 	public:
 		static constexpr const char* JSName = "\xff""\xff""WebTemplateFile";
 
-		WebTemplateFile(string path);
-		WebTemplateFile(string path, const JS::VariantMap& data);
+		// instances the template of the file from the cache, parsing it only if it changed
+		WebTemplateFile(TemplateCache&, string path);
+		WebTemplateFile(TemplateCache&, string path, const JS::VariantMap& data);
 		virtual ~WebTemplateFile();
 
 		void set_var(const string& name, const string& value);
@@ -50,7 +59,8 @@ namespace iTease {
 
 		auto get_web_template()->shared_ptr<WebTemplateFile> { return m_template; }
 
-		auto request(JS::Context&, const ServerRequest& request, ServerResponse& response)->bool;
+		// renders the controller's page, timing each render into renderTime
+		auto request(JS::Context&, const ServerRequest& request, ServerResponse& response, Metrics::Histogram& renderTime)->bool;
 
 	protected:
 		shared_ptr<WebTemplateFile> m_template;
@@ -90,7 +100,7 @@ namespace iTease {
 
 	class WebRequest {
 	public:
-		WebRequest(const ServerRequest& req) : m_request(req)
+		WebRequest(const ServerRequest& req, RouteParams routeParams = {}) : m_request(req), m_routeParams(std::move(routeParams))
 		{ }
 
 		virtual ~WebRequest() { }
@@ -99,31 +109,105 @@ namespace iTease {
 		static constexpr const char* JSName = "\xff""\xff""WebRequest";
 
 		void prototype(JS::Context& js);
+		// pushes the object of the request's values of the named kind, built the first time it's asked for
+		int push_values(JS::Context& js, const char* name);
+		auto& request() const { return m_request; }
 
 	protected:
 		ServerRequest m_request;
+		RouteParams m_routeParams;
+	};
+
+	class WebSocketJS {
+	public:
+		WebSocketJS(shared_ptr<WebSocket> socket) : m_socket(std::move(socket))
+		{ }
+
+	public:
+		static constexpr const char* JSName = "\xff""\xff""WebSocket";
+
+		void prototype(JS::Context& js);
+		auto& socket() const { return m_socket; }
+
+	protected:
+		shared_ptr<WebSocket> m_socket;
+	};
+
+	class UploadedFileJS {
+	public:
+		UploadedFileJS(shared_ptr<UploadedFile> file) : m_file(std::move(file))
+		{ }
+
+	public:
+		static constexpr const char* JSName = "\xff""\xff""UploadedFile";
+
+		void prototype(JS::Context& js);
+		auto& file() const { return m_file; }
+
+	protected:
+		// keeps the temporary file for as long as the script holds the handle
+		shared_ptr<UploadedFile> m_file;
 	};
 
 	class Web : public Module {
 	public:
 		Web(Application&);
+		virtual void init_module(Application&) override;
 		virtual void init_js(JS::Context&) override;
 
 		void add_controller(shared_ptr<WebController>);
 		void add_listener(Server::OnRequestEvent::Handler);
+		// routes for the calling worker's context, or the main context's
+		void add_route(const string& method, const string& pattern, Router::Handler);
 		WebResponse create_static_response(const fs::path& path);
+		// serves a file response from the static cache, adding its validators
+		void apply_static_cache(ServerResponse&);
 
 	private:
+		// answers requests for files under web/, with 304s for fresh validators
+		bool serve_static_file(const ServerRequest&, ServerResponse&);
+		// returns true if a file under web/ or a bundle answers the URI
+		bool is_static_uri(const string& uri);
+		// turns the value a JS handler left on the stack into the response, popping it
+		bool js_response(JS::Context&, const ServerRequest&, ServerResponse&);
 		int create_static_response_js(JS::Context&);
 		int add_controller_js(JS::Context&);
 		int add_listener_js(JS::Context&);
+		int add_route_js(JS::Context&);
+		int push_js(JS::Context&);
+		int open_update_js(JS::Context&);
+		int set_update_js(JS::Context&);
+		int collect_updates_js(JS::Context&);
+		int prepare_updates_js(JS::Context&);
+		int add_socket_js(JS::Context&);
+		int broadcast_js(JS::Context&);
+		// answers a WebSocket handshake, returns false if the request isn't one
+		bool accept_websocket(const ServerRequest&, ServerResponse&);
 		int is_static_file_js(JS::Context&);
+		int bundle_js(JS::Context&);
 		void add_block_controller_js(JS::Context&, const string& name, const JS::VariantMap& block);
 
 	private:
 		Application& m_app;
 		vector<shared_ptr<WebController>> m_controllers;
 		vector<Server::OnRequestEvent::Listener> m_serverRequestListeners;
+		vector<Router::Route> m_routes;
+		Router::Route m_staticRoute;
+		Router::Route m_eventsRoute;
+		Router::Route m_metricsRoute;
+		Router::Route m_bundleRoute;
+		Router::Route m_updateRoute;
+		Router::Route m_updatesRoute;
+		Metrics::Histogram& m_renderTime;
+		WebSocketHub m_sockets;
+		Event<>::Listener m_serverStop;
+		Event<const string&>::Listener m_staticLookup;
+		StaticCache m_staticCache;
+		// parsed templates shared by every TemplateFile of the same path
+		TemplateCache m_templateCache;
+		AssetBundler m_bundler{m_staticCache};
+		// updates of controller pages, shared by every worker's context
+		PageUpdates m_updates;
 	};
 
 
@@ -143,11 +227,11 @@ namespace iTease {
 				js.push_object();
 				for (auto var : node.vars()) {
 					auto name = var->name();
-					js.put_property(-1, Property<string>{var->name(), JS::Function{[var](JS::Context& js)->duk_ret_t {
-						js.push(var->value());
+					js.put_property(-1, Property<string>{name, JS::Function{[blockptr, name](JS::Context& js)->duk_ret_t {
+						js.push(Templating::Overlay::var_value(*blockptr, name));
 						return 1;
-					}, 0}, JS::Function{[blockptr, var](JS::Context& js)->duk_ret_t {
-						blockptr->set_var(var->name(), js.get<string>(0));
+					}, 0}, JS::Function{[blockptr, name](JS::Context& js)->duk_ret_t {
+						Templating::Overlay::assign_var(*blockptr, name, js.get<string>(0));
 						return 0;
 					}, 1}});
 				}
@@ -158,7 +242,7 @@ namespace iTease {
 					auto name = sub_block->name();
 					blockNames.push_back(name);
 					js.put_property(-1, Property<JS::Shared<Templating::Block>>{name, JS::Function{[sub_block](JS::Context& js)->duk_ret_t {
-						js.push(JS::Shared<Templating::Block>{sub_block});
+						js_push_block(js, sub_block);
 						return 1;
 					}, 0}, JS::Function{[sub_block](JS::Context& js)->duk_ret_t {
 						auto obj = js.get<Object>(0);
@@ -193,30 +277,36 @@ namespace iTease {
 					Property<string>{"path", block.path()},
 					Property<bool>{"enabled", JS::Function{[blockptr](JS::Context& js)->int {
 						//js.push<bool>(js.self<Shared<Templating::Block>>()->enabled());
-						js.push<bool>(blockptr->enabled());
+						js.push<bool>(Templating::Overlay::is_enabled(*blockptr));
 						return 1;
 					}, 0}, JS::Function{[blockptr](JS::Context& js)->int {
 						//js.self<Shared<Templating::Block>>()->enable(js.get<bool>(0));
-						blockptr->enable(js.get<bool>(0));
+						Templating::Overlay::assign_enabled(*blockptr, js.get<bool>(0));
 						return 0;
 					}, 1}},
 					Property<JS::Undefined>{"vars", JS::Function{[blockptr](JS::Context& js)->duk_ret_t {
-						if (blockptr->array_size()) {
+						auto& entries = Templating::Overlay::array_of(*blockptr);
+						if (entries.size()) {
 							js.push(JS::Array{ });
-							for (size_t i = 0; i < blockptr->array_size(); ++i) {
+							for (size_t i = 0; i < entries.size(); ++i) {
 								js.push_object();
-								auto& arr = blockptr->get_array()[i];
+								auto& arr = entries[i];
 								for (auto& pr : arr) {
 									auto name = pr.first;
 									js.put_property(-1, Property<string>{pr.first, JS::Function{[blockptr, name, i](JS::Context& js)->duk_ret_t {
-										auto& arr = blockptr->get_array();
-										if (arr.size() <= i) arr.resize(i + 1);
-										js.push(blockptr->get_array()[i][name]);
+										auto& arr = Templating::Overlay::array_of(*blockptr);
+										string value;
+										if (arr.size() > i) {
+											auto it = arr[i].find(name);
+											if (it != arr[i].end()) value = it->second;
+										}
+										js.push(value);
 										return 1;
 									}, 0}, JS::Function{[blockptr, name, i](JS::Context& js)->duk_ret_t {
-										auto& arr = blockptr->get_array();
+										auto arr = Templating::Overlay::array_of(*blockptr);
 										if (arr.size() <= i) arr.resize(i + 1);
 										arr[i][name] = js.get<string>(0);
+										Templating::Overlay::assign_array(*blockptr, std::move(arr));
 										return 0;
 									}, 1}});
 								}
@@ -227,11 +317,11 @@ namespace iTease {
 							js.push_object();
 							for (auto var : blockptr->vars()) {
 								auto name = var->name();
-								js.put_property(-1, Property<string>{var->name(), JS::Function{[var](JS::Context& js)->duk_ret_t {
-									js.push(var->value());
+								js.put_property(-1, Property<string>{name, JS::Function{[blockptr, name](JS::Context& js)->duk_ret_t {
+									js.push(Templating::Overlay::var_value(*blockptr, name));
 									return 1;
-								}, 0}, JS::Function{[blockptr, var](JS::Context& js)->duk_ret_t {
-									blockptr->set_var(var->name(), js.get<string>(0));
+								}, 0}, JS::Function{[blockptr, name](JS::Context& js)->duk_ret_t {
+									Templating::Overlay::assign_var(*blockptr, name, js.get<string>(0));
 									return 0;
 								}, 1}});
 							}
@@ -252,12 +342,12 @@ namespace iTease {
 									}
 								}
 							}
-							blockptr->set_array(arr);
+							Templating::Overlay::assign_array(*blockptr, std::move(arr));
 						}
 						else {
 							auto obj = js.get<Object>(0);
 							for (auto& var : obj) {
-								blockptr->set_var(var.first, convert_any_to_string(var.second));
+								Templating::Overlay::assign_var(*blockptr, var.first, convert_any_to_string(var.second));
 							}
 						}
 						return 0;
@@ -286,6 +376,9 @@ namespace iTease {
 					Property<string>{"content_type", wr.response.content_type},
 					Property<int>{"status", wr.response.status}
 				);
+				// file backed responses carry their path back to the server untouched
+				if (!wr.response.file.empty())
+					js.put_property(-1, Property<string>{"file", wr.response.file});
 			}
 			static bool is(Context& js, int idx) {
 				return js.is<Object>(idx) && js.has_property(idx, "content") && js.has_property(idx, "content_type") && js.has_property(idx, "status");
@@ -295,6 +388,8 @@ namespace iTease {
 				resp.content = js.get_property<string>(idx, "content");
 				resp.content_type = js.get_property<string>(idx, "content_type");
 				resp.status = js.get_property<int>(idx, "status");
+				if (js.has_property(idx, "file"))
+					resp.file = js.get_property<string>(idx, "file");
 				return resp;
 			}
 		};
@@ -0,0 +1,476 @@
+#include "stdinc.h"
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include "websocket.h"
+#include "application.h"
+#include "reactor.h"
+
+using namespace iTease;
+
+// messages above this are refused with 1009, rather than buffered, text which isn't UTF-8 with 1007
+constexpr size_t MaxMessageSize = 1024 * 1024; // 1MB
+// sends are refused while this much is still waiting for the client to read it
+constexpr size_t MaxBufferedAmount = 4 * 1024 * 1024; // 4MB
+constexpr size_t ReadChunkSize = 16 * 1024;
+// an idle connection is pinged, and dropped if the client stays silent
+constexpr auto PingInterval = std::chrono::seconds(30);
+constexpr auto IdleTimeout = std::chrono::seconds(75);
+// how long a client gets to answer our close frame
+constexpr auto CloseTimeout = std::chrono::seconds(5);
+// sockets are polled this often without a reactor, and checked for pings and pending writes with one
+constexpr long long HubTickInterval = 20;
+constexpr const char* HandshakeGUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+constexpr uint8_t OpContinuation = 0x0;
+constexpr uint8_t OpText = 0x1;
+constexpr uint8_t OpBinary = 0x2;
+constexpr uint8_t OpClose = 0x8;
+constexpr uint8_t OpPing = 0x9;
+constexpr uint8_t OpPong = 0xA;
+
+constexpr uint16_t CloseNormal = 1000;
+constexpr uint16_t CloseGoingAway = 1001;
+constexpr uint16_t CloseProtocolError = 1002;
+constexpr uint16_t CloseNoStatus = 1005;
+constexpr uint16_t CloseAbnormal = 1006;
+constexpr uint16_t CloseInvalidData = 1007;
+constexpr uint16_t CloseTooBig = 1009;
+
+// true for well-formed UTF-8, without overlong forms, surrogates or code points past U+10FFFF
+static auto is_utf8(string_view text)->bool {
+	auto p = reinterpret_cast<const uint8_t*>(text.data());
+	auto end = p + text.size();
+	while (p < end) {
+		auto c = *p++;
+		if (c < 0x80) continue;
+		size_t extra;
+		uint32_t cp;
+		if (c >= 0xc2 && c <= 0xdf) extra = 1, cp = c & 0x1f;
+		else if (c >= 0xe0 && c <= 0xef) extra = 2, cp = c & 0x0f;
+		else if (c >= 0xf0 && c <= 0xf4) extra = 3, cp = c & 0x07;
+		else return false;
+		if (static_cast<size_t>(end - p) < extra) return false;
+		for (size_t i = 0; i < extra; ++i, ++p) {
+			if ((*p & 0xc0) != 0x80) return false;
+			cp = (cp << 6) | (*p & 0x3f);
+		}
+		if ((extra == 2 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff))) || (extra == 3 && (cp < 0x10000 || cp > 0x10ffff)))
+			return false;
+	}
+	return true;
+}
+static auto set_nonblocking(SocketHandle socket)->void {
+	#ifdef _WIN32
+	u_long mode = 1;
+	ioctlsocket(socket, FIONBIO, &mode);
+	#else
+	fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+	#endif
+}
+static auto would_block()->bool {
+	#ifdef _WIN32
+	auto err = WSAGetLastError();
+	return err == WSAEWOULDBLOCK || err == WSAEINTR;
+	#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	#endif
+}
+
+auto iTease::websocket_accept_key(const string& key)->string {
+	auto str = key + HandshakeGUID;
+	unsigned char hash[SHA_DIGEST_LENGTH];
+	SHA1(reinterpret_cast<const unsigned char*>(str.data()), str.size(), hash);
+	// 20 bytes encode to 28 characters and a terminator
+	char out[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+	EVP_EncodeBlock(reinterpret_cast<unsigned char*>(out), hash, SHA_DIGEST_LENGTH);
+	return out;
+}
+
+WebSocket::WebSocket(string session, SocketHandle socket, string extra, ReleaseFunction release) :
+	m_session(std::move(session)), m_socket(socket), m_release(std::move(release)), m_in(std::move(extra)),
+	m_lastActivity(std::chrono::steady_clock::now())
+{
+	set_nonblocking(m_socket);
+}
+WebSocket::~WebSocket() {
+	release();
+}
+auto WebSocket::state()->State {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_state;
+}
+auto WebSocket::buffered_amount()->size_t {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_out.size() - m_outOffset;
+}
+auto WebSocket::send(string_view data, bool binary)->bool {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_state != State::Open || m_out.size() - m_outOffset > MaxBufferedAmount)
+		return false;
+	queue_frame(binary ? OpBinary : OpText, data);
+	write_some();
+	return true;
+}
+auto WebSocket::close(uint16_t code, string_view reason)->void {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_state != State::Open)
+		return;
+	string payload;
+	payload += static_cast<char>(code >> 8);
+	payload += static_cast<char>(code & 0xff);
+	// control frames are limited to 125 bytes
+	payload.append(reason.substr(0, 123));
+	queue_frame(OpClose, payload);
+	m_state = State::Closing;
+	m_closeCode = code;
+	m_closeReason = string(reason);
+	m_closeDeadline = std::chrono::steady_clock::now() + CloseTimeout;
+	write_some();
+}
+auto WebSocket::on_readable()->void {
+	char buf[ReadChunkSize];
+	for (;;) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_state == State::Closed || !m_release)
+				return;
+		}
+		// what's already buffered (e.g. read by MHD along with the handshake) goes first
+		parse();
+		auto n = recv(m_socket, buf, static_cast<int>(sizeof(buf)), 0);
+		if (n > 0) {
+			m_in.append(buf, static_cast<size_t>(n));
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_lastActivity = std::chrono::steady_clock::now();
+			m_pingSent = false;
+			continue;
+		}
+		if (n < 0 && would_block())
+			return;
+		// the client went away without a closing handshake
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_state == State::Open)
+			m_closeCode = CloseAbnormal;
+		m_state = State::Closed;
+		m_out.clear();
+		m_outOffset = 0;
+		return;
+	}
+}
+auto WebSocket::flush()->bool {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	write_some();
+	return m_outOffset < m_out.size();
+}
+auto WebSocket::check(std::chrono::steady_clock::time_point now)->void {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_state == State::Open) {
+		auto idle = now - m_lastActivity;
+		if (idle > IdleTimeout) {
+			m_state = State::Closed;
+			m_closeCode = CloseAbnormal;
+		}
+		else if (idle > PingInterval && !m_pingSent) {
+			queue_frame(OpPing, "");
+			m_pingSent = true;
+			write_some();
+		}
+	}
+	else if (m_state == State::Closing && now > m_closeDeadline)
+		m_state = State::Closed;
+}
+auto WebSocket::release()->void {
+	ReleaseFunction release;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_state = State::Closed;
+		release = std::move(m_release);
+		m_release = nullptr;
+	}
+	if (release) release();
+}
+auto WebSocket::parse()->void {
+	size_t pos = 0;
+	for (;;) {
+		if (state() == State::Closed)
+			break;
+		auto avail = m_in.size() - pos;
+		if (avail < 2) break;
+		auto p = reinterpret_cast<const uint8_t*>(m_in.data() + pos);
+		bool fin = (p[0] & 0x80) != 0;
+		uint8_t opcode = p[0] & 0x0f;
+		uint64_t length = p[1] & 0x7f;
+		size_t header = 2;
+		if (length == 126) {
+			if (avail < 4) break;
+			length = (uint64_t(p[2]) << 8) | p[3];
+			header = 4;
+		}
+		else if (length == 127) {
+			if (avail < 10) break;
+			length = 0;
+			for (int i = 0; i < 8; ++i)
+				length = (length << 8) | p[2 + i];
+			header = 10;
+		}
+		// no extensions were negotiated, and clients must mask everything they send
+		if ((p[0] & 0x70) || !(p[1] & 0x80))
+			return fail(CloseProtocolError);
+		if ((opcode & 0x8) && (length > 125 || !fin))
+			return fail(CloseProtocolError);
+		// refused before it's buffered, control frames may come between fragments and don't count towards the message
+		if (!(opcode & 0x8) && (length > MaxMessageSize || m_message.size() + length > MaxMessageSize))
+			return fail(CloseTooBig);
+		header += 4;
+		if (avail < header + length) break;
+
+		auto mask = p + header - 4;
+		string payload(m_in.data() + pos + header, static_cast<size_t>(length));
+		for (size_t i = 0; i < payload.size(); ++i)
+			payload[i] ^= mask[i & 3];
+		pos += header + static_cast<size_t>(length);
+		handle_frame(opcode, fin, std::move(payload));
+	}
+	m_in.erase(0, pos);
+}
+auto WebSocket::handle_frame(uint8_t opcode, bool fin, string payload)->void {
+	switch (opcode) {
+	case OpContinuation:
+		if (!m_messageOpcode)
+			return fail(CloseProtocolError);
+		m_message += payload;
+		break;
+	case OpText:
+	case OpBinary:
+		if (m_messageOpcode)
+			return fail(CloseProtocolError);
+		m_messageOpcode = opcode;
+		m_message = std::move(payload);
+		break;
+	case OpClose: {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_state == State::Open) {
+			m_closeCode = payload.size() >= 2 ? static_cast<uint16_t>((uint8_t(payload[0]) << 8) | uint8_t(payload[1])) : CloseNoStatus;
+			m_closeReason = payload.size() > 2 ? payload.substr(2) : "";
+			// echo the code, the connection is closed once it's written
+			queue_frame(OpClose, payload.substr(0, 2));
+			write_some();
+		}
+		m_state = State::Closed;
+		return;
+	}
+	case OpPing: {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_state != State::Closed) {
+			queue_frame(OpPong, payload);
+			write_some();
+		}
+		return;
+	}
+	case OpPong:
+		return;
+	default:
+		return fail(CloseProtocolError);
+	}
+	if (fin) {
+		auto binary = m_messageOpcode == OpBinary;
+		auto message = std::move(m_message);
+		m_message.clear();
+		m_messageOpcode = 0;
+		if (!binary && !is_utf8(message))
+			return fail(CloseInvalidData);
+		if (on_message) on_message(message, binary);
+	}
+}
+auto WebSocket::fail(uint16_t code)->void {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_state == State::Open) {
+		string payload;
+		payload += static_cast<char>(code >> 8);
+		payload += static_cast<char>(code & 0xff);
+		queue_frame(OpClose, payload);
+		write_some();
+		m_closeCode = code;
+	}
+	m_state = State::Closed;
+	m_in.clear();
+}
+auto WebSocket::queue_frame(uint8_t opcode, string_view payload)->void {
+	// written frames are dropped from the front once the buffer is half consumed
+	if (m_outOffset && m_outOffset >= m_out.size() / 2) {
+		m_out.erase(0, m_outOffset);
+		m_outOffset = 0;
+	}
+	m_out += static_cast<char>(0x80 | opcode);
+	auto length = payload.size();
+	if (length < 126)
+		m_out += static_cast<char>(length);
+	else if (length <= 0xffff) {
+		m_out += static_cast<char>(126);
+		m_out += static_cast<char>(length >> 8);
+		m_out += static_cast<char>(length & 0xff);
+	}
+	else {
+		m_out += static_cast<char>(127);
+		for (int i = 7; i >= 0; --i)
+			m_out += static_cast<char>((uint64_t(length) >> (i * 8)) & 0xff);
+	}
+	m_out.append(payload);
+}
+auto WebSocket::write_some()->void {
+	while (m_outOffset < m_out.size() && m_release) {
+		#ifdef _WIN32
+		auto n = ::send(m_socket, m_out.data() + m_outOffset, static_cast<int>(m_out.size() - m_outOffset), 0);
+		#else
+		auto n = ::send(m_socket, m_out.data() + m_outOffset, m_out.size() - m_outOffset, MSG_NOSIGNAL);
+		#endif
+		if (n > 0) {
+			m_outOffset += static_cast<size_t>(n);
+			continue;
+		}
+		if (n < 0 && would_block())
+			return;
+		// the client can't be written to any more, drop what's left
+		if (m_state == State::Open)
+			m_closeCode = CloseAbnormal;
+		m_state = State::Closed;
+		m_out.clear();
+		m_outOffset = 0;
+		return;
+	}
+	if (m_outOffset == m_out.size()) {
+		m_out.clear();
+		m_outOffset = 0;
+	}
+}
+
+WebSocketHub::WebSocketHub(Application& app) : m_app(app) {
+	m_onTick = m_app.add_interval_callback(HubTickInterval, [this](long long&) {
+		tick();
+		return 1;
+	});
+}
+WebSocketHub::~WebSocketHub() {
+	stop();
+}
+auto WebSocketHub::add(shared_ptr<WebSocket> socket, OpenHandler open)->void {
+	std::lock_guard<std::recursive_mutex> lock(m_mutex);
+	m_slots.push_back(Slot{std::move(socket), std::move(open)});
+	// opened on the next tick, which runs with the JS contexts locked
+}
+auto WebSocketHub::sockets(const string& session)->vector<shared_ptr<WebSocket>> {
+	vector<shared_ptr<WebSocket>> sockets;
+	std::lock_guard<std::recursive_mutex> lock(m_mutex);
+	for (auto& slot : m_slots) {
+		if ((session.empty() || slot.socket->session() == session) && slot.socket->is_open())
+			sockets.push_back(slot.socket);
+	}
+	return sockets;
+}
+auto WebSocketHub::stop()->void {
+	m_onTick.reset();
+	std::lock_guard<std::recursive_mutex> lock(m_mutex);
+	for (auto& slot : m_slots) {
+		#ifdef __linux__
+		if (slot.events && m_app.reactor())
+			m_app.reactor()->unwatch(static_cast<int>(slot.socket->socket()));
+		#endif
+		slot.socket->on_message = nullptr;
+		slot.socket->on_close = nullptr;
+		slot.socket->close(CloseGoingAway);
+		slot.socket->release();
+	}
+	m_slots.clear();
+}
+auto WebSocketHub::service(const shared_ptr<WebSocket>& socket)->void {
+	OpenHandler open;
+	{
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		auto it = std::find_if(m_slots.begin(), m_slots.end(), [&](auto& slot) { return slot.socket == socket; });
+		if (it == m_slots.end())
+			return;
+		open = std::move(it->open);
+		it->open = nullptr;
+	}
+	if (open) open(socket);
+	socket->on_readable();
+	auto pending = socket->flush();
+	if (socket->state() == WebSocket::State::Closed && !pending) {
+		finish(socket);
+		return;
+	}
+	#ifdef __linux__
+	if (m_app.reactor()) {
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		auto it = std::find_if(m_slots.begin(), m_slots.end(), [&](auto& slot) { return slot.socket == socket; });
+		if (it != m_slots.end()) watch(*it);
+	}
+	#endif
+}
+auto WebSocketHub::tick()->void {
+	vector<pair<shared_ptr<WebSocket>, uint32_t>> sockets;
+	{
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		for (auto& slot : m_slots)
+			sockets.emplace_back(slot.socket, slot.open ? 0 : slot.events);
+	}
+	auto now = std::chrono::steady_clock::now();
+	for (auto& entry : sockets) {
+		auto& socket = entry.first;
+		socket->check(now);
+		#ifdef __linux__
+		// a watched socket is serviced when it's ready, idle ones cost nothing here beyond the check
+		if (entry.second && socket->state() == WebSocket::State::Open && (!socket->buffered_amount() || (entry.second & EPOLLOUT)))
+			continue;
+		#endif
+		// new, closing and backed up sockets, or all of them without a reactor
+		service(socket);
+	}
+}
+auto WebSocketHub::watch(Slot& slot)->void {
+	#ifdef __linux__
+	auto fd = static_cast<int>(slot.socket->socket());
+	uint32_t events = EPOLLIN;
+	if (slot.socket->buffered_amount()) events |= EPOLLOUT;
+	if (events == slot.events)
+		return;
+	std::weak_ptr<WebSocket> weak = slot.socket;
+	m_app.reactor()->watch(fd, events, [this, weak](uint32_t) {
+		if (auto socket = weak.lock()) {
+			// message handlers call into JS, so they exclude the request workers like ticks do
+			auto lock = m_app.lock_js();
+			service(socket);
+		}
+	});
+	slot.events = events;
+	#endif
+}
+auto WebSocketHub::finish(const shared_ptr<WebSocket>& socket)->void {
+	{
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		auto it = std::find_if(m_slots.begin(), m_slots.end(), [&](auto& slot) { return slot.socket == socket; });
+		if (it == m_slots.end())
+			return;
+		#ifdef __linux__
+		if (it->events && m_app.reactor())
+			m_app.reactor()->unwatch(static_cast<int>(socket->socket()));
+		#endif
+		m_slots.erase(it);
+	}
+	auto onClose = std::move(socket->on_close);
+	// handlers may hold JS callbacks which refer back to the socket, dropping them breaks the cycle
+	socket->on_close = nullptr;
+	socket->on_message = nullptr;
+	socket->release();
+	if (onClose) onClose(socket->close_code(), socket->close_reason());
+}
\ No newline at end of file
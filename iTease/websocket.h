@@ -0,0 +1,140 @@
+#pragma once
+#include <chrono>
+#include <mutex>
+#include "common.h"
+#include "event.h"
+
+namespace iTease {
+	class Application;
+
+	#ifdef _WIN32
+	using SocketHandle = uintptr_t;
+	#else
+	using SocketHandle = int;
+	#endif
+
+	// returns the Sec-WebSocket-Accept value answering a handshake's Sec-WebSocket-Key
+	extern auto websocket_accept_key(const string& key)->string;
+
+	/**
+	 * WebSocket - an RFC 6455 connection over a socket upgraded from HTTP
+	 * Frames are parsed and written natively, pings are answered, and sends beyond MaxBufferedAmount are refused
+	**/
+	class WebSocket {
+	public:
+		// returns the socket to the server, which closes it
+		using ReleaseFunction = std::function<void()>;
+
+		enum class State : int {
+			Open,
+			// our close frame was sent, waiting for the client's
+			Closing,
+			// finished, the socket is released once everything queued is written
+			Closed
+		};
+
+		WebSocket(string session, SocketHandle socket, string extra, ReleaseFunction release);
+		~WebSocket();
+		WebSocket(const WebSocket&) = delete;
+		auto operator=(const WebSocket&)->WebSocket& = delete;
+
+		auto& session() const { return m_session; }
+		auto socket() const { return m_socket; }
+		auto state()->State;
+		auto is_open() { return state() == State::Open; }
+		// number of bytes queued but not yet written to the socket
+		auto buffered_amount()->size_t;
+		auto close_code() const { return m_closeCode; }
+		auto& close_reason() const { return m_closeReason; }
+
+		// queues a message, returns false if the socket isn't open or too much is buffered already
+		auto send(string_view data, bool binary = false)->bool;
+		// starts the closing handshake
+		auto close(uint16_t code = 1000, string_view reason = "")->void;
+		// reads and handles whatever the client sent, firing on_message for complete messages
+		auto on_readable()->void;
+		// writes as much as possible of what's queued, returns true if anything is left
+		auto flush()->bool;
+		// pings idle connections and gives up on unresponsive ones, called periodically
+		auto check(std::chrono::steady_clock::time_point now)->void;
+		// hands the socket back to the server, may be called more than once
+		auto release()->void;
+
+		// called with each complete message, on the thread servicing the socket
+		std::function<void(const string& data, bool binary)> on_message;
+		// called once the connection is finished, on the thread servicing the socket
+		std::function<void(uint16_t code, const string& reason)> on_close;
+
+	private:
+		auto parse()->void;
+		auto handle_frame(uint8_t opcode, bool fin, string payload)->void;
+		// sends a close frame with the code and finishes
+		auto fail(uint16_t code)->void;
+		// these expect m_mutex to be held
+		auto queue_frame(uint8_t opcode, string_view payload)->void;
+		auto write_some()->void;
+
+	private:
+		std::mutex m_mutex;
+		string m_session;
+		SocketHandle m_socket;
+		ReleaseFunction m_release;
+		State m_state = State::Open;
+		// read side, only touched by the thread servicing the socket
+		string m_in;
+		string m_message;
+		uint8_t m_messageOpcode = 0;
+		// write side, shared with senders on other threads
+		string m_out;
+		size_t m_outOffset = 0;
+		uint16_t m_closeCode = 1005;
+		string m_closeReason;
+		std::chrono::steady_clock::time_point m_lastActivity;
+		std::chrono::steady_clock::time_point m_closeDeadline;
+		bool m_pingSent = false;
+	};
+
+	/**
+	 * WebSocketHub - services every open WebSocket, delivering their events to JS
+	 * Sockets are watched by the application's reactor where there is one, and polled from a tick otherwise
+	 * Handlers run with the JS contexts locked, like network completions do
+	**/
+	class WebSocketHub {
+	public:
+		// called once the socket is serviced, before any of its messages
+		using OpenHandler = std::function<void(const shared_ptr<WebSocket>&)>;
+
+		WebSocketHub(Application&);
+		~WebSocketHub();
+		WebSocketHub(const WebSocketHub&) = delete;
+		auto operator=(const WebSocketHub&)->WebSocketHub& = delete;
+
+		// takes over a socket which was just upgraded, may be called from any thread
+		auto add(shared_ptr<WebSocket>, OpenHandler)->void;
+		// returns the open sockets of a session, or of every session if it's empty
+		auto sockets(const string& session)->vector<shared_ptr<WebSocket>>;
+		// closes and releases every socket and stops servicing them, before the server closes their connections
+		auto stop()->void;
+
+	private:
+		struct Slot {
+			shared_ptr<WebSocket> socket;
+			OpenHandler open;
+			// events the reactor watches the socket for, 0 if it isn't watched
+			uint32_t events = 0;
+		};
+
+		// reads, writes and finishes the socket, with the JS contexts locked
+		auto service(const shared_ptr<WebSocket>&)->void;
+		// pings and times out sockets, and services those the reactor doesn't watch or needs to watch differently
+		auto tick()->void;
+		auto watch(Slot&)->void;
+		auto finish(const shared_ptr<WebSocket>&)->void;
+
+	private:
+		Application& m_app;
+		std::recursive_mutex m_mutex;
+		vector<Slot> m_slots;
+		Event<long long&>::Listener m_onTick;
+	};
+}
\ No newline at end of file